@@ -0,0 +1,721 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define BENCH_QUEUE_DURATION_MS  1000   // Length of each run of the event queue benchmark
+#define BENCH_QUEUE_SERVICE_NS   25000  // Time the consumer spends on every popped event (40k events/s)
+#define BENCH_QUEUE_HIGH_NS      20000  // Arrival period of PRIORITY_HIGH events (50k events/s, more than can be served)
+#define BENCH_QUEUE_OTHER_NS     1000000    // Arrival period of PRIORITY_MED and PRIORITY_LOW events
+#define BENCH_QUEUE_AGING_MS     5
+#define BENCH_QUEUE_MAX_WAIT_MS  20
+#define BENCH_QUEUE_CAPACITY     256
+#define BENCH_QUEUE_SOURCES      16     // Distinct systems the benchmark's events claim to come from, for merging
+#define BENCH_PLACEMENT_DURATION_MS 2000    // Length of each threaded run of the placement benchmark
+#define BENCH_PLACEMENT_SYSTEMS  40     // Size of the generated scenario run alongside the sample rocket
+#define BENCH_PLACEMENT_RESOURCES 8
+#define BENCH_DISPATCH_DURATION_MS 1000 // Length of each run of the dispatch benchmark
+#define BENCH_DISPATCH_SYSTEMS   4000   // Every handled event scans the systems for the resource's producers
+#define BENCH_DISPATCH_RESOURCES 64
+#define BENCH_DISPATCH_PRODUCERS 4      // Threads pushing events, each for its own share of the resources
+#define BENCH_DISPATCH_CAPACITY  1024   // Events each queue holds before producers block
+#define BENCH_SLOTMAP_SYSTEMS    100000 // Systems iterated by the slot map benchmark
+#define BENCH_SLOTMAP_PASSES     100    // Passes over every system per measurement
+#define BENCH_HOTSWAP_ROUNDS     20     // Times the hot swap runs add and remove their systems
+#define BENCH_HOTSWAP_ROUND_MS   40     // Time the added systems run before they are removed
+#define BENCH_STATS_SYSTEMS      400    // Size of the generated scenario run alongside the sample rocket
+#define BENCH_STATS_RESOURCES    40
+#define BENCH_STATS_SIMULATED_MS (10 * 60 * 1000)   // Virtual time each run of the statistics benchmark lasts at most
+#define BENCH_STATS_RUN_MS       300    // Wall time of runs per setting in each comparison
+#define BENCH_STATS_REPEATS      5      // Comparisons, of which the median is reported
+
+// One way of configuring the queue, run under the same load as the others
+typedef struct BenchQueueMode {
+    const char *name;
+    long long aging_ns;
+    long long max_wait_ns;
+    int capacity;
+    int overflow_policy;
+} BenchQueueMode;
+
+// One thread pushing watermark events as fast as the queues take them
+typedef struct BenchProducer {
+    Manager *manager;
+    int index;          // Pushes events about every resource whose position modulo BENCH_DISPATCH_PRODUCERS is this
+    int stop;           // Set to end the thread
+    pthread_t thread;
+} BenchProducer;
+
+// Helper functions just used by this C file
+static void bench_queue_run(const BenchQueueMode *mode, FILE *stream);
+static void bench_spin_until(long long deadline_ns);
+static const char *bench_priority_name(int priority);
+static void bench_placement_run(const char *scenario, int pinned, FILE *stream, long long *transfers, long long *changes);
+static long long bench_dispatch_run(int worker_count, FILE *stream);
+static void *bench_dispatch_producer(void *arg);
+static void bench_slot_map_iterate(const char *name, void **items, const SlotMap *map, const Handle *handles, int count, FILE *stream);
+static int bench_hot_swap_run(const char *name, int threaded, int worker_count, FILE *stream);
+static void bench_hot_swap_wait(Manager *manager, int threaded, int duration_ms);
+static double bench_stats_run(const char *scenario, int timed, long long *changes, long long *events);
+
+/**
+ * Measures per-priority queueing delay of the `EventQueue` under an adversarial load.
+ *
+ * PRIORITY_HIGH events arrive faster than the consumer can pop them, so the queue is never free of them,
+ * while a trickle of PRIORITY_MED and PRIORITY_LOW events arrives alongside. With strict priority order
+ * the lower priorities starve; aging and deadlines should bound their delay. The load is driven from a
+ * single thread (arrivals are pushed as they come due between pops) so the result doesn't depend on
+ * how many cores are free.
+ *
+ * @param[in] stream  Stream to print the results to.
+ * @return            Non-zero once every mode has run.
+ */
+int bench_event_queue(FILE *stream) {
+    const BenchQueueMode modes[] = {
+        {"strict priority", 0, 0, 0, OVERFLOW_DROP},
+        {"aging", BENCH_QUEUE_AGING_MS * 1000000LL, 0, 0, OVERFLOW_DROP},
+        {"aging + deadline", BENCH_QUEUE_AGING_MS * 1000000LL, BENCH_QUEUE_MAX_WAIT_MS * 1000000LL, 0, OVERFLOW_DROP},
+        {"bounded, drop", BENCH_QUEUE_AGING_MS * 1000000LL, BENCH_QUEUE_MAX_WAIT_MS * 1000000LL, BENCH_QUEUE_CAPACITY, OVERFLOW_DROP},
+        {"bounded, merge", BENCH_QUEUE_AGING_MS * 1000000LL, BENCH_QUEUE_MAX_WAIT_MS * 1000000LL, BENCH_QUEUE_CAPACITY, OVERFLOW_MERGE},
+    };
+
+    fprintf(stream, "Event queue under adversarial load: %d ms per mode, HIGH every %dus, MED/LOW every %dus, %dus per pop\n",
+            BENCH_QUEUE_DURATION_MS, BENCH_QUEUE_HIGH_NS / 1000, BENCH_QUEUE_OTHER_NS / 1000, BENCH_QUEUE_SERVICE_NS / 1000);
+    fprintf(stream, "Aging %dms per priority level, deadline %dms for MED/LOW where enabled, bounded queues hold %d events\n",
+            BENCH_QUEUE_AGING_MS, BENCH_QUEUE_MAX_WAIT_MS, BENCH_QUEUE_CAPACITY);
+    fprintf(stream, "(OVERFLOW_BLOCK needs a separate consumer thread, so it isn't run here)\n\n");
+
+    for (int i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++) {
+        bench_queue_run(&modes[i], stream);
+    }
+
+    return 1;
+}
+
+/**
+ * Counts how often resources move between CPU caches when system threads are pinned by cluster, and when not.
+ *
+ * The sample rocket and a generated scenario each run on threads in real time, once left to the scheduler
+ * and once with `--pin`. Every change of a resource's amount made on a different CPU than the change
+ * before it had to move the resource's cache line, which is what `cpu_transfers` counts; a lower count
+ * for the same number of changes is what pinning clusters to neighbouring CPUs buys.
+ *
+ * @param[in] stream  Stream to print the results to.
+ * @return            Non-zero once every run has finished.
+ */
+int bench_placement(FILE *stream) {
+    const char *scenarios[] = {"sample", "generated"};
+    long long transfers[2], changes[2];
+
+    fprintf(stream, "Resource cache line transfers between CPUs, %d ms per run on %ld CPUs\n\n",
+            BENCH_PLACEMENT_DURATION_MS, sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (int s = 0; s < 2; s++) {
+        for (int pinned = 0; pinned < 2; pinned++) {
+            bench_placement_run(scenarios[s], pinned, stream, &transfers[pinned], &changes[pinned]);
+        }
+        fprintf(stream, "%s: %.2f transfers per 1000 changes unpinned, %.2f pinned\n\n", scenarios[s],
+                transfers[0] * 1000.0 / (changes[0] > 0 ? changes[0] : 1),
+                transfers[1] * 1000.0 / (changes[1] > 0 ? changes[1] : 1));
+    }
+
+    return 1;
+}
+
+/**
+ * Measures how many events per second the manager handles alone, and spread over manager workers.
+ *
+ * A generated scenario with BENCH_DISPATCH_SYSTEMS systems is flooded with watermark events by
+ * BENCH_DISPATCH_PRODUCERS threads, through queues that block the producers once full, so the number of
+ * events handled is what the handling side can keep up with. The systems themselves never run; handling
+ * an event is the same scan for the resource's producers and status change as in a simulation. The
+ * manager alone pops as fast as it can; with workers the main thread only coordinates.
+ *
+ * @param[in] stream  Stream to print the results to.
+ * @return            Non-zero once every run has finished.
+ */
+int bench_dispatch(FILE *stream) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long long alone, handled;
+
+    fprintf(stream, "Events handled in %d ms with %d systems, %d resources and %d producer threads, on %ld CPUs\n\n",
+            BENCH_DISPATCH_DURATION_MS, BENCH_DISPATCH_SYSTEMS, BENCH_DISPATCH_RESOURCES, BENCH_DISPATCH_PRODUCERS, cpus);
+
+    alone = bench_dispatch_run(0, stream);
+    for (int workers = 1; workers <= 2 * cpus && workers <= DISPATCH_MAX_WORKERS; workers *= 2) {
+        handled = bench_dispatch_run(workers, stream);
+        fprintf(stream, "  %.2fx the manager alone\n", handled / (double)(alone > 0 ? alone : 1));
+    }
+
+    return 1;
+}
+
+/**
+ * Measures what the timing statistics cost, by running the same scenarios with them and with `--no-stats`.
+ *
+ * The sample rocket and a generated scenario with BENCH_STATS_SYSTEMS systems run single threaded in
+ * virtual time, so a run is nothing but system loops and event handling, and any time the statistics
+ * take shows up in full; in real time it hides behind the systems' sleeps. Runs with and without the
+ * statistics alternate, so both see the same machine, until each setting has run for BENCH_STATS_RUN_MS.
+ * The settings are compared per resource change, since with aging the order events are handled in (and
+ * so the run) depends on the wall clock, and the median of BENCH_STATS_REPEATS such comparisons is reported.
+ *
+ * @param[in] stream  Stream to print the results to.
+ * @return            Non-zero once every run has finished.
+ */
+int bench_stats(FILE *stream) {
+    const char *scenarios[] = {"sample", "generated"};
+    long long changes[2], events[2], run_changes, run_events;
+    double wall_ns[2], overhead[BENCH_STATS_REPEATS], swap;
+    int s, r, i, timed;
+
+    fprintf(stream, "Timing statistics on and off, single threaded in virtual time for up to %ds per run, %dms of runs per setting\n\n",
+            BENCH_STATS_SIMULATED_MS / 1000, BENCH_STATS_RUN_MS);
+
+    for (s = 0; s < 2; s++) {
+        fprintf(stream, "%s:", scenarios[s]);
+        for (r = 0; r < BENCH_STATS_REPEATS; r++) {
+            wall_ns[0] = wall_ns[1] = 0;
+            changes[0] = changes[1] = events[0] = events[1] = 0;
+            while (wall_ns[0] < BENCH_STATS_RUN_MS * 1e6 || wall_ns[1] < BENCH_STATS_RUN_MS * 1e6) {
+                for (timed = 1; timed >= 0; timed--) {
+                    wall_ns[timed] += bench_stats_run(scenarios[s], timed, &run_changes, &run_events);
+                    changes[timed] += run_changes;
+                    events[timed] += run_events;
+                }
+            }
+            overhead[r] = (wall_ns[1] / (changes[1] > 0 ? changes[1] : 1)) / (wall_ns[0] / (changes[0] > 0 ? changes[0] : 1)) - 1;
+            fprintf(stream, " %+.1f%%", overhead[r] * 100);
+        }
+
+        for (r = 1; r < BENCH_STATS_REPEATS; r++) {
+            for (i = r; i > 0 && overhead[i - 1] > overhead[i]; i--) {
+                swap = overhead[i];
+                overhead[i] = overhead[i - 1];
+                overhead[i - 1] = swap;
+            }
+        }
+        fprintf(stream, "\n  last: %.1fns per change over %lld changes and %lld events with statistics, %.1fns over %lld and %lld without\n",
+                wall_ns[1] / (changes[1] > 0 ? changes[1] : 1), changes[1], events[1],
+                wall_ns[0] / (changes[0] > 0 ? changes[0] : 1), changes[0], events[0]);
+        fprintf(stream, "  median overhead of the statistics: %+.1f%%\n\n", overhead[BENCH_STATS_REPEATS / 2] * 100);
+    }
+
+    return 1;
+}
+
+/**
+ * Compares iterating the systems of a slot map with iterating a plain array, then adds and removes systems mid-run.
+ *
+ * BENCH_SLOTMAP_SYSTEMS systems are iterated BENCH_SLOTMAP_PASSES times: through a plain pointer array,
+ * laid out like the `SystemArray` the slot maps replaced, through the slot map's dense `items`, through
+ * `items` again after half of the systems were removed and inserted again, and by looking every system
+ * up by handle. The hot swap runs then check that removing systems and resources from a running
+ * simulation (single threaded, on threads, and on threads with manager workers) drops their events as
+ * stale rather than following freed pointers.
+ *
+ * @param[in] stream  Stream to print the results to.
+ * @return            Non-zero if every hot swap run removed everything and counted its stale events.
+ */
+int bench_slot_map(FILE *stream) {
+    System **array = (System **)malloc(BENCH_SLOTMAP_SYSTEMS * sizeof(System *));
+    Handle *handles = (Handle *)malloc(BENCH_SLOTMAP_SYSTEMS * sizeof(Handle));
+    ResourceAmount none;
+    SlotMap map;
+    int i, created = 0, passed;
+
+    slot_map_init(&map);
+    resource_amount_init(&none, NULL, 0);
+    for (i = 0; array != NULL && handles != NULL && i < BENCH_SLOTMAP_SYSTEMS; i++) {
+        system_create(&array[i], "Bench", none, none, i % 100, NULL);
+        if (array[i] == NULL || slot_map_insert(&map, array[i]).generation == 0) {
+            break;
+        }
+        created++;
+    }
+    if (created < BENCH_SLOTMAP_SYSTEMS) {
+        printf("Failed to set up the slot map benchmark\n");
+        passed = 0;
+    } else {
+        fprintf(stream, "Iterating %d systems, %d passes each\n", BENCH_SLOTMAP_SYSTEMS, BENCH_SLOTMAP_PASSES);
+        bench_slot_map_iterate("plain array", (void **)array, NULL, NULL, created, stream);
+        bench_slot_map_iterate("slot map items", map.items, NULL, NULL, map.size, stream);
+
+        // Every other system leaves and comes back, so the slots are reused and `items` reordered
+        for (i = 0; i < created; i++) {
+            handles[i] = slot_map_handle_at(&map, i);
+        }
+        for (i = 0; i < created; i += 2) {
+            slot_map_remove(&map, handles[i]);
+        }
+        for (i = 0; i < created; i += 2) {
+            slot_map_insert(&map, array[i]);
+        }
+        bench_slot_map_iterate("slot map items, churned", map.items, NULL, NULL, map.size, stream);
+
+        for (i = 0; i < map.size; i++) {
+            handles[i] = slot_map_handle_at(&map, i);
+        }
+        bench_slot_map_iterate("slot map by handle", NULL, &map, handles, map.size, stream);
+
+        fprintf(stream, "\nAdding and removing a resource and its two systems %d times mid-run\n", BENCH_HOTSWAP_ROUNDS);
+        passed = bench_hot_swap_run("single threaded", 0, 0, stream);
+        passed = bench_hot_swap_run("threads", 1, 0, stream) && passed;
+        passed = bench_hot_swap_run("threads, 2 workers", 1, 2, stream) && passed;
+    }
+
+    for (i = 0; i < created; i++) {
+        system_destroy(array[i]);
+    }
+    slot_map_clean(&map);
+    free(array);
+    free(handles);
+    return passed;
+}
+
+/**
+ * Times BENCH_SLOTMAP_PASSES passes over a set of systems, reading each one's processing time.
+ *
+ * @param[in] name     Name of the layout, printed with the result.
+ * @param[in] items    Systems to iterate in order, or NULL to look them up by handle.
+ * @param[in] map      Pointer to the `SlotMap` to look the handles up in, if `items` is NULL.
+ * @param[in] handles  Handles of the systems, if `items` is NULL.
+ * @param[in] count    Number of systems.
+ * @param[in] stream   Stream to print the result to.
+ */
+static void bench_slot_map_iterate(const char *name, void **items, const SlotMap *map, const Handle *handles, int count, FILE *stream) {
+    long long start = stats_now_ns(), elapsed, sum = 0;
+    System *system = NULL;
+
+    for (int pass = 0; pass < BENCH_SLOTMAP_PASSES; pass++) {
+        for (int i = 0; i < count; i++) {
+            system = items != NULL ? items[i] : slot_map_get(map, handles[i]);
+            sum += system->processing_time;
+        }
+    }
+    elapsed = stats_now_ns() - start;
+
+    // The sum is printed so the loop can't be optimized away
+    fprintf(stream, "  %-26s %6.2f ns per system (checksum %lld)\n", name,
+            elapsed / ((double)count * BENCH_SLOTMAP_PASSES), sum);
+}
+
+/**
+ * Runs the sample rocket while a resource and its two systems are repeatedly added and removed.
+ *
+ * Each round adds a Coolant resource with a pump producing it and a loop consuming it, runs for
+ * BENCH_HOTSWAP_ROUND_MS, then removes all three. An event about the Coolant is pushed once it is gone,
+ * as a report a system made just before the removal would be, so every round leaves at least one stale
+ * event; a stale handle resolves to NULL, so nothing freed is followed.
+ *
+ * @param[in] name          Name of the run, printed with the result.
+ * @param[in] threaded      Non-zero to run every system on its own thread.
+ * @param[in] worker_count  Manager workers to handle the events on, 0 for `manager_run` alone.
+ * @param[in] stream        Stream to print the result to.
+ * @return                  Non-zero if every removal succeeded and every stale event was counted.
+ */
+static int bench_hot_swap_run(const char *name, int threaded, int worker_count, FILE *stream) {
+    Manager manager;
+    Resource *coolant = NULL;
+    System *pump = NULL, *loop = NULL;
+    ResourceAmount none, produce, consume;
+    Handle coolant_handle, pump_handle, loop_handle;
+    Event event;
+    int round, rounds = 0, failures = 0, passed;
+
+    manager_init(&manager);
+    manager.display_enabled = 0;
+    load_data(&manager);
+    manager.dispatcher.worker_count = worker_count;
+    if (worker_count > 0 && !dispatch_start(&manager)) {
+        manager_clean(&manager);
+        return 0;
+    }
+    if (threaded) {
+        manager_start_threads(&manager);
+    }
+
+    resource_amount_init(&none, NULL, 0);
+    for (round = 0; round < BENCH_HOTSWAP_ROUNDS && manager.simulation_running; round++) {
+        resource_create(&coolant, "Coolant", 0, 50);
+        coolant_handle = manager_add_resource(&manager, coolant);
+        resource_amount_init(&produce, coolant, 5);
+        resource_amount_init(&consume, coolant, 3);
+        system_create(&pump, "Coolant Pump", none, produce, 2, &manager.event_queue);
+        system_create(&loop, "Coolant Loop", consume, none, 3, &manager.event_queue);
+        pump_handle = manager_add_system(&manager, pump);
+        loop_handle = manager_add_system(&manager, loop);
+
+        bench_hot_swap_wait(&manager, threaded, BENCH_HOTSWAP_ROUND_MS);
+
+        event_init(&event, pump, coolant, STATUS_HIGH, PRIORITY_MED, 0);
+        if (!manager_remove_system(&manager, pump_handle) || !manager_remove_system(&manager, loop_handle) ||
+            !manager_remove_resource(&manager, coolant_handle) || slot_map_get(&manager.systems, pump_handle) != NULL ||
+            slot_map_get(&manager.systems, loop_handle) != NULL || slot_map_get(&manager.resources, coolant_handle) != NULL) {
+            failures++;
+        }
+        if (manager.dispatcher.running) {
+            dispatch_push(&manager.dispatcher, &event);
+        } else {
+            event_queue_push(&manager.event_queue, &event);
+        }
+        rounds++;
+
+        // Long enough for the stale event to be popped before the next round
+        bench_hot_swap_wait(&manager, threaded, 4 * MANAGER_WAIT_TIME);
+    }
+
+    if (threaded) {
+        dispatch_stop(&manager);
+        manager_stop_threads(&manager);
+    } else {
+        dispatch_stop(&manager);
+    }
+
+    passed = rounds == BENCH_HOTSWAP_ROUNDS && failures == 0 && manager.stale_events >= rounds;
+    fprintf(stream, "  %-20s %d rounds, %d failed removals, %lld stale events dropped, %d systems left, run %s: %s\n",
+            name, rounds, failures, manager.stale_events, manager.systems.size,
+            manager_termination_name(manager.termination_reason), passed ? "ok" : "FAILED");
+    manager_clean(&manager);
+    return passed;
+}
+
+/**
+ * Runs the manager (and the systems, unless they are on threads) for a while.
+ *
+ * @param[in,out] manager      Pointer to the `Manager`.
+ * @param[in]     threaded     Non-zero if the systems run on their own threads.
+ * @param[in]     duration_ms  Wall time to run for.
+ */
+static void bench_hot_swap_wait(Manager *manager, int threaded, int duration_ms) {
+    long long end = stats_now_ns() + duration_ms * 1000000LL;
+
+    while (manager->simulation_running && stats_now_ns() < end) {
+        manager_run(manager);
+        if (threaded || manager_run_systems(manager) == 0) {
+            usleep(MANAGER_WAIT_TIME * 1000);
+        }
+    }
+}
+
+/**
+ * Runs one scenario single threaded in virtual time until it ends or BENCH_STATS_SIMULATED_MS have passed.
+ *
+ * Only the loop is timed, not loading the scenario, so the result is what the statistics cost the
+ * simulation itself.
+ *
+ * @param[in]  scenario  "sample" for the sample rocket, anything else for a generated scenario.
+ * @param[in]  timed     Non-zero to record the timing statistics, zero as with `--no-stats`.
+ * @param[out] changes   Set to the number of changes of any resource's amount (conversions and stores).
+ * @param[out] events    Set to the number of events the manager handled.
+ * @return               Wall time the loop took, in nanoseconds.
+ */
+static double bench_stats_run(const char *scenario, int timed, long long *changes, long long *events) {
+    Manager manager;
+    ScenarioConfig config;
+    System *system = NULL;
+    long long start_ns, elapsed_ns;
+
+    manager_init(&manager);
+    manager.display_enabled = 0;
+    if (scenario[0] == 's') {
+        load_data(&manager);
+    } else {
+        scenario_config_init(&config);
+        config.system_count = BENCH_STATS_SYSTEMS;
+        config.resource_count = BENCH_STATS_RESOURCES;
+        scenario_generate(&manager, &config);
+    }
+    manager_set_stats_timing(&manager, timed);
+    manager_set_virtual_time(&manager);
+
+    start_ns = stats_now_ns();
+    while (manager.simulation_running && clock_now_ms(&manager.clock) < BENCH_STATS_SIMULATED_MS) {
+        manager_run(&manager);
+        if (manager_run_systems(&manager) == 0) {
+            clock_sleep_ms(&manager.clock, MANAGER_WAIT_TIME);
+        }
+    }
+    elapsed_ns = stats_now_ns() - start_ns;
+
+    *changes = 0;
+    for (int i = 0; i < manager.systems.size; i++) {
+        system = manager.systems.items[i];
+        *changes += system->stats.conversions + system->stats.stores;
+    }
+    *events = manager.event_queue.latency.total;
+
+    manager_clean(&manager);
+    return (double)elapsed_ns;
+}
+
+/**
+ * Floods one manager with events for BENCH_DISPATCH_DURATION_MS and prints how many it handled.
+ *
+ * @param[in] worker_count  Manager workers to run, 0 for the calling thread to handle every event itself.
+ * @param[in] stream        Stream to print the results to.
+ * @return                  Number of events handled.
+ */
+static long long bench_dispatch_run(int worker_count, FILE *stream) {
+    Manager manager;
+    ScenarioConfig config;
+    BenchProducer producers[BENCH_DISPATCH_PRODUCERS];
+    Event event;
+    long long end, handled;
+    int i, started = 0;
+
+    manager_init(&manager);
+    manager.display_enabled = 0;
+    scenario_config_init(&config);
+    config.system_count = BENCH_DISPATCH_SYSTEMS;
+    config.resource_count = BENCH_DISPATCH_RESOURCES;
+    if (!scenario_generate(&manager, &config)) {
+        manager_clean(&manager);
+        return 0;
+    }
+    event_queue_set_capacity(&manager.event_queue, BENCH_DISPATCH_CAPACITY, OVERFLOW_BLOCK);
+
+    manager.dispatcher.worker_count = worker_count;
+    if (worker_count > 0 && !dispatch_start(&manager)) {
+        manager_clean(&manager);
+        return 0;
+    }
+
+    for (i = 0; i < BENCH_DISPATCH_PRODUCERS; i++) {
+        producers[i].manager = &manager;
+        producers[i].index = i;
+        producers[i].stop = 0;
+        if (pthread_create(&producers[i].thread, NULL, bench_dispatch_producer, &producers[i]) != 0) {
+            printf("Failed to start producer %d\n", i);
+            break;
+        }
+        started++;
+    }
+
+    // `manager_run` would never return while the producers keep up, so the manager alone pops here instead
+    end = stats_now_ns() + BENCH_DISPATCH_DURATION_MS * 1000000LL;
+    while (stats_now_ns() < end) {
+        if (worker_count > 0) {
+            manager_run(&manager);
+            usleep(MANAGER_WAIT_TIME * 1000);
+        } else if (event_queue_pop(&manager.event_queue, &event)) {
+            manager_handle_event(&manager, &event, NULL);
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        __atomic_store_n(&producers[i].stop, 1, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    dispatch_stop(&manager);
+
+    // The workers' queues were merged into the manager's, so this counts every popped event either way
+    handled = manager.event_queue.latency.total;
+    if (worker_count == 0) {
+        fprintf(stream, "manager alone: %lld events (%.0f/s)\n", handled, handled * 1000.0 / BENCH_DISPATCH_DURATION_MS);
+    } else {
+        fprintf(stream, "%d workers: %lld events (%.0f/s), per worker:", worker_count, handled, handled * 1000.0 / BENCH_DISPATCH_DURATION_MS);
+        for (i = 0; i < worker_count; i++) {
+            fprintf(stream, " %lld", manager.dispatcher.workers[i].handled);
+        }
+        fprintf(stream, "\n");
+    }
+
+    manager_clean(&manager);
+    return handled;
+}
+
+/**
+ * Pushes LOW, HIGH and NORMAL watermark events about the producer's resources in turn until stopped.
+ *
+ * Each resource only ever gets events from one producer, numbered in `amount`, so the events about a
+ * resource are pushed in order.
+ *
+ * @param[in,out] arg  Pointer to the `BenchProducer`.
+ * @return             NULL.
+ */
+static void *bench_dispatch_producer(void *arg) {
+    BenchProducer *producer = (BenchProducer *)arg;
+    Manager *manager = producer->manager;
+    const int statuses[] = {STATUS_LOW, STATUS_HIGH, STATUS_NORMAL};
+    Resource *resource = NULL;
+    Event event;
+    int sequence = 0;
+
+    while (!__atomic_load_n(&producer->stop, __ATOMIC_RELAXED)) {
+        for (int i = producer->index; i < manager->resources.size; i += BENCH_DISPATCH_PRODUCERS) {
+            resource = manager->resources.items[i];
+            event_init(&event, NULL, resource, statuses[sequence % 3], PRIORITY_MED, sequence);
+            if (manager->dispatcher.running) {
+                dispatch_push(&manager->dispatcher, &event);
+            } else {
+                event_queue_push(&manager->event_queue, &event);
+            }
+        }
+        sequence++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs one scenario on threads for BENCH_PLACEMENT_DURATION_MS and prints its transfers.
+ *
+ * @param[in]  scenario   "sample" for the sample rocket, anything else for a generated scenario.
+ * @param[in]  pinned     Non-zero to pin the threads with `placement_apply`.
+ * @param[in]  stream     Stream to print the results to.
+ * @param[out] transfers  Set to the transfers summed over every resource.
+ * @param[out] changes    Set to the number of changes of any resource's amount (consumes and stores).
+ */
+static void bench_placement_run(const char *scenario, int pinned, FILE *stream, long long *transfers, long long *changes) {
+    Manager manager;
+    ScenarioConfig config;
+    System *system = NULL;
+    long long end;
+    int i;
+
+    manager_init(&manager);
+    manager.display_enabled = 0;
+    manager.placement.enabled = pinned;
+    manager.placement.count_transfers = 1;
+    if (scenario[0] == 's') {
+        load_data(&manager);
+    } else {
+        scenario_config_init(&config);
+        config.system_count = BENCH_PLACEMENT_SYSTEMS;
+        config.resource_count = BENCH_PLACEMENT_RESOURCES;
+        scenario_generate(&manager, &config);
+    }
+
+    manager_start_threads(&manager);
+    end = stats_now_ns() + BENCH_PLACEMENT_DURATION_MS * 1000000LL;
+    while (manager.simulation_running && stats_now_ns() < end) {
+        manager_run(&manager);
+        usleep(MANAGER_WAIT_TIME * 1000);
+    }
+    manager_stop_threads(&manager);
+
+    *transfers = 0;
+    *changes = 0;
+    for (i = 0; i < manager.resources.size; i++) {
+        *transfers += ((Resource *)manager.resources.items[i])->cpu_transfers;
+    }
+    for (i = 0; i < manager.systems.size; i++) {
+        system = manager.systems.items[i];
+        *changes += system->stats.conversions + system->stats.stores;
+    }
+
+    fprintf(stream, "%s, %s: %lld changes, %lld transfers", scenario, pinned ? "pinned" : "unpinned", *changes, *transfers);
+    if (pinned) {
+        fprintf(stream, ", %d clusters over %d CPUs", manager.placement.cluster_count, manager.placement.cpu_count);
+    }
+    fprintf(stream, "\n");
+    manager_clean(&manager);
+}
+
+/**
+ * Runs the benchmark load against a queue configured by one mode and prints its delay histograms.
+ *
+ * Events still queued at the end never got popped; they are reported separately with the age of the
+ * oldest, since leaving them out of the histogram is exactly what hides starvation. Events are spread
+ * over BENCH_QUEUE_SOURCES made up systems, so a merging queue has something to merge.
+ *
+ * @param[in] mode    Pointer to the `BenchQueueMode` to run.
+ * @param[in] stream  Stream to print the results to.
+ */
+static void bench_queue_run(const BenchQueueMode *mode, FILE *stream) {
+    EventQueue queue;
+    Event event;
+    EventNode *node;
+    long long next[EVENT_PRIORITY_LEVELS];
+    long long period[EVENT_PRIORITY_LEVELS] = {0};
+    long long unserved[EVENT_PRIORITY_LEVELS] = {0};
+    long long oldest[EVENT_PRIORITY_LEVELS] = {0};
+    long long start, end, now;
+    char label[32];
+    long long pushed = 0;
+    int level;
+
+    event_queue_init(&queue);
+    event_queue_set_aging(&queue, mode->aging_ns, mode->max_wait_ns);
+    event_queue_set_capacity(&queue, mode->capacity, mode->overflow_policy);
+
+    period[PRIORITY_HIGH] = BENCH_QUEUE_HIGH_NS;
+    period[PRIORITY_MED] = BENCH_QUEUE_OTHER_NS;
+    period[PRIORITY_LOW] = BENCH_QUEUE_OTHER_NS;
+
+    start = stats_now_ns();
+    end = start + BENCH_QUEUE_DURATION_MS * 1000000LL;
+    for (level = 0; level < EVENT_PRIORITY_LEVELS; level++) {
+        next[level] = start;
+    }
+
+    while ((now = stats_now_ns()) < end) {
+        // Push every arrival that came due while the last event was being served
+        for (level = PRIORITY_LOW; level <= PRIORITY_HIGH; level++) {
+            while (next[level] <= now) {
+                // Watermark reports, since a full queue never drops the stall reports systems sleep after
+                event_init(&event, NULL, NULL, STATUS_HIGH, level, 0);
+                event.system.index = (unsigned int)(pushed++ % BENCH_QUEUE_SOURCES);
+                event.system.generation = 1;
+                event_queue_push(&queue, &event);
+                next[level] += period[level];
+            }
+        }
+
+        if (event_queue_pop(&queue, &event)) {
+            bench_spin_until(now + BENCH_QUEUE_SERVICE_NS);
+        }
+    }
+
+    now = stats_now_ns();
+    for (level = PRIORITY_LOW; level <= PRIORITY_HIGH; level++) {
+        for (node = queue.heads[level]; node != NULL; node = node->next) {
+            unserved[level]++;
+            if (now - node->event.enqueue_ns > oldest[level]) {
+                oldest[level] = now - node->event.enqueue_ns;
+            }
+        }
+    }
+
+    fprintf(stream, "%s: pushed %lld, popped %lld, promoted %lld, left queued %d (max %d), dropped %lld, merged %lld, overflowed %lld\n",
+            mode->name, pushed, queue.latency.total, queue.promoted, queue.size, queue.max_size,
+            queue.dropped, queue.merged, queue.overflowed);
+    for (level = PRIORITY_HIGH; level >= PRIORITY_LOW; level--) {
+        snprintf(label, sizeof(label), "  %s delay", bench_priority_name(level));
+        histogram_print(stream, label, &queue.priority_latency[level]);
+        fprintf(stream, "  %-18s: %lld, oldest waited %.1fms\n", "never popped", unserved[level], oldest[level] / 1e6);
+    }
+    fprintf(stream, "\n");
+
+    event_queue_clean(&queue);
+}
+
+/**
+ * Busy waits until the given time, standing in for the work done on a popped event.
+ *
+ * @param[in] deadline_ns  Time to wait until, from `stats_now_ns`.
+ */
+static void bench_spin_until(long long deadline_ns) {
+    while (stats_now_ns() < deadline_ns) {
+    }
+}
+
+/**
+ * Returns a short name for an event priority.
+ *
+ * @param[in] priority  PRIORITY_LOW..PRIORITY_HIGH.
+ * @return              Name of the priority.
+ */
+static const char *bench_priority_name(int priority) {
+    switch (priority) {
+        case PRIORITY_HIGH:
+            return "HIGH";
+        case PRIORITY_MED:
+            return "MED";
+        default:
+            return "LOW";
+    }
+}
@@ -0,0 +1,50 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* SimClock functions */
+
+/**
+ * Initializes a `SimClock`.
+ *
+ * @param[out] clock         Pointer to the `SimClock` to initialize.
+ * @param[in]  virtual_time  Non-zero for a clock that advances instead of sleeping.
+ */
+void clock_init(SimClock *clock, int virtual_time) {
+    clock->virtual_time = virtual_time;
+    clock->now_ms = 0;
+    clock->start_ns = stats_now_ns();
+}
+
+/**
+ * Waits for the given number of milliseconds.
+ *
+ * In virtual time the clock is advanced instead, which is equivalent for a single threaded run since
+ * nothing else could have happened while the caller slept. A NULL clock always sleeps.
+ *
+ * @param[in,out] clock         Pointer to the `SimClock`, may be NULL.
+ * @param[in]     milliseconds  Time to wait.
+ */
+void clock_sleep_ms(SimClock *clock, int milliseconds) {
+    if (clock != NULL && clock->virtual_time) {
+        clock->now_ms += milliseconds;
+        return;
+    }
+
+    usleep(milliseconds * 1000);
+}
+
+/**
+ * Returns the time elapsed on the clock.
+ *
+ * @param[in] clock  Pointer to the `SimClock`.
+ * @return           Milliseconds since `clock_init`, simulated in virtual time and measured otherwise.
+ */
+long long clock_now_ms(const SimClock *clock) {
+    if (clock->virtual_time) {
+        return clock->now_ms;
+    }
+
+    return (stats_now_ns() - clock->start_ns) / 1000000;
+}
@@ -0,0 +1,148 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Helper functions just used by this C file
+static double control_setpoint(const Resource *resource);
+static double control_clamp(double value, double low, double high);
+
+/**
+ * Initializes a `RateController` that is off, with the default tick and gains.
+ *
+ * @param[out] control  Pointer to the `RateController` to initialize.
+ */
+void control_init(RateController *control) {
+    control->enabled = 0;
+    control->tick_ms = CONTROL_TICK_MS;
+    control->last_tick_ms = -1;
+    control->ticks = 0;
+    control->kp = CONTROL_KP;
+    control->ki = CONTROL_KI;
+}
+
+/**
+ * Sets the rate of every producer from the fill level of the resource it produces.
+ *
+ * Each resource has a PI controller: the error is how far the amount is below its setpoint, as a
+ * fraction of capacity, and the rate is `1 + kp * error + integral`, clamped to between CONTROL_MIN_RATE
+ * and CONTROL_MAX_RATE. The integral only accumulates while the rate isn't clamped, so a resource that
+ * sat full or empty for a while doesn't overshoot once it recovers. Every system producing the resource
+ * has its processing time multiplied by `1 / rate`; systems producing nothing keep their rate.
+ *
+ * Only runs once every `tick_ms` of clock time, so the gains don't depend on how often the manager loops,
+ * and the statuses are left alone, so a SLOW or FAST set some other way still applies on top.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` whose systems are steered.
+ * @return                 Non-zero if the rates were updated; zero if it wasn't time yet, or the controller is off.
+ */
+int control_tick(Manager *manager) {
+    RateController *control = &manager->control;
+    Resource *resource = NULL;
+    System *system = NULL;
+    double error, rate, integral, scale, seconds;
+    long long now;
+    int i, j;
+
+    if (!control->enabled || !manager->simulation_running) {
+        return 0;
+    }
+
+    now = clock_now_ms(&manager->clock);
+    if (control->last_tick_ms >= 0 && now - control->last_tick_ms < control->tick_ms) {
+        return 0;
+    }
+    seconds = control->last_tick_ms < 0 ? control->tick_ms / 1000.0 : (now - control->last_tick_ms) / 1000.0;
+    control->last_tick_ms = now;
+    control->ticks++;
+
+    for (i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        if (resource->max_capacity <= 0) {
+            continue;
+        }
+
+        error = (control_setpoint(resource) - __atomic_load_n(&resource->amount, __ATOMIC_RELAXED)) / resource->max_capacity;
+        integral = resource->control_integral + control->ki * error * seconds;
+        rate = 1.0 + control->kp * error + integral;
+        if (rate >= CONTROL_MIN_RATE && rate <= CONTROL_MAX_RATE) {
+            resource->control_integral = integral;
+        }
+        rate = control_clamp(1.0 + control->kp * error + resource->control_integral, CONTROL_MIN_RATE, CONTROL_MAX_RATE);
+
+        // Read by the producers' threads while they sleep out their processing time
+        scale = 1.0 / rate;
+        for (j = 0; j < manager->systems.size; j++) {
+            system = manager->systems.items[j];
+            if (system->produced.resource == resource) {
+                __atomic_store(&system->time_scale, &scale, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Prints how many times the controller ran and the rate it left every producer at.
+ *
+ * Prints nothing if the controller is off.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] stream   Stream to print to.
+ */
+void control_print(const Manager *manager, FILE *stream) {
+    const RateController *control = &manager->control;
+    const System *system = NULL;
+    int printed = 0;
+
+    if (!control->enabled) {
+        return;
+    }
+
+    fprintf(stream, "Rate controller: %lld ticks every %dms (kp %.2f, ki %.2f), final rates:",
+            control->ticks, control->tick_ms, control->kp, control->ki);
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        if (system->produced.resource != NULL) {
+            fprintf(stream, "%s %s x%.2f", printed++ == 0 ? "" : ",", system->name, 1.0 / system->time_scale);
+        }
+    }
+    fprintf(stream, "\n");
+}
+
+/**
+ * Works out the amount the controller steers a resource towards.
+ *
+ * The destination is only ever wanted full, so Distance is steered towards its capacity; everything
+ * else towards the middle of its watermarks, where neither a LOW nor a HIGH event fires.
+ *
+ * @param[in] resource  Pointer to the `Resource`.
+ * @return              The setpoint, in units of the resource.
+ */
+static double control_setpoint(const Resource *resource) {
+    if (strcmp(resource->name, "Distance") == 0) {
+        return resource->max_capacity;
+    }
+
+    return (resource->low_mark + resource->high_mark) / 2.0;
+}
+
+/**
+ * Limits a value to a range.
+ *
+ * @param[in] value  Value to limit.
+ * @param[in] low    Smallest value returned.
+ * @param[in] high   Largest value returned.
+ * @return           `value`, or the nearest end of the range if it lies outside.
+ */
+static double control_clamp(double value, double low, double high) {
+    if (value < low) {
+        return low;
+    }
+    if (value > high) {
+        return high;
+    }
+
+    return value;
+}
@@ -1,4 +1,7 @@
 #include <semaphore.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 
 // Don't worry about these! These are special codes that allow us to do some formatting in the terminal
 // Such as clearing the line before printing or moving the location of the "cursor" that will print.
@@ -20,23 +23,180 @@
 #define STATUS_LOW          1
 #define STATUS_INSUFFICIENT 2
 #define STATUS_CAPACITY     3
+#define STATUS_HIGH         4   // Rose to the high watermark
+#define STATUS_NORMAL       5   // Back between the watermarks after being low or high
 #define STATUS_PRODUCED     10
 
 #define THRESHOLD_RESOURCE_LOW 0.3  // Percentage of resource before it is considered low.
+#define THRESHOLD_RESOURCE_HIGH 0.9 // Percentage of resource above which it is considered high.
+#define THRESHOLD_HYSTERESIS 0.1    // Percentage a resource must move back past a watermark before it can cross it again.
 #define MANAGER_WAIT_TIME 5         // Milliseconds for the manager to wait between popping the queue
 #define SYSTEM_WAIT_TIME 20         // Milliseconds between loops of the system when production cannot occur
+#define WAIT_AVAILABLE 0             // Waiting for an amount of a resource to be available
+#define WAIT_SPACE     1             // Waiting for an amount of free space in a resource
+#define SHARD_TIME_LIMIT 120000     // Milliseconds before a sharded comparison run is stopped
 
 #define PRIORITY_HIGH 3
 #define PRIORITY_MED 2
 #define PRIORITY_LOW 1
+#define EVENT_PRIORITY_LEVELS (PRIORITY_HIGH + 1)   // The event queue keeps one list per priority, indexed directly
+#define EVENT_AGING_MS        50    // Milliseconds of waiting worth one priority level when choosing the next event
+#define EVENT_MAX_WAIT_MS     250   // Default deadline of MED and LOW events, after which they are popped first
+#define EVENT_BLOCK_TIMEOUT_MS 100  // Longest a producer is blocked on a full queue before its event is let in anyway
+
+#define OVERFLOW_BLOCK      0   // A full queue blocks the producer until an event is popped
+#define OVERFLOW_DROP       1   // A full queue drops its oldest event of the lowest priority (never PRIORITY_HIGH, EMPTY, INSUFFICIENT or CAPACITY)
+#define OVERFLOW_MERGE      2   // A full queue updates a queued event from the same system about the same resource and status,
+                                // falling back to OVERFLOW_DROP
+
+#define END_RUNNING     0   // The simulation has not ended yet
+#define END_OXYGEN      1   // Oxygen ran out
+#define END_DESTINATION 2   // Distance reached its capacity
+#define END_TIMEOUT     3   // Stopped by the caller's time limit
+#define END_STALLED     4   // No system could make progress again, or none that could end the run
+#define STALL_CONFIRM_MS 50 // Least time a stall must last before the run is ended, on top of the longest processing time
+
+#define CACHE_LINE_SIZE 64                              // Bytes moved between cores at a time; fields written by different threads are kept apart by this much
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))  // Starts a field on its own cache line
+#define PLACEMENT_MAX_CPUS 1024                         // Most CPUs a placement spreads threads over (the size of a cpu_set_t)
+#define PLACEMENT_SYSTEMS_PER_CPU 4                     // Systems of one cluster sharing a CPU, they mostly sleep through their processing time
+
+#define TRACE_CONVERT   0   // Span: a system consuming its input
+#define TRACE_PROCESS   1   // Span: a system's processing time
+#define TRACE_STORE     2   // Span: a system storing its output
+#define TRACE_STALL     3   // Span: a system waiting on a resource
+#define TRACE_PUSH      4   // Instant: a system pushed an event
+#define TRACE_POP       5   // Instant: the manager popped an event
+#define TRACE_STATUS    6   // Instant: the manager changed a system's status
+#define TRACE_CHUNK_RECORDS   512   // Records per allocation of a trace buffer (16KB)
+#define TRACE_DEFAULT_BUDGET_MB 256 // Memory all trace buffers may use before they overwrite their oldest records
+#define TRACE_NAME_LENGTH     64
+
+#define CONTROL_TICK_MS   20    // Default milliseconds between rate controller updates
+#define CONTROL_KP        4.0   // Rate added per unit of fill error (the error is a fraction of capacity)
+#define CONTROL_KI        1.0   // Rate added per second per unit of fill error
+#define CONTROL_MIN_RATE  0.25  // Slowest a controlled system runs, as a multiple of its normal rate
+#define CONTROL_MAX_RATE  2.0   // Fastest a controlled system runs (FAST's rate)
+
+#define SYSTEM_STATUS_COUNT (FAST + 1)            // Number of run modes (TERMINATE..FAST) tracked by the stats
+#define STALL_STATUS_COUNT  (STATUS_CAPACITY + 1) // Stall counters are indexed directly by status code
+
+// Log-bucketed (HDR-style) histogram layout: values below HISTOGRAM_SUB_COUNT are exact, every power of two
+// above that is split into HISTOGRAM_SUB_COUNT linear sub-buckets, giving roughly 12% relative error.
+#define HISTOGRAM_SUB_BITS   3
+#define HISTOGRAM_SUB_COUNT  (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS    ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// Latency histogram in nanoseconds, only ever written by a single thread and merged when read
+typedef struct LatencyHistogram {
+    long long counts[HISTOGRAM_BUCKETS];
+    long long total;
+    long long sum;
+    long long min;
+    long long max;
+} LatencyHistogram;
+
+// Hot-path counters for a single system, only written by whoever runs the system
+typedef struct SystemStats {
+    long long conversions;                          // Successful consumes of the input resource
+    long long stores;                               // Successful stores of the produced resource
+    long long consumed_total;                       // Total amount taken from the consumed resource
+    long long produced_total;                       // Total amount put into the produced resource
+    long long stalls[STALL_STATUS_COUNT];           // Number of failed attempts, indexed by STATUS_EMPTY/INSUFFICIENT/CAPACITY
+    long long stall_ns[STALL_STATUS_COUNT];         // Time spent waiting after each kind of failure
+    long long status_ns[SYSTEM_STATUS_COUNT];       // Time spent in each run mode (SLOW, FAST, ...)
+    long long last_sample_ns;                       // `stats_coarse_ns` when `last_status` was last charged, 0 before the first sample
+    int last_status;                                // Status that was observed at `last_sample_ns`
+    int timed;                                      // non-zero to record `stall_ns` and `status_ns` (the default)
+} SystemStats;
+
+// Clock used by systems to wait; in virtual time waiting only advances `now_ms` so a run takes no wall time
+typedef struct SimClock {
+    int virtual_time;   // non-zero to advance `now_ms` instead of sleeping
+    long long now_ms;   // Simulated milliseconds since the start of the run (virtual time only)
+    long long start_ns; // Wall time the clock was initialized (real time only)
+} SimClock;
+
+// Generation-checked reference to an entry in a `SlotMap`, stale once the entry is removed
+typedef struct Handle {
+    unsigned int index;         // Slot holding the entry
+    unsigned int generation;    // Generation of the slot when the handle was made, 0 is never valid
+} Handle;
+
+// A slot of a `SlotMap`, either pointing at a live entry or at the next free slot
+typedef struct Slot {
+    unsigned int generation;
+    int dense;                  // Position in `items` while live, next free slot (or -1) while free
+} Slot;
+
+// Entries addressed by handles, densely packed for iteration and removable in O(1)
+typedef struct SlotMap {
+    void **items;               // Live entries, iterated like a plain array
+    int *owners;                // Slot of each entry in `items`
+    Slot *slots;
+    int size;                   // Number of live entries
+    int capacity;               // Capacity of `items`, `owners` and `slots`
+    int slot_count;             // Number of slots ever used
+    int free_head;              // First free slot, -1 if none
+} SlotMap;
+
+// A system waiting on a resource, kept in one of the resource's wait lists sorted by threshold
+typedef struct Waiter {
+    struct System *system;
+    int threshold;          // Amount available (or free space) the system needs before it can run again
+    struct Waiter *next;
+} Waiter;
 
 // Represents the resource amounts for the entire rocket
+// Allocated aligned to a cache line, so `amount` never shares one with another resource
 typedef struct Resource {
     char *name;      // Dynamically allocated string
-    int amount;
     int max_capacity;
+    int shared;      // non-zero if the resource lives in shared memory and is used by several processes
+    Handle handle;              // Handle of the resource in its manager
+    int users;                  // Number of systems in the manager consuming or producing the resource
+    sem_t lock;                 // Protects the wait lists
+    int waiter_count;           // Number of systems in either wait list, checked without the lock
+    Waiter *waiting_available;  // Systems waiting for at least `threshold` to be available
+    Waiter *waiting_space;      // Systems waiting for at least `threshold` free space
+    int low_mark;               // Amount at or below which the resource is low
+    int high_mark;              // Amount at or above which the resource is high
+    int hysteresis;             // Distance back past a mark before the resource leaves low or high
+    int level;                  // STATUS_LOW, STATUS_NORMAL or STATUS_HIGH, only changed by compare-and-swap
+    double control_integral;    // Integral term of the rate controller for the resource's producers
+    int amount CACHE_ALIGNED;   // Changed by every consume and store, so it starts a cache line of its own
+    int last_cpu;               // CPU that last changed `amount`, -1 before the first change
+    long long cpu_transfers;    // Changes of `amount` made on a different CPU than the one before, each moved the line
+    int count_transfers;        // non-zero to count `cpu_transfers`, copied from the manager's placement
 } Resource;
 
+// One thing that happened, as recorded by a tracer; spans are recorded once they end
+typedef struct TraceRecord {
+    long long start_ns;     // From `stats_now_ns`
+    long long duration_ns;  // -1 for an instant
+    Handle resource;        // Resource involved, invalid if none
+    int type;               // TRACE_* code
+    int status;             // STATUS_* code of the outcome, or the new system status for TRACE_STATUS
+    int value;              // Amount for spans, priority for events, track of the system for TRACE_STATUS
+} TraceRecord;
+
+typedef struct TraceChunk {
+    TraceRecord records[TRACE_CHUNK_RECORDS];
+    struct TraceChunk *next;
+} TraceChunk;
+
+// Records of a single writer (a system, or the manager), so recording needs no locking
+typedef struct TraceBuffer {
+    struct Tracer *tracer;
+    char name[TRACE_NAME_LENGTH];   // Copied, the buffer outlives its system
+    int track;                      // Thread id in the trace, also the buffer's position in the tracer
+    TraceChunk *head;               // Oldest chunk
+    TraceChunk *tail;               // Chunk being written
+    int used;                       // Records written to `tail`
+    long long overwritten;          // Records lost to the memory budget
+    long long dropped;              // Records lost because the buffer never got a chunk within the budget
+} TraceBuffer;
+
 // Represents the amount of a resource consumed/produced for a single system
 typedef struct ResourceAmount {
     Resource *resource;
@@ -46,21 +206,41 @@ typedef struct ResourceAmount {
 // A system which consumes resources, waits for `processing_time` milliseconds, then produced the produced resource
 typedef struct System {
     char *name;     // Dynamically allocated string
+    Handle handle;  // Handle of the system in its manager
     ResourceAmount consumed;
     ResourceAmount produced;
     int amount_stored;
     int processing_time;
     int status; 
     struct EventQueue *event_queue;  
+    struct Dispatcher *dispatcher;  // Routes the system's events to the manager workers, NULL to use `event_queue`
+    SimClock *clock;    // Clock used for processing and waiting, NULL to always sleep in real time
+    int threaded;               // non-zero if the system runs on its own thread
+    pthread_t thread;
+    sem_t wakeup;               // Posted when a threaded system's wait is over
+    int waiting;                // non-zero while the system is in a resource's wait list
+    struct Resource *waiting_on;// Resource the system is waiting on, NULL if none
+    Waiter waiter;              // Wait list entry, a system only ever waits on one resource at a time
+    int stall_status;           // Status of the current stall, charged to the stats once it ends
+    long long stall_start_ns;   // When the current stall started (`stats_now_ns` if tracing, else `stats_coarse_ns`), 0 if not stalled
+    int cluster;                // Cluster of systems sharing resources with this one, -1 until placed
+    int cpu_first;              // First of the placement's CPUs the system's thread is pinned to
+    int cpu_count;              // Number of consecutive placement CPUs it is pinned to, 0 if not pinned
+    TraceBuffer *trace;         // Where the system's phases are recorded, NULL unless tracing
+    double time_scale;          // Multiplier of the processing time, set by the rate controller (1 otherwise)
+    SystemStats stats CACHE_ALIGNED;    // Written every loop by the system's thread, kept off the lines other threads write
 } System;
 
 // Used to send notifications to the manager about an issue / state of the system
+// Events refer to systems and resources by handle, so an event outliving either is detected and dropped
 typedef struct Event {
-    System *system;
-    Resource *resource;
+    Handle system;      // Invalid for events forwarded from another process
+    Handle resource;
     int status;     
     int priority;   // Higher values indicate higher priority
     int amount;     // Amount of the resource in question
+    long long enqueue_ns;   // Time the event was pushed, used for the queue latency histogram
+    long long deadline_ns;  // Time by which the event should be popped, 0 for the queue's default (if any)
 } Event;
 
 // Linked List Node for the Event queue
@@ -69,47 +249,379 @@ typedef struct EventNode {
     struct EventNode *next;
 } EventNode;
 
-// Linked List structure with a head and no tail, single instance shared by all systems
+// One FIFO linked list per priority, single instance shared by all systems
+// Popping picks between the heads of the lists by priority, age and deadline, so no priority can starve
 typedef struct EventQueue {
-    EventNode *head;
+    EventNode *heads[EVENT_PRIORITY_LEVELS];
+    EventNode *tails[EVENT_PRIORITY_LEVELS];
     int size;
+    sem_t lock;                 // Makes pushing and popping safe from any number of threads
+    long long aging_ns;         // Waiting time worth one priority level, 0 for strict priority order
+    long long max_wait_ns[EVENT_PRIORITY_LEVELS];   // Default deadline per priority, 0 for none
+    long long promoted;         // Events popped ahead of a higher priority because of their age or deadline
+    int capacity;               // Events held before the overflow policy applies, 0 for no limit
+    int overflow_policy;        // OVERFLOW_BLOCK, OVERFLOW_DROP or OVERFLOW_MERGE
+    int max_size;               // Deepest the queue has been
+    long long dropped;          // Events dropped to make room (or because there was none)
+    long long merged;           // Events merged into one already queued
+    long long overflowed;       // Events let in past the capacity, PRIORITY_HIGH or after blocking too long
+    int blocked_producers;      // Producers waiting on `space`
+    sem_t space;                // Posted by every pop while producers are blocked
+    LatencyHistogram block_time;    // Time producers spent blocked on a full queue
+    LatencyHistogram latency;   // Enqueue-to-dequeue latency of every popped event
+    LatencyHistogram priority_latency[EVENT_PRIORITY_LEVELS];   // The same, split by priority
+    int histograms;             // non-zero to record the histograms (the default); `latency.total` counts pops either way
+    void (*observer)(void *context, const Event *event);    // Optional, called for every pushed event
+    void *observer_context;
 } EventQueue;
 
-// A basic dynamic array to store all of the systems in the simulation
-typedef struct SystemArray {
-    System **systems;
-    int size;
-    int capacity;
-} SystemArray;
+// Position of a resource in a `SlotMap`, sorted by address to look up the position of a pointer
+typedef struct ResourceIndex {
+    Resource *resource;
+    int index;
+} ResourceIndex;
 
-// A basic resource array to store all resources in the simulation
-typedef struct ResourceArray {
-    Resource **resources;
-    int size;
-    int capacity;
-} ResourceArray;
+#define LOOKAHEAD_HORIZON_MS     5000   // Virtual time each candidate is simulated forward
+#define LOOKAHEAD_MAX_CANDIDATES 17     // The current statuses plus a FAST and SLOW variant for up to 8 systems per cycle
+#define LOOKAHEAD_MAX_THREADS    4
+
+// A system in a lookahead's compact copy of the simulation, with its resources as positions in `amounts`
+typedef struct LookaheadSystem {
+    int consumed;           // -1 for none
+    int consumed_amount;
+    int produced;           // -1 for none
+    int produced_amount;
+    int processing_time;
+    int status;
+    int stored;             // Produced but not yet stored, as `System.amount_stored`
+    long long ready_ms;     // When the system next acts, when systems run concurrently
+} LookaheadSystem;
+
+// Compact copy of everything the lookahead needs to run the simulation forward
+typedef struct LookaheadState {
+    int resource_count;
+    int system_count;
+    int *amounts;
+    int *capacities;
+    LookaheadSystem *systems;
+    long long now_ms;
+} LookaheadState;
+
+// Evaluates candidate status assignments by running copies of the simulation forward in virtual time
+typedef struct Lookahead {
+    int enabled;
+    int horizon_ms;
+    int thread_count;
+    int serial;             // non-zero to model the single threaded loop, where systems take turns
+    int oxygen;             // Position of the "Oxygen" resource, -1 if there is none
+    int distance;           // Position of the "Distance" resource, -1 if there is none
+    int allocated_resources;
+    int allocated_systems;
+    int candidate_count;
+    int next_candidate;     // Next candidate to claim, updated atomically by the evaluating threads
+    int next_system;        // System the next cycle's candidates start from, so every system gets its turn
+    pthread_t threads[LOOKAHEAD_MAX_THREADS - 1];   // Pool helping the manager's thread evaluate, started on the first cycle
+    int pool_size;          // Threads in the pool, 0 until it is started
+    int pool_stop;          // Set to end the pool's threads
+    sem_t pool_start;       // Posted once per pool thread to evaluate a cycle's candidates
+    sem_t pool_done;        // Posted by each pool thread once there are no candidates left to claim
+    LookaheadState base;
+    LookaheadState candidates[LOOKAHEAD_MAX_CANDIDATES];
+    double scores[LOOKAHEAD_MAX_CANDIDATES];
+    int changed[LOOKAHEAD_MAX_CANDIDATES];  // Position of the system each candidate switched, -1 for the current statuses
+    long long cycles;       // Lookaheads run
+    long long applied;      // Lookaheads that changed a status
+    long long evaluated;    // Candidates run forward
+    long long clone_ns;     // Time spent copying the state
+    long long evaluate_ns;  // Time spent running candidates forward
+    long long simulated_ms; // Virtual time simulated over every candidate
+} Lookahead;
+
+// Where system threads are pinned: systems that share resources form a cluster, and each cluster gets its
+// own run of neighbouring CPUs so the resources it shares stay in the caches of those CPUs
+typedef struct Placement {
+    int enabled;                    // non-zero to pin system threads when they start
+    int count_transfers;            // non-zero for the resources to count `cpu_transfers` (--pin and its benchmark)
+    int cpu_count;                  // CPUs the process may run on
+    int cpus[PLACEMENT_MAX_CPUS];   // Those CPUs, ordered so that neighbours share a core or package
+    int cluster_count;
+} Placement;
+
+// Timeline of what the systems and the manager did, kept in a buffer per writer and written out at the end
+typedef struct Tracer {
+    int enabled;
+    long long start_ns;         // Time zero of the trace
+    int max_chunks;             // Chunks all buffers may hold together
+    int chunk_count;            // Chunks currently held, changed atomically by the writers
+    TraceBuffer **buffers;      // Every buffer, indexed by track; track 0 is the manager
+    int buffer_count;
+    int buffer_capacity;
+} Tracer;
+
+// Sets every producer's rate from the fill level of what it produces, in place of flipping statuses
+typedef struct RateController {
+    int enabled;
+    int tick_ms;            // Clock milliseconds between updates
+    long long last_tick_ms; // Clock time of the last update, -1 before the first
+    long long ticks;
+    double kp;
+    double ki;
+} RateController;
+
+// Ends runs that can't make progress; see `stall_check`
+typedef struct StallDetector {
+    int enabled;            // non-zero to check (off for shard workers, which only see part of the graph)
+    int dirty;              // Set when something happened that could have left nothing able to run
+    int suspect;            // non-zero while every check since `suspect_ms` found the run stalled
+    long long suspect_ms;   // Clock time the current suspicion started
+    long long progress;     // Conversions and stores of every system at `suspect_ms`
+    long long window_ms;    // How long the suspicion must last before the run is ended
+    long long checks;       // Number of times the live systems were worked out
+    int live_count;         // Systems that could still run, as of the last check
+    int can_end;            // non-zero if, as of the last check, a live system could still end the run
+} StallDetector;
+
+#define DISPATCH_MAX_WORKERS 64    // Most manager workers `dispatch_start` runs
+#define DISPATCH_END_PENDING -1    // `termination` claimed by a worker that hasn't published its reason yet
+
+// One manager worker, handling the events about its share of the resources
+typedef struct DispatchWorker {
+    struct Manager *manager;
+    EventQueue queue;           // Events about every resource whose handle index is the worker's index modulo the worker count
+    sem_t ready;                // Posted for every event pushed to `queue`, and to stop the worker
+    sem_t lock;                 // Held while an event is handled, so the systems and resources can't change underneath
+    pthread_t thread;
+    TraceBuffer *trace;         // The worker's own track, NULL unless tracing
+    long long handled CACHE_ALIGNED;    // Only written by the worker
+} DispatchWorker;
+
+// Spreads event handling over manager workers by resource, leaving mission-wide decisions to the coordinator; see `dispatch_start`
+typedef struct Dispatcher {
+    int worker_count;           // Workers `dispatch_start` runs, 0 to handle every event in `manager_run`
+    DispatchWorker *workers;
+    int running;                // non-zero between `dispatch_start` and `dispatch_stop`
+    int termination;            // END_* a worker asked the coordinator to end the run with, END_RUNNING for none
+    long long termination_ms;   // Clock time of that request, written before the reason is published
+} Dispatcher;
 
 // Container structure which contains all of the core data for our simulation
 typedef struct Manager {
     int simulation_running; // non-zero if the simulation is running, zero if it should be stopped
-    SystemArray system_array;
-    ResourceArray resource_array;
+    int display_enabled;    // non-zero to print the state and every event to the terminal
+    time_t last_display_time;   // When the display was last refreshed
+    int termination_reason; // END_* code describing why the simulation stopped
+    long long end_time_ms;  // Clock time at which the simulation stopped
+    double threshold_low;   // Fraction of capacity below which a resource is considered low
+    SimClock clock;
+    SlotMap systems;        // System* entries
+    SlotMap resources;      // Resource* entries
+    long long stale_events; // Events dropped because their resource had been removed
+    int stats_timed;        // non-zero to record the timing statistics, see `manager_set_stats_timing`
+    int threads_running;    // non-zero between `manager_start_threads` and `manager_stop_threads`
+    Lookahead lookahead;    // Only used if `lookahead.enabled`
+    Placement placement;    // Only used if `placement.enabled`
+    Tracer tracer;          // Only used if `tracer.enabled`
+    StallDetector stall;
+    RateController control; // Only used if `control.enabled`
+    Dispatcher dispatcher;  // Only used while `dispatcher.running`
+    struct ExportRegion *export;    // State published for monitors, NULL unless `export_open` was called
     EventQueue event_queue;
 } Manager;
 
+#define EXPORT_MAGIC          0x4b434f52u  // "ROCK", marks a region written by `export_open`
+#define EXPORT_VERSION        1            // Bumped whenever the layout of `ExportRegion` changes
+#define EXPORT_DEFAULT_NAME   "/rocket_sim"
+#define EXPORT_NAME_LENGTH    32
+#define EXPORT_MAX_RESOURCES  64
+#define EXPORT_MAX_SYSTEMS    256
+
+// A resource as published to monitoring processes
+typedef struct ExportResource {
+    char name[EXPORT_NAME_LENGTH];
+    int amount;
+    int max_capacity;
+} ExportResource;
+
+// A system as published to monitoring processes
+typedef struct ExportSystem {
+    char name[EXPORT_NAME_LENGTH];
+    int status;
+    int waiting;
+    long long conversions;
+    long long stores;
+    long long stalls;
+} ExportSystem;
+
+// Fixed layout state shared through /dev/shm, rewritten in place by the simulation and read by any
+// number of monitors. `sequence` is a seqlock: odd while an update is being written, so a reader retries
+// until it sees the same even value before and after copying.
+typedef struct ExportRegion {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int size;          // sizeof(ExportRegion) of the writer
+    unsigned int sequence;
+    long long updates;          // Number of completed updates
+    long long clock_ms;
+    int simulation_running;
+    int termination_reason;
+    int resource_count;         // Entries used in `resources`, later resources aren't published
+    int system_count;           // Entries used in `systems`, later systems aren't published
+    int queue_size;
+    int queue_max_size;
+    long long events;           // Events popped by the manager
+    long long dropped;
+    ExportResource resources[EXPORT_MAX_RESOURCES];
+    ExportSystem systems[EXPORT_MAX_SYSTEMS];
+} ExportRegion;
+
+#define SCENARIO_DIST_CONSTANT    0   // Every system uses `min_processing_time`
+#define SCENARIO_DIST_UNIFORM     1   // Uniform between `min_processing_time` and `max_processing_time`
+#define SCENARIO_DIST_EXPONENTIAL 2   // Exponential with mean `min_processing_time`, capped at `max_processing_time`
+
+// Parameters for generating a random (but valid) production graph of resources and systems
+typedef struct ScenarioConfig {
+    unsigned long long seed;    // Same seed and parameters always produce the same scenario
+    int resource_count;         // Including the source resource and the final "Distance" resource
+    int system_count;           // Must be at least `resource_count` so every resource is connected
+    int max_fan_in;             // Maximum number of systems producing a single resource
+    int max_fan_out;            // Maximum number of systems consuming a single resource
+    int processing_distribution;
+    int min_processing_time;    // Milliseconds
+    int max_processing_time;    // Milliseconds
+    int min_capacity;
+    int max_capacity;
+    double capacity_ratio;      // Initial amount of intermediate resources as a fraction of capacity
+    int max_amount;             // Largest amount consumed or produced by a single conversion
+} ScenarioConfig;
+
+#define SWEEP_MAX_VALUES 32
+#define SWEEP_MAX_AXES   8
+#define SWEEP_MAX_RUNS   1000000    // Largest grid a sweep runs, every combination of the axes is one run
+#define SWEEP_NAME_LENGTH 64
+
+#define SWEEP_AXIS_CAPACITY 0   // max_capacity of the resource named `target`
+#define SWEEP_AXIS_TIME     1   // processing_time of the system named `target`, in milliseconds
+#define SWEEP_AXIS_SCALE    2   // Multiplier applied to every system's processing time
+#define SWEEP_AXIS_LOW      3   // Fraction of capacity below which every resource is low (THRESHOLD_RESOURCE_LOW)
+
+// A list of values to try for one parameter of a sweep
+typedef struct SweepAxis {
+    int kind;                           // SWEEP_AXIS_*
+    char target[SWEEP_NAME_LENGTH];     // Resource or system the axis changes, empty for SCALE and LOW
+    double values[SWEEP_MAX_VALUES];
+    int count;
+} SweepAxis;
+
+// Parameter sweep over a scenario, every combination of the axes is one run
+typedef struct SweepConfig {
+    SweepAxis axes[SWEEP_MAX_AXES];
+    int axis_count;                 // 0 for the default grid, see `sweep_run`
+    int thread_count;               // Worker threads, zero for one per online core
+    long long time_limit_ms;        // Simulated time after which a run is stopped with END_TIMEOUT
+    const char *scenario;           // Scenario every run loads, as written by `scenario_write`
+    size_t scenario_length;
+} SweepConfig;
+
 // Manager functions
 void manager_init(Manager *manager);
 void manager_clean(Manager *manager);
 void manager_run(Manager *manager);
+Handle manager_add_resource(Manager *manager, Resource *resource);
+Handle manager_add_system(Manager *manager, System *system);
+int manager_remove_resource(Manager *manager, Handle handle);
+int manager_remove_system(Manager *manager, Handle handle);
+int manager_run_systems(Manager *manager);
+void manager_start_threads(Manager *manager);
+void manager_stop_threads(Manager *manager);
+void manager_set_virtual_time(Manager *manager);
+void manager_handle_event(Manager *manager, const Event *event, TraceBuffer *trace);
+void manager_end(Manager *manager, int reason);
+const char *manager_termination_name(int reason);
+void load_data(Manager *manager);
+
+// SimClock functions
+void clock_init(SimClock *clock, int virtual_time);
+void clock_sleep_ms(SimClock *clock, int milliseconds);
+long long clock_now_ms(const SimClock *clock);
+
+// Lookahead functions
+void lookahead_init(Lookahead *lookahead);
+void lookahead_clean(Lookahead *lookahead);
+int lookahead_run(Manager *manager);
+void lookahead_print(const Lookahead *lookahead, FILE *stream);
+
+// Export functions
+int export_open(Manager *manager, const char *name);
+void export_publish(Manager *manager);
+void export_close(Manager *manager, const char *name);
+
+// Placement functions
+void placement_init(Placement *placement);
+int placement_apply(Manager *manager);
+void placement_print(const Manager *manager, FILE *stream);
+
+// Rate controller functions
+void control_init(RateController *control);
+int control_tick(Manager *manager);
+void control_print(const Manager *manager, FILE *stream);
+
+// Dispatch functions
+void dispatch_init(Dispatcher *dispatcher);
+void dispatch_clean(Dispatcher *dispatcher);
+int dispatch_start(Manager *manager);
+void dispatch_stop(Manager *manager);
+void dispatch_push(Dispatcher *dispatcher, const Event *event);
+int dispatch_coordinate(Manager *manager);
+void dispatch_lock(Dispatcher *dispatcher);
+void dispatch_unlock(Dispatcher *dispatcher);
+void dispatch_print(const Manager *manager, FILE *stream);
+
+// Stall detection functions
+void stall_init(StallDetector *stall);
+int stall_check(Manager *manager);
+void stall_print(const Manager *manager, FILE *stream);
+
+// Trace functions
+void trace_init(Tracer *tracer);
+void trace_clean(Tracer *tracer);
+int trace_enable(Manager *manager, int budget_mb);
+TraceBuffer *trace_add_buffer(Tracer *tracer, const char *name);
+void trace_span(TraceBuffer *buffer, int type, long long start_ns, int status, int value, Handle resource);
+void trace_instant(TraceBuffer *buffer, int type, int status, int value, Handle resource);
+int trace_write(const Manager *manager, FILE *stream);
+
+// Benchmark functions
+int bench_event_queue(FILE *stream);
+int bench_placement(FILE *stream);
+int bench_dispatch(FILE *stream);
+int bench_slot_map(FILE *stream);
+int bench_stats(FILE *stream);
+
+// Shard functions
+int shard_compare(Manager *manager, int shard_count, long long time_limit_ms, FILE *stream);
+
+// Sweep functions
+void sweep_config_init(SweepConfig *config);
+int sweep_config_set(SweepConfig *config, const char *option);
+int sweep_run(const SweepConfig *config, FILE *stream);
 
 // System functions
 void system_create(System **system, const char *name, ResourceAmount consumed, ResourceAmount produced, int processing_time, EventQueue *event_queue);
 void system_destroy(System *system);
 void system_run(System *system);
+void *system_thread(void *system);
+void system_wake(System *system);
 
 // Resource functions
 void resource_create(Resource **resource, const char *name, int amount, int max_capacity);
 void resource_destroy(Resource *resource);
+int resource_consume(Resource *resource, int amount, int *crossing);
+int resource_store(Resource *resource, int amount, int *crossing);
+void resource_set_watermarks(Resource *resource, double low, double high, double hysteresis);
+int resource_wait(Resource *resource, System *system, int kind, int threshold);
+void resource_cancel_wait(Resource *resource, System *system);
+ResourceIndex *resource_index_build(const SlotMap *resources);
+int resource_index_find(const ResourceIndex *indexes, int size, const Resource *resource);
 
 // ResourceAmount functions
 void resource_amount_init(ResourceAmount *resource_amount, Resource *resource, int amount);
@@ -122,14 +634,38 @@ void event_queue_init(EventQueue *queue);
 void event_queue_clean(EventQueue *queue);
 void event_queue_push(EventQueue *queue, const Event *event); 
 int event_queue_pop(EventQueue *queue, Event* event);
+void event_queue_set_aging(EventQueue *queue, long long aging_ns, long long max_wait_ns);
+void event_queue_set_capacity(EventQueue *queue, int capacity, int overflow_policy);
+const char *event_queue_policy_name(int overflow_policy);
+
+// SlotMap functions
+void slot_map_init(SlotMap *map);
+void slot_map_clean(SlotMap *map);
+Handle slot_map_insert(SlotMap *map, void *item);
+void *slot_map_get(const SlotMap *map, Handle handle);
+void *slot_map_remove(SlotMap *map, Handle handle);
+Handle slot_map_handle_at(const SlotMap *map, int dense);
 
-// Dynamic array functions for systems and resources
-void system_array_init(SystemArray *array);
-void system_array_clean(SystemArray *array);
-void system_array_add(SystemArray *array, System *system);
+// Scenario functions
+void scenario_config_init(ScenarioConfig *config);
+int scenario_config_set(ScenarioConfig *config, const char *option);
+int scenario_generate(Manager *manager, const ScenarioConfig *config);
+int scenario_write(Manager *manager, FILE *stream);
+int scenario_load(Manager *manager, FILE *stream);
 
-void resource_array_init(ResourceArray *array);
-void resource_array_clean(ResourceArray *array);
-void resource_array_add(ResourceArray *array, Resource *resource);
+// Statistics functions
+long long stats_now_ns(void);
+long long stats_coarse_ns(void);
+void system_stats_init(SystemStats *stats, int status);
+void system_stats_sample(SystemStats *stats, int status);
+void system_stats_merge(SystemStats *total, const SystemStats *stats);
+void manager_set_stats_timing(Manager *manager, int enabled);
+void histogram_init(LatencyHistogram *histogram);
+void histogram_record(LatencyHistogram *histogram, long long value);
+void histogram_merge(LatencyHistogram *total, const LatencyHistogram *histogram);
+long long histogram_percentile(const LatencyHistogram *histogram, double percentile);
+void histogram_print(FILE *stream, const char *label, const LatencyHistogram *histogram);
+void manager_stats_print(Manager *manager, FILE *stream);
+const char *stats_status_name(int status);
 
   
\ No newline at end of file
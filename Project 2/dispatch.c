@@ -0,0 +1,313 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Helper functions just used by this C file
+static void *dispatch_worker_thread(void *arg);
+static void dispatch_wake(void *context, const Event *event);
+static void dispatch_merge_queue(EventQueue *total, const EventQueue *queue);
+
+/**
+ * Initializes a `Dispatcher` with no workers, so every event goes through the manager's own queue.
+ *
+ * @param[out] dispatcher  Pointer to the `Dispatcher` to initialize.
+ */
+void dispatch_init(Dispatcher *dispatcher) {
+    dispatcher->worker_count = 0;
+    dispatcher->workers = NULL;
+    dispatcher->running = 0;
+    dispatcher->termination = END_RUNNING;
+    dispatcher->termination_ms = 0;
+}
+
+/**
+ * Frees the workers of a stopped `Dispatcher`, and any events still queued for them.
+ *
+ * @param[in,out] dispatcher  Pointer to the `Dispatcher` to clean.
+ */
+void dispatch_clean(Dispatcher *dispatcher) {
+    if (dispatcher->workers == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < dispatcher->worker_count; i++) {
+        event_queue_clean(&dispatcher->workers[i].queue);
+        sem_destroy(&dispatcher->workers[i].ready);
+        sem_destroy(&dispatcher->workers[i].lock);
+    }
+    free(dispatcher->workers);
+    dispatcher->workers = NULL;
+}
+
+/**
+ * Starts `worker_count` manager workers and routes every system's events to them.
+ *
+ * The resources are split into shards by handle index modulo the worker count, and each worker has its
+ * own `EventQueue` holding the events about its shard, configured like the manager's queue. Every event
+ * about a resource goes through the same queue and is handled by the same thread, so the events about
+ * one resource are handled in the order that queue pops them, as they were by `manager_run`. Systems only
+ * ever change the status of the producers of the event's resource, so the workers never write the same
+ * system, and the only contended lock on the way is that of the shard's queue.
+ *
+ * Call before `manager_start_threads`, so the system threads report to the workers from the start.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`, with `dispatcher.worker_count` set.
+ * @return                 Non-zero if every worker started; zero otherwise, with every event left to `manager_run`.
+ */
+int dispatch_start(Manager *manager) {
+    Dispatcher *dispatcher = &manager->dispatcher;
+    DispatchWorker *worker = NULL;
+    char name[TRACE_NAME_LENGTH];
+    int i, started;
+
+    if (dispatcher->worker_count <= 0 || dispatcher->worker_count > DISPATCH_MAX_WORKERS) {
+        printf("The manager can run between 1 and %d workers\n", DISPATCH_MAX_WORKERS);
+        return 0;
+    }
+
+    dispatcher->workers = (DispatchWorker *)aligned_alloc(CACHE_LINE_SIZE, dispatcher->worker_count * sizeof(DispatchWorker));
+    if (dispatcher->workers == NULL) {
+        printf("Failed to allocate memory for the manager workers\n");
+        return 0;
+    }
+
+    for (i = 0; i < dispatcher->worker_count; i++) {
+        worker = &dispatcher->workers[i];
+        worker->manager = manager;
+        worker->handled = 0;
+        worker->trace = NULL;
+        sem_init(&worker->ready, 0, 0);
+        sem_init(&worker->lock, 0, 1);
+
+        event_queue_init(&worker->queue);
+        event_queue_set_capacity(&worker->queue, manager->event_queue.capacity, manager->event_queue.overflow_policy);
+        worker->queue.aging_ns = manager->event_queue.aging_ns;
+        worker->queue.histograms = manager->event_queue.histograms;
+        memcpy(worker->queue.max_wait_ns, manager->event_queue.max_wait_ns, sizeof(worker->queue.max_wait_ns));
+        worker->queue.observer = dispatch_wake;
+        worker->queue.observer_context = worker;
+
+        if (manager->tracer.enabled) {
+            snprintf(name, sizeof(name), "Manager worker %d", i);
+            worker->trace = trace_add_buffer(&manager->tracer, name);
+        }
+    }
+
+    dispatcher->termination = END_RUNNING;
+    __atomic_store_n(&dispatcher->running, 1, __ATOMIC_RELEASE);
+    for (started = 0; started < dispatcher->worker_count; started++) {
+        if (pthread_create(&dispatcher->workers[started].thread, NULL, dispatch_worker_thread, &dispatcher->workers[started]) != 0) {
+            printf("Failed to start manager worker %d\n", started);
+            break;
+        }
+    }
+    if (started < dispatcher->worker_count) {
+        __atomic_store_n(&dispatcher->running, 0, __ATOMIC_RELEASE);
+        for (i = 0; i < started; i++) {
+            sem_post(&dispatcher->workers[i].ready);
+            pthread_join(dispatcher->workers[i].thread, NULL);
+        }
+        dispatch_clean(dispatcher);
+        return 0;
+    }
+
+    for (i = 0; i < manager->systems.size; i++) {
+        __atomic_store_n(&((System *)manager->systems.items[i])->dispatcher, dispatcher, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+/**
+ * Stops the manager workers, sending any later events back to the manager's own queue.
+ *
+ * The workers' queue statistics are merged into the manager's queue, so the statistics cover every
+ * event whichever thread handled it. Call before `manager_stop_threads`, so no worker can undo the
+ * TERMINATE it sets; events the system threads report after that stay in the manager's queue.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ */
+void dispatch_stop(Manager *manager) {
+    Dispatcher *dispatcher = &manager->dispatcher;
+    int i;
+
+    if (!dispatcher->running) {
+        return;
+    }
+
+    for (i = 0; i < manager->systems.size; i++) {
+        __atomic_store_n(&((System *)manager->systems.items[i])->dispatcher, NULL, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&dispatcher->running, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < dispatcher->worker_count; i++) {
+        sem_post(&dispatcher->workers[i].ready);
+    }
+    for (i = 0; i < dispatcher->worker_count; i++) {
+        pthread_join(dispatcher->workers[i].thread, NULL);
+        dispatch_merge_queue(&manager->event_queue, &dispatcher->workers[i].queue);
+    }
+}
+
+/**
+ * Sends an event to the worker handling its resource.
+ *
+ * @param[in,out] dispatcher  Pointer to the running `Dispatcher`.
+ * @param[in]     event       Pointer to the `Event` to push.
+ */
+void dispatch_push(Dispatcher *dispatcher, const Event *event) {
+    event_queue_push(&dispatcher->workers[event->resource.index % dispatcher->worker_count].queue, event);
+}
+
+/**
+ * Makes the decisions that affect the whole mission on behalf of the workers.
+ *
+ * A worker that sees the run end (Oxygen out, or the destination reached) only records the reason and
+ * when it happened, and the first reason recorded is applied here, on the thread that calls `manager_run`.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @return                 Non-zero if the simulation was ended; zero otherwise.
+ */
+int dispatch_coordinate(Manager *manager) {
+    Dispatcher *dispatcher = &manager->dispatcher;
+    int reason = __atomic_load_n(&dispatcher->termination, __ATOMIC_ACQUIRE);
+
+    // A pending reason is published by its worker shortly, and picked up on the next loop
+    if (reason == END_RUNNING || reason == DISPATCH_END_PENDING || !manager->simulation_running) {
+        return 0;
+    }
+
+    manager_end(manager, reason);
+    manager->end_time_ms = dispatcher->termination_ms;
+    return 1;
+}
+
+/**
+ * Stops every worker from handling events, so the systems and resources can be changed.
+ *
+ * Takes each worker's lock in turn; each lock is only ever contended here, so handling an event only
+ * pays for an uncontended lock of the worker's own. Does nothing unless the workers run.
+ *
+ * @param[in,out] dispatcher  Pointer to the `Dispatcher`.
+ */
+void dispatch_lock(Dispatcher *dispatcher) {
+    if (!dispatcher->running) {
+        return;
+    }
+
+    for (int i = 0; i < dispatcher->worker_count; i++) {
+        sem_wait(&dispatcher->workers[i].lock);
+    }
+}
+
+/**
+ * Lets the workers handle events again after `dispatch_lock`.
+ *
+ * @param[in,out] dispatcher  Pointer to the `Dispatcher`.
+ */
+void dispatch_unlock(Dispatcher *dispatcher) {
+    if (!dispatcher->running) {
+        return;
+    }
+
+    for (int i = dispatcher->worker_count - 1; i >= 0; i--) {
+        sem_post(&dispatcher->workers[i].lock);
+    }
+}
+
+/**
+ * Prints how many events each manager worker handled.
+ *
+ * Prints nothing unless workers were started.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] stream   Stream to print to.
+ */
+void dispatch_print(const Manager *manager, FILE *stream) {
+    const Dispatcher *dispatcher = &manager->dispatcher;
+
+    if (dispatcher->workers == NULL) {
+        return;
+    }
+
+    fprintf(stream, "Events handled by %d manager workers:", dispatcher->worker_count);
+    for (int i = 0; i < dispatcher->worker_count; i++) {
+        fprintf(stream, " %lld", dispatcher->workers[i].handled);
+    }
+    fprintf(stream, "\n");
+}
+
+/**
+ * Runs one manager worker, handling the events of its shard until the dispatcher stops.
+ *
+ * Like `manager_run`, stops handling events once the run has ended, or a worker has asked for it to; the
+ * event popped at that point is dropped, as nothing is left to react to it.
+ *
+ * @param[in,out] arg  Pointer to the `DispatchWorker`.
+ * @return             NULL.
+ */
+static void *dispatch_worker_thread(void *arg) {
+    DispatchWorker *worker = (DispatchWorker *)arg;
+    Manager *manager = worker->manager;
+    Dispatcher *dispatcher = &manager->dispatcher;
+    Event event;
+    int running;
+
+    while (1) {
+        sem_wait(&worker->ready);
+        if (!__atomic_load_n(&dispatcher->running, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // A post per push, so once the queue is drained the posts left over only find it empty
+        while (event_queue_pop(&worker->queue, &event)) {
+            // Checked under the lock, since `manager_end` takes it before setting every status to TERMINATE
+            sem_wait(&worker->lock);
+            running = __atomic_load_n(&dispatcher->termination, __ATOMIC_ACQUIRE) == END_RUNNING &&
+                      __atomic_load_n(&manager->simulation_running, __ATOMIC_RELAXED);
+            if (running) {
+                manager_handle_event(manager, &event, worker->trace);
+                worker->handled++;
+            }
+            sem_post(&worker->lock);
+            if (!running) {
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Wakes the worker of a queue an event was pushed to; the observer of every worker's queue.
+ *
+ * @param[in,out] context  Pointer to the `DispatchWorker`.
+ * @param[in]     event    Pointer to the pushed `Event` (unused).
+ */
+static void dispatch_wake(void *context, const Event *event) {
+    (void)event;
+    sem_post(&((DispatchWorker *)context)->ready);
+}
+
+/**
+ * Adds the counters and histograms of a worker's queue to those of another queue.
+ *
+ * @param[in,out] total  Pointer to the `EventQueue` to add to.
+ * @param[in]     queue  Pointer to the worker's `EventQueue`.
+ */
+static void dispatch_merge_queue(EventQueue *total, const EventQueue *queue) {
+    histogram_merge(&total->latency, &queue->latency);
+    histogram_merge(&total->block_time, &queue->block_time);
+    for (int i = 0; i < EVENT_PRIORITY_LEVELS; i++) {
+        histogram_merge(&total->priority_latency[i], &queue->priority_latency[i]);
+    }
+    total->promoted += queue->promoted;
+    total->dropped += queue->dropped;
+    total->merged += queue->merged;
+    total->overflowed += queue->overflowed;
+    if (queue->max_size > total->max_size) {
+        total->max_size = queue->max_size;
+    }
+}
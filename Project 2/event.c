@@ -1,6 +1,21 @@
 #include "defs.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#define EVENT_ADMITTED 0    // The pushed event goes into the queue
+#define EVENT_MERGED   1    // The pushed event was merged into a queued one
+#define EVENT_DROPPED  2    // The pushed event was dropped
+
+// Helper functions just used by this C file
+static int event_queue_make_room(EventQueue *queue, const Event *event, int level);
+static int event_queue_wait_for_space(EventQueue *queue);
+static int event_queue_drop_oldest(EventQueue *queue, int level);
+static int event_queue_select(EventQueue *queue, long long now);
+static int event_priority_level(int priority);
+static int event_deadline_before(const Event *event, const Event *other);
+static int event_is_critical(const Event *event);
 
 /* Event functions */
 
@@ -8,20 +23,25 @@
  * Initializes an `Event` structure.
  *
  * Sets up an `Event` with the provided system, resource, status, priority, and amount.
+ * The system and resource are stored as handles, so the event stays safe to handle after either is removed.
  *
  * @param[out] event     Pointer to the `Event` to initialize.
- * @param[in]  system    Pointer to the `System` that generated the event.
+ * @param[in]  system    Pointer to the `System` that generated the event, NULL if there is none.
  * @param[in]  resource  Pointer to the `Resource` associated with the event.
  * @param[in]  status    Status code representing the event type.
  * @param[in]  priority  Priority level of the event.
  * @param[in]  amount    Amount related to the event (e.g., resource amount).
  */
 void event_init(Event *event, System *system, Resource *resource, int status, int priority, int amount) {
-    event->system = system;
-    event->resource = resource;
+    Handle none = {0, 0};
+
+    event->system = (system != NULL) ? system->handle : none;
+    event->resource = (resource != NULL) ? resource->handle : none;
     event->status = status;
     event->priority = priority;
     event->amount = amount;
+    event->enqueue_ns = 0;
+    event->deadline_ns = 0;
 }
 
 /* EventQueue functions */
@@ -30,6 +50,8 @@ void event_init(Event *event, System *system, Resource *resource, int status, in
  * Initializes the `EventQueue`.
  *
  * Sets up the queue for use, initializing any necessary data (e.g., semaphores when threading).
+ * The queue starts with the default aging (EVENT_AGING_MS) and deadlines (EVENT_MAX_WAIT_MS), and no
+ * limit on the events it holds until `event_queue_set_capacity` sets one.
  *
  * @param[out] queue  Pointer to the `EventQueue` to initialize.
  */
@@ -38,37 +60,110 @@ void event_queue_init(EventQueue *queue) {
         printf("Error initializing EventQueue");
         return;
     }
-    queue->head = NULL;
+    for (int i = 0; i < EVENT_PRIORITY_LEVELS; i++) {
+        queue->heads[i] = NULL;
+        queue->tails[i] = NULL;
+        histogram_init(&queue->priority_latency[i]);
+    }
     queue->size = 0;
+    queue->promoted = 0;
+    queue->max_size = 0;
+    queue->dropped = 0;
+    queue->merged = 0;
+    queue->overflowed = 0;
+    queue->blocked_producers = 0;
+    sem_init(&queue->lock, 0, 1);
+    sem_init(&queue->space, 0, 0);
+    histogram_init(&queue->latency);
+    histogram_init(&queue->block_time);
+    event_queue_set_aging(queue, EVENT_AGING_MS * 1000000LL, EVENT_MAX_WAIT_MS * 1000000LL);
+    event_queue_set_capacity(queue, 0, OVERFLOW_MERGE);
+    queue->histograms = 1;
+    queue->observer = NULL;
+    queue->observer_context = NULL;
+}
+
+/**
+ * Sets how the `EventQueue` trades priority against waiting time.
+ *
+ * Every `aging_ns` an event has waited counts as one more level of priority, and an event still queued
+ * at its deadline is popped before anything that isn't also overdue. PRIORITY_HIGH events never get a
+ * default deadline, they can only be held up by older overdue events.
+ *
+ * @param[in,out] queue        Pointer to the `EventQueue`.
+ * @param[in]     aging_ns     Waiting time worth one priority level, 0 for strict priority order.
+ * @param[in]     max_wait_ns  Default deadline of lower priority events, 0 for none.
+ */
+void event_queue_set_aging(EventQueue *queue, long long aging_ns, long long max_wait_ns) {
+    sem_wait(&queue->lock);
+    queue->aging_ns = aging_ns;
+    for (int i = 0; i < EVENT_PRIORITY_LEVELS; i++) {
+        queue->max_wait_ns[i] = i < PRIORITY_HIGH ? max_wait_ns : 0;
+    }
+    sem_post(&queue->lock);
+}
+
+/**
+ * Sets how many events the `EventQueue` holds and what happens to a push once it is full.
+ *
+ * PRIORITY_HIGH events, and the STATUS_EMPTY, STATUS_INSUFFICIENT and STATUS_CAPACITY events whose
+ * reporters then sleep on a wait list, are never dropped, nor evicted to make room: if nothing else can
+ * make room they are let in past the capacity. OVERFLOW_BLOCK needs another thread to pop, so `main`
+ * only accepts it with --threads or --workers; a push still gives up after EVENT_BLOCK_TIMEOUT_MS.
+ *
+ * @param[in,out] queue            Pointer to the `EventQueue`.
+ * @param[in]     capacity         Number of events to hold, 0 for no limit.
+ * @param[in]     overflow_policy  OVERFLOW_BLOCK, OVERFLOW_DROP or OVERFLOW_MERGE.
+ */
+void event_queue_set_capacity(EventQueue *queue, int capacity, int overflow_policy) {
+    sem_wait(&queue->lock);
+    queue->capacity = capacity > 0 ? capacity : 0;
+    queue->overflow_policy = overflow_policy;
+    sem_post(&queue->lock);
+}
+
+/**
+ * Returns the name of an overflow policy, as accepted on the command line.
+ *
+ * @param[in] overflow_policy  OVERFLOW_BLOCK, OVERFLOW_DROP or OVERFLOW_MERGE.
+ * @return                     Name of the policy.
+ */
+const char *event_queue_policy_name(int overflow_policy) {
+    switch (overflow_policy) {
+        case OVERFLOW_BLOCK:
+            return "block";
+        case OVERFLOW_DROP:
+            return "drop";
+        case OVERFLOW_MERGE:
+            return "merge";
+        default:
+            return "unknown";
+    }
 }
 
 /**
  * Cleans up the `EventQueue`.
  *
  * Frees any memory and resources associated with the `EventQueue`.
+ * Events only hold handles, so the systems and resources they refer to are left alone.
  * 
  * @param[in,out] queue  Pointer to the `EventQueue` to clean.
  */
 void event_queue_clean(EventQueue *queue) {
     if (queue != NULL) {
-        EventNode *current = queue->head;
-        while (current != NULL) {
-            EventNode *temp = current;
-            current = current->next;
-
-            if(temp->event.system != NULL){
-                system_destroy(temp->event.system);
-                temp->event.system = NULL;
-            }
-
-            if(temp->event.resource != NULL){
-                resource_destroy(temp->event.resource);
-                temp->event.resource = NULL;
+        for (int i = 0; i < EVENT_PRIORITY_LEVELS; i++) {
+            EventNode *current = queue->heads[i];
+            while (current != NULL) {
+                EventNode *temp = current;
+                current = current->next;
+                free(temp);
             }
-            
-            free(temp);
+            queue->heads[i] = NULL;
+            queue->tails[i] = NULL;
         }
-        queue->head = NULL;
+        queue->size = 0;
+        sem_destroy(&queue->lock);
+        sem_destroy(&queue->space);
     }
 }
     
@@ -76,7 +171,11 @@ void event_queue_clean(EventQueue *queue) {
 /**
  * Pushes an `Event` onto the `EventQueue`.
  *
- * Adds the event to the queue in a thread-safe manner, maintaining priority order (highest first).
+ * Adds the event to the list for its priority in a thread-safe manner, stamping the time it was pushed
+ * and its deadline (the queue's default for its priority, unless the event already has one). Each list
+ * is kept in deadline order, which is push order unless an event brings an earlier deadline of its own.
+ * A full queue applies its overflow policy first, which may merge or drop the event instead.
+ * If the queue has an observer it is then shown the event, unless it was dropped.
  *
  * @param[in,out] queue  Pointer to the `EventQueue`.
  * @param[in]     event  Pointer to the `Event` to push onto the queue.
@@ -95,37 +194,77 @@ void event_queue_push(EventQueue *queue, const Event *event) {
         return;
     }
 
+    int level = event_priority_level(event->priority);
+    int outcome = EVENT_ADMITTED;
+    Event pushed;
+
     // Copy the event data into the new node
     new_node->event = *event;  
+    new_node->event.enqueue_ns = stats_now_ns();
     new_node->next = NULL;
 
-    // Find the correct spot to insert the node
-    EventNode *current = queue->head;
-    EventNode *previous = NULL;
-    while (current != NULL && current->event.priority > event->priority) {
-        previous = current;
-        current = current->next;
+    sem_wait(&queue->lock);
+
+    if (new_node->event.deadline_ns == 0 && queue->max_wait_ns[level] > 0) {
+        new_node->event.deadline_ns = new_node->event.enqueue_ns + queue->max_wait_ns[level];
+    }
+    pushed = new_node->event;
+
+    if (queue->capacity > 0 && queue->size >= queue->capacity) {
+        outcome = event_queue_make_room(queue, &new_node->event, level);
+    }
+    if (outcome != EVENT_ADMITTED) {
+        sem_post(&queue->lock);
+        free(new_node);
+        if (outcome == EVENT_MERGED && queue->observer != NULL) {
+            queue->observer(queue->observer_context, &pushed);
+        }
+        return;
     }
 
-    // Insert the new node
-    if (previous == NULL) {
-        // Insert at the head
-        new_node->next = queue->head;
-        queue->head = new_node;
+    if (queue->tails[level] == NULL) {
+        queue->heads[level] = new_node;
+        queue->tails[level] = new_node;
+    } else if (event_deadline_before(&queue->tails[level]->event, &new_node->event)) {
+        // Usual case, the new event is due no earlier than everything already in the list
+        queue->tails[level]->next = new_node;
+        queue->tails[level] = new_node;
     } else {
-        // Insert elsewhere
-        previous->next = new_node;
+        // Find the correct spot to insert the node
+        EventNode *current = queue->heads[level];
+        EventNode *previous = NULL;
+        while (current != NULL && event_deadline_before(&current->event, &new_node->event)) {
+            previous = current;
+            current = current->next;
+        }
+
         new_node->next = current;
+        if (previous == NULL) {
+            queue->heads[level] = new_node;
+        } else {
+            previous->next = new_node;
+        }
     }
 
     queue->size++;
+    if (queue->size > queue->max_size) {
+        queue->max_size = queue->size;
+    }
+    sem_post(&queue->lock);
+
+    // The node may already have been popped and freed, so the observer is shown a copy
+    if (queue->observer != NULL) {
+        queue->observer(queue->observer_context, &pushed);
+    }
 }
 
 
 /**
  * Pops an `Event` from the `EventQueue`.
  *
- * Removes the highest priority event from the queue in a thread-safe manner.
+ * Removes the next event in a thread-safe manner. Overdue events come first, earliest deadline first;
+ * otherwise the event with the highest priority after aging is chosen, the oldest one on a tie.
+ * Records how long the event sat in the queue into the queue's latency histograms.
  *
  * @param[in,out] queue  Pointer to the `EventQueue`.
  * @param[out]    event  Pointer to the `Event` structure to store the popped event.
@@ -142,25 +281,39 @@ int event_queue_pop(EventQueue *queue, Event *event) {
         return 0; 
     }
 
+    sem_wait(&queue->lock);
+
     if(queue->size == 0){
         //printf("Tried to pop from empty queue.");
+        sem_post(&queue->lock);
         return 0; 
 
     }
 
-    if(queue->head == NULL){
-        //printf("The head of the queue is null.");
+    long long now = stats_now_ns();
+    int level = event_queue_select(queue, now);
+    if(level < 0){
+        sem_post(&queue->lock);
         return 0; 
     }
 
-    // Stores the old head event in the event parameter
-    *event = queue->head->event;
+    // Stores the chosen head event in the event parameter
+    *event = queue->heads[level]->event;
+    if (queue->histograms) {
+        histogram_record(&queue->latency, now - event->enqueue_ns);
+        histogram_record(&queue->priority_latency[level], now - event->enqueue_ns);
+    } else {
+        queue->latency.total++;
+    }
 
     // Creates a temp variable to store the head node
-    EventNode *temp = queue->head;
+    EventNode *temp = queue->heads[level];
 
     // Reassigns head
-    queue->head = queue->head->next;
+    queue->heads[level] = temp->next;
+    if (queue->heads[level] == NULL) {
+        queue->tails[level] = NULL;
+    }
 
     // Frees the old head node
     free(temp);
@@ -168,14 +321,223 @@ int event_queue_pop(EventQueue *queue, Event *event) {
     // Decreases the size of the queue
     queue->size--;
 
-    // Ensure `head` is NULL when queue becomes empty
-    if (queue->size == 0) {
-        queue->head = NULL;
+    // Let a blocked producer check whether there is room now
+    if (queue->blocked_producers > 0) {
+        sem_post(&queue->space);
     }
 
+    sem_post(&queue->lock);
     return 1;
 }
 
+/**
+ * Applies the overflow policy of a full queue to an event being pushed. The queue must be locked.
+ *
+ * @param[in,out] queue  Pointer to the locked, full `EventQueue`.
+ * @param[in]     event  Pointer to the `Event` being pushed.
+ * @param[in]     level  Priority list the event belongs in.
+ * @return               EVENT_ADMITTED if the event should now be inserted, otherwise EVENT_MERGED or EVENT_DROPPED.
+ */
+static int event_queue_make_room(EventQueue *queue, const Event *event, int level) {
+    EventNode *current;
+
+    if (queue->overflow_policy == OVERFLOW_BLOCK) {
+        if (!event_queue_wait_for_space(queue)) {
+            queue->overflowed++;
+        }
+        return EVENT_ADMITTED;
+    }
+
+    if (queue->overflow_policy == OVERFLOW_MERGE) {
+        // Only the latest amount matters, the queued event keeps its place and deadline
+        for (current = queue->heads[level]; current != NULL; current = current->next) {
+            if (current->event.status == event->status &&
+                current->event.system.index == event->system.index && current->event.system.generation == event->system.generation &&
+                current->event.resource.index == event->resource.index && current->event.resource.generation == event->resource.generation) {
+                current->event.amount = event->amount;
+                queue->merged++;
+                return EVENT_MERGED;
+            }
+        }
+    }
+
+    if (event_queue_drop_oldest(queue, level)) {
+        queue->dropped++;
+        return EVENT_ADMITTED;
+    }
+
+    // Nothing queued is less important than the new event, or the reporter is about to sleep until it is handled
+    if (level == PRIORITY_HIGH || event_is_critical(event)) {
+        queue->overflowed++;
+        return EVENT_ADMITTED;
+    }
+    queue->dropped++;
+    return EVENT_DROPPED;
+}
+
+/**
+ * Blocks a producer until the queue has room, or EVENT_BLOCK_TIMEOUT_MS has passed.
+ *
+ * The queue must be locked; the lock is released while waiting and held again on return.
+ *
+ * @param[in,out] queue  Pointer to the locked, full `EventQueue`.
+ * @return               Non-zero if there is room now; zero if the wait timed out.
+ */
+static int event_queue_wait_for_space(EventQueue *queue) {
+    struct timespec timeout;
+    long long start_ns = queue->histograms ? stats_now_ns() : 0;
+    int timed_out = 0;
+
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += (EVENT_BLOCK_TIMEOUT_MS % 1000) * 1000000L;
+    timeout.tv_sec += EVENT_BLOCK_TIMEOUT_MS / 1000 + timeout.tv_nsec / 1000000000L;
+    timeout.tv_nsec %= 1000000000L;
+
+    // A pop posts `space` once for every blocked producer it sees, so stale posts only cause an extra check
+    while (queue->size >= queue->capacity && !timed_out) {
+        queue->blocked_producers++;
+        sem_post(&queue->lock);
+        while (sem_timedwait(&queue->space, &timeout) != 0) {
+            if (errno != EINTR) {
+                timed_out = 1;
+                break;
+            }
+        }
+        sem_wait(&queue->lock);
+        queue->blocked_producers--;
+    }
+
+    if (queue->histograms) {
+        histogram_record(&queue->block_time, stats_now_ns() - start_ns);
+    }
+    return queue->size < queue->capacity;
+}
+
+/**
+ * Drops the oldest event of the lowest priority, never PRIORITY_HIGH nor a critical event. The queue must be locked.
+ *
+ * @param[in,out] queue  Pointer to the locked `EventQueue`.
+ * @param[in]     level  Priority of the event being pushed; only events of this priority or lower are dropped.
+ * @return               Non-zero if an event was dropped; zero if there was none to drop.
+ */
+static int event_queue_drop_oldest(EventQueue *queue, int level) {
+    EventNode *victim, *previous;
+
+    for (int i = PRIORITY_LOW; i <= level && i < PRIORITY_HIGH; i++) {
+        previous = NULL;
+        for (victim = queue->heads[i]; victim != NULL && event_is_critical(&victim->event); victim = victim->next) {
+            previous = victim;
+        }
+        if (victim == NULL) {
+            continue;
+        }
+
+        if (previous == NULL) {
+            queue->heads[i] = victim->next;
+        } else {
+            previous->next = victim->next;
+        }
+        if (queue->tails[i] == victim) {
+            queue->tails[i] = previous;
+        }
+        free(victim);
+        queue->size--;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Chooses which priority list to pop from. The queue must be locked.
+ *
+ * Aging compares `enqueue_ns - priority * aging_ns` between the heads, the lowest (oldest after
+ * crediting priority) wins, so a lower priority event overtakes a higher one once it has waited
+ * `aging_ns` longer for every level between them.
+ *
+ * @param[in,out] queue  Pointer to the locked `EventQueue`, whose `promoted` count is updated.
+ * @param[in]     now    Current time, from `stats_now_ns`.
+ * @return               Priority level to pop from, or -1 if every list is empty.
+ */
+static int event_queue_select(EventQueue *queue, long long now) {
+    const Event *head;
+    int level, chosen = -1, top = -1, overdue = -1;
+    long long key, chosen_key = 0;
+
+    for (level = EVENT_PRIORITY_LEVELS - 1; level >= 0; level--) {
+        if (queue->heads[level] == NULL) {
+            continue;
+        }
+        head = &queue->heads[level]->event;
+        if (top < 0) {
+            top = level;
+        }
+
+        if (head->deadline_ns != 0 && head->deadline_ns <= now &&
+            (overdue < 0 || head->deadline_ns < queue->heads[overdue]->event.deadline_ns)) {
+            overdue = level;
+        }
+
+        key = head->enqueue_ns - level * queue->aging_ns;
+        if (queue->aging_ns > 0 && (chosen < 0 || key < chosen_key)) {
+            chosen = level;
+            chosen_key = key;
+        }
+    }
+
+    if (overdue >= 0) {
+        chosen = overdue;
+    } else if (chosen < 0) {
+        chosen = top;
+    }
+
+    if (chosen != top) {
+        queue->promoted++;
+    }
+    return chosen;
+}
+
+/**
+ * Maps an event priority to the index of its list in the `EventQueue`.
+ *
+ * @param[in] priority  Priority of the event.
+ * @return              Priority clamped to PRIORITY_LOW..PRIORITY_HIGH.
+ */
+static int event_priority_level(int priority) {
+    if (priority < PRIORITY_LOW) {
+        return PRIORITY_LOW;
+    }
+    return priority > PRIORITY_HIGH ? PRIORITY_HIGH : priority;
+}
+
+/**
+ * Returns whether an event is due no later than another, for keeping a priority list in deadline order.
+ *
+ * @param[in] event  Pointer to the `Event` already in the list.
+ * @param[in] other  Pointer to the `Event` being inserted.
+ * @return           Non-zero if `event` should stay ahead of `other`.
+ */
+static int event_deadline_before(const Event *event, const Event *other) {
+    if (other->deadline_ns == 0) {
+        return 1;
+    }
+    return event->deadline_ns != 0 && event->deadline_ns <= other->deadline_ns;
+}
+
+/**
+ * Checks whether an event must never be dropped.
+ *
+ * A system reporting that it ran out, didn't have enough, or had no room then sleeps on the resource's
+ * wait list and doesn't report again, so the event is the only notice the manager gets; for Oxygen and
+ * Distance it is how the run ends.
+ *
+ * @param[in] event  Pointer to the `Event`.
+ * @return           Non-zero if the event is STATUS_EMPTY, STATUS_INSUFFICIENT or STATUS_CAPACITY.
+ */
+static int event_is_critical(const Event *event) {
+    return event->status == STATUS_EMPTY || event->status == STATUS_INSUFFICIENT || event->status == STATUS_CAPACITY;
+}
+
 
 
 // valgrind --leak-check=full -s ./program
@@ -0,0 +1,140 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Helper functions just used by this C file
+static void export_copy_name(char *destination, const char *name);
+
+/**
+ * Creates (or replaces) the shared memory region that the simulation's state is published to.
+ *
+ * The region is a fixed layout `ExportRegion` under /dev/shm, so monitors can map it read-only and read it
+ * with plain loads. Nothing is published until the first `export_publish`.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` to publish.
+ * @param[in]     name     Name of the region, starting with '/' (e.g. EXPORT_DEFAULT_NAME).
+ * @return                 Non-zero if the region was created; zero otherwise.
+ */
+int export_open(Manager *manager, const char *name) {
+    ExportRegion *region;
+    int fd;
+
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("Could not create shared memory region %s\n", name);
+        return 0;
+    }
+
+    if (ftruncate(fd, sizeof(ExportRegion)) != 0) {
+        printf("Could not size shared memory region %s\n", name);
+        close(fd);
+        return 0;
+    }
+
+    region = (ExportRegion *)mmap(NULL, sizeof(ExportRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        printf("Could not map shared memory region %s\n", name);
+        return 0;
+    }
+
+    // The magic goes in last, a reader that sees it can trust the rest of the header
+    memset(region, 0, sizeof(ExportRegion));
+    region->version = EXPORT_VERSION;
+    region->size = sizeof(ExportRegion);
+    __atomic_store_n(&region->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+    manager->export = region;
+    return 1;
+}
+
+/**
+ * Publishes the current state of the simulation to the export region, if there is one.
+ *
+ * Only the manager's thread may publish. The update is bracketed by the seqlock, so it costs a few
+ * stores per resource and system and never waits for readers.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` to publish.
+ */
+void export_publish(Manager *manager) {
+    ExportRegion *region = manager->export;
+    unsigned int sequence;
+    int i;
+
+    if (region == NULL) {
+        return;
+    }
+
+    // Odd while writing; the fence keeps the writes below from becoming visible before it
+    sequence = region->sequence;
+    __atomic_store_n(&region->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    region->clock_ms = clock_now_ms(&manager->clock);
+    region->simulation_running = manager->simulation_running;
+    region->termination_reason = manager->termination_reason;
+    region->queue_size = manager->event_queue.size;
+    region->queue_max_size = manager->event_queue.max_size;
+    region->events = manager->event_queue.latency.total;
+    region->dropped = manager->event_queue.dropped;
+
+    region->resource_count = manager->resources.size < EXPORT_MAX_RESOURCES ? manager->resources.size : EXPORT_MAX_RESOURCES;
+    for (i = 0; i < region->resource_count; i++) {
+        Resource *resource = manager->resources.items[i];
+        ExportResource *published = &region->resources[i];
+
+        export_copy_name(published->name, resource->name);
+        published->amount = __atomic_load_n(&resource->amount, __ATOMIC_RELAXED);
+        published->max_capacity = resource->max_capacity;
+    }
+
+    region->system_count = manager->systems.size < EXPORT_MAX_SYSTEMS ? manager->systems.size : EXPORT_MAX_SYSTEMS;
+    for (i = 0; i < region->system_count; i++) {
+        System *system = manager->systems.items[i];
+        ExportSystem *published = &region->systems[i];
+
+        export_copy_name(published->name, system->name);
+        published->status = __atomic_load_n(&system->status, __ATOMIC_RELAXED);
+        published->waiting = __atomic_load_n(&system->waiting, __ATOMIC_RELAXED);
+        published->conversions = system->stats.conversions;
+        published->stores = system->stats.stores;
+        published->stalls = system->stats.stalls[STATUS_EMPTY] + system->stats.stalls[STATUS_INSUFFICIENT] +
+                            system->stats.stalls[STATUS_CAPACITY];
+    }
+
+    region->updates++;
+    __atomic_store_n(&region->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Unmaps and removes the export region.
+ *
+ * Monitors that already have it mapped keep their mapping, showing the final state.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` that opened the region.
+ * @param[in]     name     Name the region was opened with.
+ */
+void export_close(Manager *manager, const char *name) {
+    if (manager->export == NULL) {
+        return;
+    }
+
+    munmap(manager->export, sizeof(ExportRegion));
+    shm_unlink(name);
+    manager->export = NULL;
+}
+
+/**
+ * Copies a name into a fixed size field, truncating it if needed.
+ *
+ * @param[out] destination  Field of EXPORT_NAME_LENGTH characters.
+ * @param[in]  name         Name to copy.
+ */
+static void export_copy_name(char *destination, const char *name) {
+    strncpy(destination, name, EXPORT_NAME_LENGTH - 1);
+    destination[EXPORT_NAME_LENGTH - 1] = '\0';
+}
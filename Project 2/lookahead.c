@@ -0,0 +1,537 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOOKAHEAD_REACHED  2000000.0    // Score of reaching the destination, before crediting how early
+#define LOOKAHEAD_DEPLETED -2000000.0   // Score of running out of oxygen, before crediting the distance covered by then
+
+// Helper functions just used by this C file
+static int lookahead_reserve(Lookahead *lookahead, int resource_count, int system_count);
+static void lookahead_capture(Lookahead *lookahead, Manager *manager);
+static void lookahead_copy(const Lookahead *lookahead, LookaheadState *copy);
+static int lookahead_add_candidates(Lookahead *lookahead);
+static void *lookahead_worker(void *arg);
+static void *lookahead_pool_thread(void *arg);
+static void lookahead_start_pool(Lookahead *lookahead);
+static double lookahead_simulate(const Lookahead *lookahead, LookaheadState *state);
+static int lookahead_step(const Lookahead *lookahead, LookaheadState *state, LookaheadSystem *system);
+static int lookahead_adjusted_time(const LookaheadSystem *system);
+static int lookahead_resource_position(Manager *manager, Resource *resource);
+
+/**
+ * Initializes a `Lookahead`, disabled and with no state allocated.
+ *
+ * @param[out] lookahead  Pointer to the `Lookahead` to initialize.
+ */
+void lookahead_init(Lookahead *lookahead) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(lookahead, 0, sizeof(Lookahead));
+    lookahead->horizon_ms = LOOKAHEAD_HORIZON_MS;
+    lookahead->thread_count = processors < 1 ? 1 : processors > LOOKAHEAD_MAX_THREADS ? LOOKAHEAD_MAX_THREADS : (int)processors;
+    lookahead->oxygen = -1;
+    lookahead->distance = -1;
+}
+
+/**
+ * Frees the state copies of a `Lookahead`.
+ *
+ * @param[in,out] lookahead  Pointer to the `Lookahead` to clean.
+ */
+void lookahead_clean(Lookahead *lookahead) {
+    if (lookahead == NULL) {
+        return;
+    }
+
+    if (lookahead->pool_size > 0) {
+        lookahead->pool_stop = 1;
+        for (int i = 0; i < lookahead->pool_size; i++) {
+            sem_post(&lookahead->pool_start);
+        }
+        for (int i = 0; i < lookahead->pool_size; i++) {
+            pthread_join(lookahead->threads[i], NULL);
+        }
+        sem_destroy(&lookahead->pool_start);
+        sem_destroy(&lookahead->pool_done);
+        lookahead->pool_size = 0;
+        lookahead->pool_stop = 0;
+    }
+
+    for (int i = -1; i < LOOKAHEAD_MAX_CANDIDATES; i++) {
+        LookaheadState *state = i < 0 ? &lookahead->base : &lookahead->candidates[i];
+        free(state->amounts);
+        free(state->capacities);
+        free(state->systems);
+        state->amounts = NULL;
+        state->capacities = NULL;
+        state->systems = NULL;
+    }
+    lookahead->allocated_resources = 0;
+    lookahead->allocated_systems = 0;
+}
+
+/**
+ * Picks the status of every system by running candidate assignments forward, and applies the best one.
+ *
+ * The candidates are the current statuses, and each system switched to FAST or to SLOW on its own. Each
+ * gets its own compact copy of the resources and systems, which is run forward `horizon_ms` of virtual
+ * time with the statuses held fixed, spread over the manager's thread and a pool of `thread_count - 1`
+ * threads kept from one cycle to the next. A candidate scores best by
+ * reaching the destination soonest, otherwise by not running out of oxygen and then by distance covered
+ * and oxygen kept, otherwise by the distance covered before oxygen runs out. The current statuses win
+ * any tie, so nothing changes without a reason. Only the one status the best candidate changed is
+ * applied, so statuses set since the capture are kept.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`, whose systems' statuses may be changed.
+ * @return                 Non-zero if a status was changed; zero otherwise.
+ */
+int lookahead_run(Manager *manager) {
+    Lookahead *lookahead = &manager->lookahead;
+    int i, best = 0, changed = 0, status;
+    long long start_ns;
+    Handle none = {0, 0};
+    System *system = NULL;
+
+    if (!lookahead->enabled || !manager->simulation_running || manager->systems.size == 0) {
+        return 0;
+    }
+    if (!lookahead_reserve(lookahead, manager->resources.size, manager->systems.size)) {
+        lookahead->enabled = 0;
+        return 0;
+    }
+
+    start_ns = stats_now_ns();
+    lookahead_capture(lookahead, manager);
+    lookahead->candidate_count = lookahead_add_candidates(lookahead);
+    lookahead->clone_ns += stats_now_ns() - start_ns;
+
+    if (lookahead->pool_size == 0 && lookahead->thread_count > 1) {
+        lookahead_start_pool(lookahead);
+    }
+
+    start_ns = stats_now_ns();
+    lookahead->next_candidate = 0;
+    for (i = 0; i < lookahead->pool_size; i++) {
+        sem_post(&lookahead->pool_start);
+    }
+    lookahead_worker(lookahead);
+    for (i = 0; i < lookahead->pool_size; i++) {
+        sem_wait(&lookahead->pool_done);
+    }
+    lookahead->evaluate_ns += stats_now_ns() - start_ns;
+
+    for (i = 1; i < lookahead->candidate_count; i++) {
+        if (lookahead->scores[i] > lookahead->scores[best]) {
+            best = i;
+        }
+    }
+
+    lookahead->cycles++;
+    lookahead->evaluated += lookahead->candidate_count;
+    if (best == 0) {
+        return 0;
+    }
+
+    // A candidate only differs from the capture in one system. Every other status may have been changed
+    // since by the event handler or a manager worker, and is newer than the captured one, so it is left
+    // alone; so is the chosen system's, if it no longer has the status the candidate was compared against
+    i = lookahead->changed[best];
+    status = lookahead->candidates[best].systems[i].status;
+    dispatch_lock(&manager->dispatcher);
+    system = manager->systems.items[i];
+    if (system->status == lookahead->base.systems[i].status) {
+        if (system->trace != NULL) {
+            trace_instant(manager->tracer.buffers[0], TRACE_STATUS, status, system->trace->track, none);
+        }
+        system->status = status;
+        changed = 1;
+    }
+    dispatch_unlock(&manager->dispatcher);
+
+    lookahead->applied += changed;
+    return changed;
+}
+
+/**
+ * Prints what the lookahead did and what it cost.
+ *
+ * @param[in] lookahead  Pointer to the `Lookahead`.
+ * @param[in] stream     Stream to print to.
+ */
+void lookahead_print(const Lookahead *lookahead, FILE *stream) {
+    if (!lookahead->enabled || lookahead->cycles == 0) {
+        return;
+    }
+
+    fprintf(stream, "Lookahead: %lld cycles, %lld candidates, %lld applied; per cycle clone %.1fus, evaluate %.1fus; "
+            "%.0f virtual s simulated per wall s\n",
+            lookahead->cycles, lookahead->evaluated, lookahead->applied,
+            lookahead->clone_ns / 1000.0 / lookahead->cycles, lookahead->evaluate_ns / 1000.0 / lookahead->cycles,
+            lookahead->evaluate_ns > 0 ? lookahead->simulated_ms / 1000.0 / (lookahead->evaluate_ns / 1e9) : 0.0);
+}
+
+/**
+ * Makes sure every state copy has room for the given number of resources and systems.
+ *
+ * Use of realloc is NOT permitted, and the copies are overwritten every cycle anyway, so they are
+ * simply allocated again (doubling) when the simulation has grown.
+ *
+ * @param[in,out] lookahead       Pointer to the `Lookahead`.
+ * @param[in]     resource_count  Number of resources to make room for.
+ * @param[in]     system_count    Number of systems to make room for.
+ * @return                        Non-zero if there is room; zero if memory ran out.
+ */
+static int lookahead_reserve(Lookahead *lookahead, int resource_count, int system_count) {
+    int resources = lookahead->allocated_resources > 0 ? lookahead->allocated_resources : 1;
+    int systems = lookahead->allocated_systems > 0 ? lookahead->allocated_systems : 1;
+
+    if (resource_count <= lookahead->allocated_resources && system_count <= lookahead->allocated_systems) {
+        return 1;
+    }
+
+    while (resources < resource_count) {
+        resources *= 2;
+    }
+    while (systems < system_count) {
+        systems *= 2;
+    }
+
+    lookahead_clean(lookahead);
+    for (int i = -1; i < LOOKAHEAD_MAX_CANDIDATES; i++) {
+        LookaheadState *state = i < 0 ? &lookahead->base : &lookahead->candidates[i];
+        state->amounts = (int *)malloc(resources * sizeof(int));
+        state->capacities = (int *)malloc(resources * sizeof(int));
+        state->systems = (LookaheadSystem *)malloc(systems * sizeof(LookaheadSystem));
+        if (state->amounts == NULL || state->capacities == NULL || state->systems == NULL) {
+            printf("Failed to allocate memory for lookahead\n");
+            lookahead_clean(lookahead);
+            return 0;
+        }
+    }
+
+    lookahead->allocated_resources = resources;
+    lookahead->allocated_systems = systems;
+    return 1;
+}
+
+/**
+ * Copies the manager's resources and systems into the lookahead's base state.
+ *
+ * Systems refer to resources by their position in the resource slot map, found in O(1) from the handle.
+ *
+ * @param[in,out] lookahead  Pointer to the `Lookahead`, with room reserved.
+ * @param[in]     manager    Pointer to the `Manager` to copy.
+ */
+static void lookahead_capture(Lookahead *lookahead, Manager *manager) {
+    LookaheadState *base = &lookahead->base;
+    int i;
+
+    base->resource_count = manager->resources.size;
+    base->system_count = manager->systems.size;
+    base->now_ms = 0;
+    lookahead->serial = !manager->threads_running;
+    lookahead->oxygen = -1;
+    lookahead->distance = -1;
+
+    for (i = 0; i < base->resource_count; i++) {
+        Resource *resource = manager->resources.items[i];
+
+        base->amounts[i] = __atomic_load_n(&resource->amount, __ATOMIC_RELAXED);
+        base->capacities[i] = resource->max_capacity;
+        if (strcmp(resource->name, "Oxygen") == 0) {
+            lookahead->oxygen = i;
+        } else if (strcmp(resource->name, "Distance") == 0) {
+            lookahead->distance = i;
+        }
+    }
+
+    for (i = 0; i < base->system_count; i++) {
+        System *system = manager->systems.items[i];
+        LookaheadSystem *copy = &base->systems[i];
+
+        copy->consumed = lookahead_resource_position(manager, system->consumed.resource);
+        copy->consumed_amount = system->consumed.amount;
+        copy->produced = lookahead_resource_position(manager, system->produced.resource);
+        copy->produced_amount = system->produced.amount;
+        copy->processing_time = (int)(system->processing_time * system->time_scale + 0.5);
+        copy->status = system->status;
+        copy->stored = system->amount_stored;
+        copy->ready_ms = 0;
+    }
+}
+
+/**
+ * Copies the base state into a candidate's state.
+ *
+ * @param[in]  lookahead  Pointer to the `Lookahead` holding the base state.
+ * @param[out] copy       Pointer to the candidate `LookaheadState`, with room reserved.
+ */
+static void lookahead_copy(const Lookahead *lookahead, LookaheadState *copy) {
+    const LookaheadState *base = &lookahead->base;
+
+    copy->resource_count = base->resource_count;
+    copy->system_count = base->system_count;
+    copy->now_ms = base->now_ms;
+    memcpy(copy->amounts, base->amounts, base->resource_count * sizeof(int));
+    memcpy(copy->capacities, base->capacities, base->resource_count * sizeof(int));
+    memcpy(copy->systems, base->systems, base->system_count * sizeof(LookaheadSystem));
+}
+
+/**
+ * Fills in the candidates: the current statuses first, then one system at a time switched to FAST or SLOW.
+ *
+ * Only so many systems fit in LOOKAHEAD_MAX_CANDIDATES, so each cycle starts from the system after the
+ * last one the previous cycle tried, and larger scenarios have every system tried in turn.
+ *
+ * @param[in,out] lookahead  Pointer to the `Lookahead` with its base state captured.
+ * @return                   Number of candidates.
+ */
+static int lookahead_add_candidates(Lookahead *lookahead) {
+    static const int alternatives[] = {FAST, SLOW};
+    const LookaheadState *base = &lookahead->base;
+    int count = 1, i, j, k, first;
+
+    lookahead_copy(lookahead, &lookahead->candidates[0]);
+    lookahead->changed[0] = -1;
+
+    // Systems may have been removed since the last cycle
+    first = lookahead->next_system < base->system_count ? lookahead->next_system : 0;
+    for (k = 0; k < base->system_count && count < LOOKAHEAD_MAX_CANDIDATES; k++) {
+        i = (first + k) % base->system_count;
+        lookahead->next_system = (i + 1) % base->system_count;
+        if (base->systems[i].status == TERMINATE) {
+            continue;
+        }
+        for (j = 0; j < 2 && count < LOOKAHEAD_MAX_CANDIDATES; j++) {
+            if (base->systems[i].status == alternatives[j]) {
+                continue;
+            }
+            lookahead_copy(lookahead, &lookahead->candidates[count]);
+            lookahead->candidates[count].systems[i].status = alternatives[j];
+            lookahead->changed[count] = i;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Claims candidates and runs them forward until there are none left.
+ *
+ * @param[in,out] arg  Pointer to the `Lookahead`.
+ * @return             Always NULL.
+ */
+static void *lookahead_worker(void *arg) {
+    Lookahead *lookahead = (Lookahead *)arg;
+    int candidate;
+
+    while ((candidate = __atomic_fetch_add(&lookahead->next_candidate, 1, __ATOMIC_RELAXED)) < lookahead->candidate_count) {
+        lookahead->scores[candidate] = lookahead_simulate(lookahead, &lookahead->candidates[candidate]);
+        __atomic_fetch_add(&lookahead->simulated_ms, lookahead->candidates[candidate].now_ms, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the pool of threads that help the manager's thread evaluate candidates.
+ *
+ * Started once and kept until `lookahead_clean`, so a cycle only costs a post and a wait per thread
+ * rather than creating and joining threads every manager loop. If fewer threads start, the pool is smaller.
+ *
+ * @param[in,out] lookahead  Pointer to the `Lookahead`.
+ */
+static void lookahead_start_pool(Lookahead *lookahead) {
+    sem_init(&lookahead->pool_start, 0, 0);
+    sem_init(&lookahead->pool_done, 0, 0);
+    lookahead->pool_stop = 0;
+
+    for (int i = 0; i < lookahead->thread_count - 1; i++) {
+        if (pthread_create(&lookahead->threads[i], NULL, lookahead_pool_thread, lookahead) != 0) {
+            break;
+        }
+        lookahead->pool_size++;
+    }
+}
+
+/**
+ * Runs one pool thread: evaluates candidates every time a cycle starts, until the pool is stopped.
+ *
+ * @param[in,out] arg  Pointer to the `Lookahead`.
+ * @return             Always NULL.
+ */
+static void *lookahead_pool_thread(void *arg) {
+    Lookahead *lookahead = (Lookahead *)arg;
+
+    while (1) {
+        sem_wait(&lookahead->pool_start);
+        if (lookahead->pool_stop) {
+            break;
+        }
+        lookahead_worker(lookahead);
+        sem_post(&lookahead->pool_done);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs a candidate forward until the horizon, the destination, or running out of oxygen, and scores it.
+ *
+ * In the single threaded loop the systems take turns, each turn taking the system's processing time; with
+ * a thread per system each acts as soon as it is ready, and only the earliest is stepped at a time.
+ *
+ * @param[in]     lookahead  Pointer to the `Lookahead`.
+ * @param[in,out] state      Pointer to the candidate `LookaheadState`, left at the end of the run.
+ * @return                   Score of the candidate, higher is better.
+ */
+static double lookahead_simulate(const Lookahead *lookahead, LookaheadState *state) {
+    LookaheadSystem *system, *next;
+    int i, acted, outcome = 0;
+    int min_oxygen = lookahead->oxygen >= 0 ? state->amounts[lookahead->oxygen] : 0;
+
+    while (state->now_ms < lookahead->horizon_ms && outcome == 0) {
+        if (lookahead->serial) {
+            acted = 0;
+            for (i = 0; i < state->system_count && outcome <= 0; i++) {
+                system = &state->systems[i];
+                if (system->status != TERMINATE) {
+                    outcome = lookahead_step(lookahead, state, system);
+                    acted += (outcome >= 0);
+                }
+            }
+            // Every system is waiting, so the manager idles as in `main`
+            if (!acted) {
+                state->now_ms += MANAGER_WAIT_TIME;
+            }
+        } else {
+            next = NULL;
+            for (i = 0; i < state->system_count; i++) {
+                system = &state->systems[i];
+                if (system->status != TERMINATE && (next == NULL || system->ready_ms < next->ready_ms)) {
+                    next = system;
+                }
+            }
+            if (next == NULL) {
+                break;
+            }
+            if (next->ready_ms > state->now_ms) {
+                state->now_ms = next->ready_ms;
+            }
+            outcome = lookahead_step(lookahead, state, next);
+            if (outcome < 0) {
+                // Stalled: try again once the others have had a chance to change things
+                next->ready_ms = state->now_ms + SYSTEM_WAIT_TIME;
+            }
+        }
+
+        if (outcome < 0) {
+            outcome = 0;
+        }
+        if (lookahead->oxygen >= 0 && state->amounts[lookahead->oxygen] < min_oxygen) {
+            min_oxygen = state->amounts[lookahead->oxygen];
+        }
+    }
+
+    if (outcome == END_DESTINATION) {
+        return LOOKAHEAD_REACHED + (lookahead->horizon_ms - state->now_ms);
+    }
+    if (outcome == END_OXYGEN) {
+        // The run ends there whatever else happens, so what counts is the distance covered by then, and
+        // only between equal distances how late it happens
+        return LOOKAHEAD_DEPLETED + (lookahead->distance >= 0 ?
+               1000000.0 * state->amounts[lookahead->distance] / state->capacities[lookahead->distance] : 0.0) +
+               (double)state->now_ms / lookahead->horizon_ms;
+    }
+
+    // Neither happened within the horizon: favour progress, then keeping oxygen in reserve
+    return (lookahead->distance >= 0 ? 1000.0 * state->amounts[lookahead->distance] / state->capacities[lookahead->distance] : 0.0) +
+           (lookahead->oxygen >= 0 ? 100.0 * min_oxygen / state->capacities[lookahead->oxygen] : 0.0);
+}
+
+/**
+ * Runs one loop of a system in a state copy, as `system_run` would.
+ *
+ * @param[in]     lookahead  Pointer to the `Lookahead`.
+ * @param[in,out] state      Pointer to the `LookaheadState`.
+ * @param[in,out] system     Pointer to the `LookaheadSystem` to run.
+ * @return                   END_OXYGEN or END_DESTINATION if the run ends, -1 if the system is stalled, otherwise 0.
+ */
+static int lookahead_step(const Lookahead *lookahead, LookaheadState *state, LookaheadSystem *system) {
+    int space, stored;
+
+    if (system->stored == 0) {
+        if (system->consumed >= 0) {
+            if (state->amounts[system->consumed] < system->consumed_amount) {
+                return (system->consumed == lookahead->oxygen && state->amounts[system->consumed] == 0) ? END_OXYGEN : -1;
+            }
+            state->amounts[system->consumed] -= system->consumed_amount;
+        }
+
+        if (lookahead->serial) {
+            state->now_ms += lookahead_adjusted_time(system);
+        } else {
+            system->ready_ms = state->now_ms + lookahead_adjusted_time(system);
+        }
+        system->stored = system->produced >= 0 ? system->produced_amount : 0;
+        if (!lookahead->serial) {
+            // The store happens once the processing time is up
+            return 0;
+        }
+    }
+
+    if (system->stored > 0) {
+        space = state->capacities[system->produced] - state->amounts[system->produced];
+        stored = space < system->stored ? space : system->stored;
+        state->amounts[system->produced] += stored;
+        system->stored -= stored;
+
+        if (system->stored > 0) {
+            return system->produced == lookahead->distance ? END_DESTINATION : -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns a system's processing time adjusted for its status, as `system_simulate_process_time` does.
+ *
+ * @param[in] system  Pointer to the `LookaheadSystem`.
+ * @return            Processing time in milliseconds, at least 1 so virtual time always advances.
+ */
+static int lookahead_adjusted_time(const LookaheadSystem *system) {
+    int time;
+
+    switch (system->status) {
+        case SLOW:
+            time = system->processing_time * 2;
+            break;
+        case FAST:
+            time = system->processing_time / 2;
+            break;
+        default:
+            time = system->processing_time;
+    }
+
+    return time > 0 ? time : 1;
+}
+
+/**
+ * Returns the position of a resource in the manager's resource slot map.
+ *
+ * @param[in] manager   Pointer to the `Manager`.
+ * @param[in] resource  Pointer to the `Resource`, may be NULL.
+ * @return              Position in `manager->resources.items`, or -1 for NULL.
+ */
+static int lookahead_resource_position(Manager *manager, Resource *resource) {
+    if (resource == NULL) {
+        return -1;
+    }
+
+    return manager->resources.slots[resource->handle.index].dense;
+}
@@ -2,27 +2,289 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <pthread.h>
+#include <unistd.h>
 
-void load_data(Manager *manager);
+static int load_arguments(Manager *manager, int argc, char *argv[], int *threaded, const char **export_name, const char **trace_name);
+static void print_usage(const char *program);
 
-int main(void) {
+int main(int argc, char *argv[]) {
     Manager manager;
+    int threaded = 0;
+    const char *export_name = NULL;
+    const char *trace_name = NULL;
+    FILE *trace_file = NULL;
     manager_init(&manager);
-    load_data(&manager);
 
-    while (manager.simulation_running) {
-        manager_run(&manager);
-        for (int i = 0; i < manager.system_array.size; ++i) {
-            system_run(manager.system_array.systems[i]);
+    // Some options do all of their work while loading, so there may be nothing left to run
+    int loaded = load_arguments(&manager, argc, argv, &threaded, &export_name, &trace_name);
+    if (loaded <= 0) {
+        manager_clean(&manager);
+        return loaded < 0 ? 1 : 0;
+    }
+
+    if (export_name != NULL && !export_open(&manager, export_name)) {
+        manager_clean(&manager);
+        return 1;
+    }
+
+    if (manager.dispatcher.worker_count > 0 && !dispatch_start(&manager)) {
+        manager_clean(&manager);
+        return 1;
+    }
+
+    if (threaded) {
+        // Every system runs on its own thread, this one only has to manage them
+        manager_start_threads(&manager);
+        while (manager.simulation_running) {
+            manager_run(&manager);
+            usleep(MANAGER_WAIT_TIME * 1000);
+        }
+        // No worker may be left to change a status once the system threads are told to terminate
+        dispatch_stop(&manager);
+        manager_stop_threads(&manager);
+    } else {
+        while (manager.simulation_running) {
+            manager_run(&manager);
+            if (manager_run_systems(&manager) == 0) {
+                // Every system is waiting, so give the manager time before checking again
+                clock_sleep_ms(&manager.clock, MANAGER_WAIT_TIME);
+            }
         }
+        dispatch_stop(&manager);
+    }
+
+    if (!manager.display_enabled) {
+        printf("Simulation ended: %s\n", manager_termination_name(manager.termination_reason));
     }
+    manager_stats_print(&manager, stdout);
+    export_close(&manager, export_name);
 
+    // Written after the threads have stopped, so nothing records while the buffers are read
+    if (trace_name != NULL) {
+        trace_file = fopen(trace_name, "w");
+        if (trace_file == NULL) {
+            printf("Could not create trace %s\n", trace_name);
+        } else {
+            trace_write(&manager, trace_file);
+            fclose(trace_file);
+            printf("Trace written to %s\n", trace_name);
+        }
+    }
     manager_clean(&manager);
     
     return 0;
 }
 
+/**
+ * Parses the command line and loads the scenario it selects.
+ *
+ * With no scenario option the sample rocket from `load_data` is used.
+ *     --quiet                                       Don't display the state or print events
+ *     --threads                                     Run every system on its own thread
+ *     --pin                                         With --threads, pin the threads of systems sharing resources to neighbouring CPUs
+ *     --scenario <file>                             Load a scenario file
+ *     --generate <systems> <resources> <seed> [name=value ...] [file]
+ *                                                   Generate a random scenario, writing it to `file` if given; see
+ *                                                   `scenario_config_set` for the options shaping the graph
+ *     --sweep [threads] [name=value ...]            Run a parameter sweep over the scenario instead of a single simulation;
+ *                                                   see `sweep_config_set` for the axes, `sweep_run` for the default grid
+ *     --shards <count>                              Compare a single-process run against one split over `count` processes
+ *     --queue <capacity> <block|drop|merge>         Bound the event queue, with the given overflow policy (0 for no bound);
+ *                                                   block needs --threads or --workers, so another thread pops
+ *     --workers <count>                             Handle events on `count` manager workers, each owning a shard of the resources
+ *     --lookahead [horizon_ms]                      Try status changes forward in virtual time every manager loop
+ *     --control [tick_ms]                           Steer every producer's rate from its resource's fill level instead of SLOW/FAST
+ *     --export [/name]                              Publish the state to shared memory for `monitor` (default /rocket_sim)
+ *     --trace <file> [budget_mb]                    Write a Chrome trace of every system phase, event and status change
+ *     --no-stats                                    Don't record stall, status and event latency times (the counters are kept)
+ *     --bench-queue                                 Measure event queue delay per priority under an adversarial load
+ *     --bench-placement                             Count resource cache line transfers between CPUs with and without --pin
+ *     --bench-dispatch                              Measure events handled per second by the manager alone and by 1 to 2x CPUs workers
+ *     --bench-slotmap                               Compare slot map and plain array iteration, and add and remove systems mid-run
+ *     --bench-stats                                 Measure the cost of the timing statistics by running with and without them
+ *
+ * @param[in,out] manager  Pointer to the `Manager` to populate.
+ * @param[in]     argc     Argument count from `main`.
+ * @param[in]     argv     Arguments from `main`.
+ * @param[out]    threaded Set to non-zero if every system should run on its own thread.
+ * @param[out]    export_name Set to the name of the shared memory region to publish the state to, if any.
+ * @param[out]    trace_name  Set to the file to write the trace to, if tracing.
+ * @return                 1 if the simulation should run, 0 to exit successfully, or -1 on an error.
+ */
+static int load_arguments(Manager *manager, int argc, char *argv[], int *threaded, const char **export_name, const char **trace_name) {
+    ScenarioConfig config;
+    SweepConfig sweep;
+    FILE *file = NULL;
+    char *scenario_text = NULL;
+    size_t scenario_length = 0;
+    int loaded = 0, success, shard_count = 0, policy, budget, sweeping = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quiet") == 0) {
+            manager->display_enabled = 0;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            *threaded = 1;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            manager->placement.enabled = 1;
+            manager->placement.count_transfers = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shard_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sweep") == 0) {
+            sweep_config_init(&sweep);
+            sweeping = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && strchr(argv[i + 1], '=') == NULL) {
+                sweep.thread_count = atoi(argv[++i]);
+            }
+            while (i + 1 < argc && argv[i + 1][0] != '-' && strchr(argv[i + 1], '=') != NULL) {
+                if (!sweep_config_set(&sweep, argv[++i])) {
+                    printf("Unknown or invalid sweep option %s\n", argv[i]);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            }
+        } else if (strcmp(argv[i], "--queue") == 0 && i + 2 < argc) {
+            policy = -1;
+            for (int j = OVERFLOW_BLOCK; j <= OVERFLOW_MERGE; j++) {
+                if (strcmp(argv[i + 2], event_queue_policy_name(j)) == 0) {
+                    policy = j;
+                }
+            }
+            if (policy < 0) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            event_queue_set_capacity(&manager->event_queue, atoi(argv[i + 1]), policy);
+            i += 2;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            manager->dispatcher.worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lookahead") == 0) {
+            manager->lookahead.enabled = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                manager->lookahead.horizon_ms = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--control") == 0) {
+            manager->control.enabled = 1;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                manager->control.tick_ms = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--export") == 0) {
+            *export_name = EXPORT_DEFAULT_NAME;
+            if (i + 1 < argc && argv[i + 1][0] == '/') {
+                *export_name = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            *trace_name = argv[++i];
+            budget = TRACE_DEFAULT_BUDGET_MB;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                budget = atoi(argv[++i]);
+            }
+            if (!trace_enable(manager, budget)) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--no-stats") == 0) {
+            manager_set_stats_timing(manager, 0);
+        } else if (strcmp(argv[i], "--bench-queue") == 0) {
+            return bench_event_queue(stdout) ? 0 : -1;
+        } else if (strcmp(argv[i], "--bench-placement") == 0) {
+            return bench_placement(stdout) ? 0 : -1;
+        } else if (strcmp(argv[i], "--bench-dispatch") == 0) {
+            return bench_dispatch(stdout) ? 0 : -1;
+        } else if (strcmp(argv[i], "--bench-slotmap") == 0) {
+            return bench_slot_map(stdout) ? 0 : -1;
+        } else if (strcmp(argv[i], "--bench-stats") == 0) {
+            return bench_stats(stdout) ? 0 : -1;
+        } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc && !loaded) {
+            file = fopen(argv[++i], "r");
+            if (file == NULL) {
+                printf("Could not open scenario %s\n", argv[i]);
+                return -1;
+            }
+            success = scenario_load(manager, file);
+            fclose(file);
+            if (!success) {
+                return -1;
+            }
+            loaded = 1;
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 3 < argc && !loaded) {
+            scenario_config_init(&config);
+            config.system_count = atoi(argv[i + 1]);
+            config.resource_count = atoi(argv[i + 2]);
+            config.seed = strtoull(argv[i + 3], NULL, 10);
+            i += 3;
+            // Optional name=value shape settings come before the file
+            while (i + 1 < argc && argv[i + 1][0] != '-' && strchr(argv[i + 1], '=') != NULL) {
+                if (!scenario_config_set(&config, argv[++i])) {
+                    printf("Unknown or invalid generator option %s\n", argv[i]);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            }
+            if (!scenario_generate(manager, &config)) {
+                return -1;
+            }
+            loaded = 1;
+
+            // Writing the scenario to a file replaces running it
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                file = fopen(argv[++i], "w");
+                if (file == NULL) {
+                    printf("Could not create scenario %s\n", argv[i]);
+                    return -1;
+                }
+                scenario_write(manager, file);
+                fclose(file);
+                return 0;
+            }
+        } else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // A blocked push waits for another thread to pop, which the single threaded loop doesn't have
+    if (manager->event_queue.capacity > 0 && manager->event_queue.overflow_policy == OVERFLOW_BLOCK &&
+        !*threaded && manager->dispatcher.worker_count <= 0) {
+        printf("--queue <capacity> block needs --threads or --workers\n");
+        return -1;
+    }
+
+    if (!loaded) {
+        load_data(manager);
+    }
+
+    // A sweep runs its own managers, each loading a copy of the scenario, so this one is never started
+    if (sweeping) {
+        file = open_memstream(&scenario_text, &scenario_length);
+        if (file == NULL) {
+            printf("Failed to copy the scenario for the sweep\n");
+            return -1;
+        }
+        success = scenario_write(manager, file);
+        fclose(file);
+        sweep.scenario = scenario_text;
+        sweep.scenario_length = scenario_length;
+        success = success && sweep_run(&sweep, stdout);
+        free(scenario_text);
+        return success ? 0 : -1;
+    }
+
+    // A sharded comparison runs the scenario in worker processes instead of this manager
+    if (shard_count > 0) {
+        return shard_compare(manager, shard_count, SHARD_TIME_LIMIT, stdout) ? 0 : -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Prints the command line options.
+ *
+ * @param[in] program  Name the program was run as.
+ */
+static void print_usage(const char *program) {
+    printf("Usage: %s [--quiet] [--threads [--pin]] [--scenario <file> | --generate <systems> <resources> <seed> [name=value ...] [file]] [--sweep [threads] [name=value ...]] [--shards <count>] [--queue <capacity> <block|drop|merge>] [--workers <count>] [--lookahead [horizon_ms]] [--control [tick_ms]] [--export [/name]] [--trace <file> [budget_mb]] [--no-stats] [--bench-queue] [--bench-placement] [--bench-dispatch] [--bench-slotmap] [--bench-stats]\n", program);
+}
+
 /**
  * Loads sample data for the simulation.
  *
@@ -38,10 +300,10 @@ void load_data(Manager *manager) {
     resource_create(&energy, "Energy", 30, 50);
     resource_create(&distance, "Distance", 0, 5000);
 
-    resource_array_add(&manager->resource_array, fuel);
-    resource_array_add(&manager->resource_array, oxygen);
-    resource_array_add(&manager->resource_array, energy);
-    resource_array_add(&manager->resource_array, distance);
+    manager_add_resource(manager, fuel);
+    manager_add_resource(manager, oxygen);
+    manager_add_resource(manager, energy);
+    manager_add_resource(manager, distance);
 
     // Create systems
     System *propulsion_system, *life_support_system, *crew_capsule_system, *generator_system;
@@ -65,10 +327,10 @@ void load_data(Manager *manager) {
     resource_amount_init(&produce_energy, energy, 10);
     system_create(&generator_system, "Generator", consume_fuel_for_energy, produce_energy, 20, &manager->event_queue);
 
-    system_array_add(&manager->system_array, propulsion_system);
-    system_array_add(&manager->system_array, life_support_system);
-    system_array_add(&manager->system_array, crew_capsule_system);
-    system_array_add(&manager->system_array, generator_system);
+    manager_add_system(manager, propulsion_system);
+    manager_add_system(manager, life_support_system);
+    manager_add_system(manager, crew_capsule_system);
+    manager_add_system(manager, generator_system);
 }
 
 
@@ -12,30 +12,199 @@ static void display_simulation_state(Manager *manager);
 /**
  * Initializes the `Manager`.
  *
- * Sets up the manager by initializing the system array, resource array, and event queue.
+ * Sets up the manager by initializing the system and resource slot maps, and the event queue.
  * Prepares the simulation to be run.
  *
  * @param[out] manager  Pointer to the `Manager` to initialize.
  */
 void manager_init(Manager *manager) {
     manager->simulation_running = 1; // Any non-zero value to state the sim is running
-    system_array_init(&manager->system_array);
-    resource_array_init(&manager->resource_array);
+    manager->display_enabled = 1;
+    manager->last_display_time = 0;
+    manager->termination_reason = END_RUNNING;
+    manager->end_time_ms = 0;
+    manager->threshold_low = THRESHOLD_RESOURCE_LOW;
+    clock_init(&manager->clock, 0);
+    manager->stale_events = 0;
+    manager->stats_timed = 1;
+    manager->threads_running = 0;
+    manager->export = NULL;
+    lookahead_init(&manager->lookahead);
+    placement_init(&manager->placement);
+    trace_init(&manager->tracer);
+    stall_init(&manager->stall);
+    control_init(&manager->control);
+    dispatch_init(&manager->dispatcher);
+    slot_map_init(&manager->systems);
+    slot_map_init(&manager->resources);
     event_queue_init(&manager->event_queue);
 }
 
 /**
  * Cleans up the `Manager`.
  *
- * Frees all resources associated with the manager.
+ * Frees all resources associated with the manager, including every system, resource and queued event.
  *
  * @param[in,out] manager  Pointer to the `Manager` to clean.
  */
 void manager_clean(Manager *manager) {
+    int i;
+
     if(manager != NULL){
-        resource_array_clean(&manager->resource_array);
-        system_array_clean(&manager->system_array);
+        for (i = 0; i < manager->systems.size; i++) {
+            system_destroy(manager->systems.items[i]);
+        }
+        for (i = 0; i < manager->resources.size; i++) {
+            resource_destroy(manager->resources.items[i]);
+        }
+        slot_map_clean(&manager->systems);
+        slot_map_clean(&manager->resources);
+        event_queue_clean(&manager->event_queue);
+        lookahead_clean(&manager->lookahead);
+        trace_clean(&manager->tracer);
+        dispatch_clean(&manager->dispatcher);
+    }
+}
+
+/**
+ * Adds a `Resource` to the manager, which takes ownership of it.
+ *
+ * The resource's low watermark is taken from the manager's `threshold_low`.
+ *
+ * @param[in,out] manager   Pointer to the `Manager`.
+ * @param[in]     resource  Pointer to the `Resource` to add.
+ * @return                  Handle of the resource, also stored in `resource->handle`.
+ */
+Handle manager_add_resource(Manager *manager, Resource *resource) {
+    resource_set_watermarks(resource, manager->threshold_low, THRESHOLD_RESOURCE_HIGH, THRESHOLD_HYSTERESIS);
+    resource->count_transfers = manager->placement.count_transfers;
+    dispatch_lock(&manager->dispatcher);
+    resource->handle = slot_map_insert(&manager->resources, resource);
+    dispatch_unlock(&manager->dispatcher);
+    return resource->handle;
+}
+
+/**
+ * Adds a `System` to the manager, which takes ownership of it.
+ *
+ * May be called while the simulation runs: the system joins the clock in virtual time, and gets its own
+ * thread if the systems are running on threads. Its resources must already be in the manager.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @param[in]     system   Pointer to the `System` to add.
+ * @return                 Handle of the system, also stored in `system->handle`.
+ */
+Handle manager_add_system(Manager *manager, System *system) {
+    dispatch_lock(&manager->dispatcher);
+    system->handle = slot_map_insert(&manager->systems, system);
+    dispatch_unlock(&manager->dispatcher);
+    if (system->handle.generation == 0) {
+        return system->handle;
+    }
+    if (manager->dispatcher.running) {
+        system->dispatcher = &manager->dispatcher;
+    }
+
+    if (system->consumed.resource != NULL) {
+        __atomic_fetch_add(&system->consumed.resource->users, 1, __ATOMIC_RELAXED);
     }
+    if (system->produced.resource != NULL) {
+        __atomic_fetch_add(&system->produced.resource->users, 1, __ATOMIC_RELAXED);
+    }
+
+    if (manager->clock.virtual_time) {
+        system->clock = &manager->clock;
+    }
+    system->stats.timed = manager->stats_timed;
+
+    if (manager->tracer.enabled) {
+        system->trace = trace_add_buffer(&manager->tracer, system->name);
+    }
+    manager->stall.dirty = 1;
+
+    if (manager->threads_running) {
+        system->threaded = 1;
+        if (pthread_create(&system->thread, NULL, system_thread, system) != 0) {
+            printf("Failed to start thread for %s\n", system->name);
+            system->threaded = 0;
+        }
+        // The new system may join clusters, so every thread is placed again
+        if (manager->placement.enabled) {
+            placement_apply(manager);
+        }
+    }
+
+    return system->handle;
+}
+
+/**
+ * Removes a `Resource` from the manager and destroys it.
+ *
+ * A resource can't be removed while any system still consumes or produces it. Queued events about it
+ * become stale and are dropped when popped.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @param[in]     handle   Handle of the resource.
+ * @return                 Non-zero if the resource was removed; zero if the handle is stale or the resource is in use.
+ */
+int manager_remove_resource(Manager *manager, Handle handle) {
+    Resource *resource = slot_map_get(&manager->resources, handle);
+
+    if (resource == NULL || __atomic_load_n(&resource->users, __ATOMIC_RELAXED) > 0) {
+        return 0;
+    }
+
+    dispatch_lock(&manager->dispatcher);
+    slot_map_remove(&manager->resources, handle);
+    resource_destroy(resource);
+    dispatch_unlock(&manager->dispatcher);
+    return 1;
+}
+
+/**
+ * Removes a `System` from the manager and destroys it.
+ *
+ * The system leaves the slot map first, so no manager worker can set its status over TERMINATE, then a
+ * threaded system's thread is stopped and a waiting system leaves its wait list. Anything the system had
+ * produced but not yet stored is lost, and queued events from it become stale.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @param[in]     handle   Handle of the system.
+ * @return                 Non-zero if the system was removed; zero if the handle is stale.
+ */
+int manager_remove_system(Manager *manager, Handle handle) {
+    System *system = slot_map_get(&manager->systems, handle);
+    Resource *resource = NULL;
+
+    if (system == NULL) {
+        return 0;
+    }
+
+    dispatch_lock(&manager->dispatcher);
+    slot_map_remove(&manager->systems, handle);
+    dispatch_unlock(&manager->dispatcher);
+
+    __atomic_store_n(&system->status, TERMINATE, __ATOMIC_SEQ_CST);
+    resource = __atomic_load_n(&system->waiting_on, __ATOMIC_SEQ_CST);
+    if (resource != NULL) {
+        resource_cancel_wait(resource, system);
+    }
+    if (system->threaded) {
+        sem_post(&system->wakeup);
+        pthread_join(system->thread, NULL);
+        system->threaded = 0;
+    }
+
+    if (system->consumed.resource != NULL) {
+        __atomic_fetch_sub(&system->consumed.resource->users, 1, __ATOMIC_RELAXED);
+    }
+    if (system->produced.resource != NULL) {
+        __atomic_fetch_sub(&system->produced.resource->users, 1, __ATOMIC_RELAXED);
+    }
+
+    system_destroy(system);
+    manager->stall.dirty = 1;
+    return 1;
 }
 
 /**
@@ -43,69 +212,294 @@ void manager_clean(Manager *manager) {
  *
  * Handles event processing, updates system statuses, and displays the simulation state.
  * Continues until the simulation is no longer running. (In a multi-threaded implementation)
+ * While the dispatcher runs, the manager workers handle the events and this loop only coordinates.
  *
  * @param[in,out] manager  Pointer to the `Manager`.
  */
 void manager_run(Manager *manager) {
     Event event;
-    int i, status;
-    int event_found_flag = 0, no_oxygen_flag = 0, distance_reached_flag = 0, need_more_flag = 0, need_less_flag = 0;
-    
-    System *sys = NULL;
 
     // Update the display of the current state of things
-    display_simulation_state(manager);
+    if (manager->display_enabled) {
+        display_simulation_state(manager);
+    }
 
-    // Process events if one is popped
-    
-    event_found_flag = event_queue_pop(&manager->event_queue, &event);
+    if (manager->dispatcher.running) {
+        // Apply what the workers can't decide alone, such as ending the run
+        dispatch_coordinate(manager);
+    } else {
+        // Process events while one is popped
+        while (manager->simulation_running && event_queue_pop(&manager->event_queue, &event)) {
+            manager_handle_event(manager, &event, manager->tracer.enabled ? manager->tracer.buffers[0] : NULL);
+        }
+    }
+
+    // Steer every producer's rate towards keeping what it produces between the watermarks
+    control_tick(manager);
+
+    // End runs that could otherwise spin forever with nothing able to happen
+    stall_check(manager);
+
+    // Second guess the reactions above by trying alternatives forward in virtual time
+    lookahead_run(manager);
+
+    // Monitors see the state as of the end of every manager loop, including the last one
+    export_publish(manager);
+}
+
+/**
+ * Handles one event: speeds up or slows down the systems producing its resource, or ends the run.
+ *
+ * Only touches the producers of the event's resource, so events about different resources can be handled
+ * on different threads at once. Ending the run is mission-wide, so while the dispatcher runs it is only
+ * requested here and applied by the coordinator in `manager_run`.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @param[in]     event    Pointer to the popped `Event`.
+ * @param[in,out] trace    Trace buffer of the calling thread, NULL unless tracing.
+ */
+void manager_handle_event(Manager *manager, const Event *event, TraceBuffer *trace) {
+    int i, status = STANDARD, reason, expected = END_RUNNING;
+    int no_oxygen_flag = 0, distance_reached_flag = 0, need_more_flag = 0, need_less_flag = 0;
+    int watermark_flag = 0, back_to_normal_flag = 0, status_flag = 0;
+
+    System *sys = NULL;
+    System *source = NULL;
+    Resource *resource = NULL;
+
+    // Events about a resource that has since been removed are dropped, there is nothing left to manage
+    resource = slot_map_get(&manager->resources, event->resource);
+    if (resource == NULL) {
+        __atomic_fetch_add(&manager->stale_events, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    source = slot_map_get(&manager->systems, event->system);
+    if (event->status == STATUS_EMPTY || event->status == STATUS_INSUFFICIENT || event->status == STATUS_CAPACITY) {
+        __atomic_store_n(&manager->stall.dirty, 1, __ATOMIC_RELAXED);
+    }
+    if (trace != NULL) {
+        trace_instant(trace, TRACE_POP, event->status, event->priority, event->resource);
+    }
 
-    while (manager->simulation_running && event_found_flag) {
-        // Handle the event
+    // Handle the event
+    if (manager->display_enabled) {
         printf("Event: [%s] Reported Resource [%s : %d] Status [%d]\n",
-                event.system->name,
-                event.resource->name,
-                event.amount,
-                event.status);
-
-        // Set some flags based on the event that we can react to below
-        no_oxygen_flag        = (event.status == STATUS_EMPTY && strcmp(event.resource->name, "Oxygen") == 0);
-        distance_reached_flag = (event.status == STATUS_CAPACITY && strcmp(event.resource->name, "Distance") == 0);
-        need_more_flag        = (event.status == STATUS_LOW || event.status == STATUS_EMPTY || event.status == STATUS_INSUFFICIENT);
-        need_less_flag        = (event.status == STATUS_CAPACITY);
-
-        if (no_oxygen_flag) {
-            printf("Oxygen depleted. Terminating all systems.\n");
+                source != NULL ? source->name : "Remote",
+                resource->name,
+                event->amount,
+                event->status);
+    }
+
+    // Set some flags based on the event that we can react to below
+    no_oxygen_flag        = (event->status == STATUS_EMPTY && strcmp(resource->name, "Oxygen") == 0);
+    distance_reached_flag = (event->status == STATUS_CAPACITY && strcmp(resource->name, "Distance") == 0);
+    // Watermarks on the destination only say how close it is, they are no reason to slow the engine
+    watermark_flag        = (event->status == STATUS_LOW || event->status == STATUS_HIGH || event->status == STATUS_NORMAL) &&
+                            strcmp(resource->name, "Distance") != 0;
+    // With the rate controller on, the rates come from `control_tick` rather than from flipping statuses
+    status_flag           = !manager->control.enabled;
+    need_more_flag        = status_flag && ((watermark_flag && event->status == STATUS_LOW) || event->status == STATUS_EMPTY || event->status == STATUS_INSUFFICIENT);
+    need_less_flag        = status_flag && ((watermark_flag && event->status == STATUS_HIGH) || event->status == STATUS_CAPACITY);
+    back_to_normal_flag   = status_flag && (watermark_flag && event->status == STATUS_NORMAL);
+
+    if (no_oxygen_flag && manager->display_enabled) {
+        printf("Oxygen depleted. Terminating all systems.\n");
+    }
+
+    if (distance_reached_flag && manager->display_enabled) {
+        printf("Destination reached. Terminating all systems.\n");
+    }
+
+    if (no_oxygen_flag || distance_reached_flag) {
+        reason = no_oxygen_flag ? END_OXYGEN : END_DESTINATION;
+        if (!manager->dispatcher.running) {
+            manager_end(manager, reason);
+        } else if (__atomic_compare_exchange_n(&manager->dispatcher.termination, &expected, DISPATCH_END_PENDING, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            // The first worker to ask decides how the run ended; the time is stored before the reason is
+            // published, so the coordinator never sees a reason without it
+            manager->dispatcher.termination_ms = clock_now_ms(&manager->clock);
+            __atomic_store_n(&manager->dispatcher.termination, reason, __ATOMIC_RELEASE);
         }
+        return;
+    }
+    else if (need_more_flag) {
+        status = FAST;
+    }
+    else if (need_less_flag) {
+        status = SLOW;
+    }
+    else if (back_to_normal_flag) {
+        status = STANDARD;
+    }
 
-        if (distance_reached_flag) {
-            printf("Destination reached. Terminating all systems.\n");
+    if (need_more_flag || need_less_flag || back_to_normal_flag) {
+        // Update all of the systems producing the resource to speed up or slow down production
+        for (i = 0; i < manager->systems.size; i++) {
+            sys = manager->systems.items[i];
+            if (sys->produced.resource == resource) {
+                if (trace != NULL && sys->trace != NULL && sys->status != status) {
+                    trace_instant(trace, TRACE_STATUS, status, sys->trace->track, resource->handle);
+                }
+                sys->status = status;
+            }
         }
+    }
+}
+
+/**
+ * Ends the simulation, terminating every system.
+ *
+ * Holds every manager worker's lock, so no worker can set a status over TERMINATE afterwards.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @param[in]     reason   END_* code describing why the simulation stopped.
+ */
+void manager_end(Manager *manager, int reason) {
+    Handle none = {0, 0};
+    System *sys = NULL;
+
+    dispatch_lock(&manager->dispatcher);
+    manager->simulation_running = 0;
+    manager->termination_reason = reason;
+    manager->end_time_ms = clock_now_ms(&manager->clock);
 
-        if (no_oxygen_flag || distance_reached_flag) {
-            status = TERMINATE;
-            manager->simulation_running = 0;
+    for (int i = 0; i < manager->systems.size; i++) {
+        sys = manager->systems.items[i];
+        if (sys->trace != NULL && sys->status != TERMINATE) {
+            trace_instant(manager->tracer.buffers[0], TRACE_STATUS, TERMINATE, sys->trace->track, none);
         }
-        else if (need_more_flag) {
-            status = FAST;
+        sys->status = TERMINATE;
+    }
+    dispatch_unlock(&manager->dispatcher);
+}
+
+/**
+ * Runs one loop of every system that is able to run, for the single threaded simulation.
+ *
+ * Systems waiting on a resource are skipped until the resource wakes them, as are terminated systems.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @return                 Number of systems that ran; zero means every system is waiting.
+ */
+int manager_run_systems(Manager *manager) {
+    System *system = NULL;
+    int ran = 0;
+
+    for (int i = 0; i < manager->systems.size; ++i) {
+        system = manager->systems.items[i];
+        if (system->status != TERMINATE && !__atomic_load_n(&system->waiting, __ATOMIC_SEQ_CST)) {
+            system_run(system);
+            ran++;
         }
-        else if (need_less_flag) {
-            status = SLOW;
+    }
+
+    return ran;
+}
+
+/**
+ * Starts a thread for every system in the manager.
+ *
+ * From then on each system runs (and waits on its resources) independently, and the caller only needs to
+ * keep calling `manager_run` until the simulation stops. With `placement.enabled` the threads are then
+ * pinned by `placement_apply`.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ */
+void manager_start_threads(Manager *manager) {
+    System *system = NULL;
+
+    // --pin may come after the scenario on the command line, so the resources only learn of it here;
+    // otherwise they are left alone, as they may be shared with other processes already running
+    for (int i = 0; manager->placement.count_transfers && i < manager->resources.size; i++) {
+        ((Resource *)manager->resources.items[i])->count_transfers = 1;
+    }
+
+    manager->threads_running = 1;
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        system->threaded = 1;
+        if (pthread_create(&system->thread, NULL, system_thread, system) != 0) {
+            printf("Failed to start thread for %s\n", system->name);
+            system->threaded = 0;
         }
+    }
 
-        if (no_oxygen_flag || distance_reached_flag || need_more_flag || need_less_flag) {
-            // Update all of the systems to speed up or slow down production, or terminate
-            for (i = 0; i < manager->system_array.size; i++) {
-                sys = manager->system_array.systems[i];
-                if (status == TERMINATE || sys->produced.resource == event.resource) {
-                    sys->status = status;
-                }
-            }   
+    if (manager->placement.enabled) {
+        placement_apply(manager);
+    }
+}
+
+/**
+ * Terminates every system thread and waits for them to finish.
+ *
+ * Systems blocked in a resource's wait list are released first.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ */
+void manager_stop_threads(Manager *manager) {
+    System *system = NULL;
+    Resource *resource = NULL;
+    int i;
+
+    manager->threads_running = 0;
+    for (i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        __atomic_store_n(&system->status, TERMINATE, __ATOMIC_SEQ_CST);
+
+        resource = __atomic_load_n(&system->waiting_on, __ATOMIC_SEQ_CST);
+        if (system->threaded) {
+            if (resource != NULL) {
+                resource_cancel_wait(resource, system);
+            }
+            sem_post(&system->wakeup);
         }
+    }
 
-        event_found_flag = event_queue_pop(&manager->event_queue, &event);
+    for (i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        if (system->threaded) {
+            pthread_join(system->thread, NULL);
+            system->threaded = 0;
+        }
+    }
+}
+
+/**
+ * Switches the simulation to virtual time.
+ *
+ * Every system currently in the manager waits on the manager's clock, which advances instead of sleeping.
+ * Call after all of the systems have been added.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ */
+void manager_set_virtual_time(Manager *manager) {
+    clock_init(&manager->clock, 1);
+    for (int i = 0; i < manager->systems.size; i++) {
+        ((System *)manager->systems.items[i])->clock = &manager->clock;
+    }
+}
+
+/**
+ * Returns a human-readable name for a termination reason.
+ *
+ * @param[in] reason  END_* code.
+ * @return            Name of the reason.
+ */
+const char *manager_termination_name(int reason) {
+    switch (reason) {
+        case END_RUNNING:
+            return "running";
+        case END_OXYGEN:
+            return "oxygen";
+        case END_DESTINATION:
+            return "destination";
+        case END_TIMEOUT:
+            return "timeout";
+        case END_STALLED:
+            return "stalled";
+        default:
+            return "unknown";
     }
-    
 }
 
 // Don't worry much about these! These are special codes that allow us to do some formatting in the terminal
@@ -126,13 +520,12 @@ void manager_run(Manager *manager) {
  * @param[in] manager  Pointer to the `Manager` containing the simulation state.
  */
 void display_simulation_state(Manager *manager) {
-    // Static integers are allocated to the data segment, so they persist between function calls
+    // The last refresh is kept in the manager so that several simulations can run side by side
     static const int display_interval = 1;
-    static time_t last_display_time = 0;
 
     // If it has not been long enough since our previous display refresh, keep waiting.
     time_t current_time = time(NULL);
-    if (difftime(current_time, last_display_time) < display_interval) {
+    if (difftime(current_time, manager->last_display_time) < display_interval) {
         return;
     }
 
@@ -150,8 +543,8 @@ void display_simulation_state(Manager *manager) {
     Resource *resource = NULL;
     int amount = 0; 
     int max_capacity = 0;
-    for (int i = 0; i < manager->resource_array.size; i++) {
-        resource = manager->resource_array.resources[i];
+    for (int i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
 
         amount = resource->amount;
         max_capacity = resource->max_capacity;
@@ -166,8 +559,8 @@ void display_simulation_state(Manager *manager) {
     printf(ANSI_LN_CLR "---------------\n");
 
     System *system = NULL;
-    for (int i = 0; i < manager->system_array.size; i++) {
-        system = manager->system_array.systems[i];
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
 
         // Map system status code to a human-readable string
         const char *status_str;
@@ -192,12 +585,18 @@ void display_simulation_state(Manager *manager) {
                 break;
         }
 
-        printf(ANSI_LN_CLR  "%-20s: %-10s\n", system->name, status_str);
+        printf(ANSI_LN_CLR  "%-20s: %-10s %-9s converts=%-8lld stalls=%lld\n", system->name, status_str,
+               system->waiting ? "(waiting)" : "",
+               system->stats.conversions,
+               system->stats.stalls[STATUS_EMPTY] + system->stats.stalls[STATUS_INSUFFICIENT] + system->stats.stalls[STATUS_CAPACITY]);
     }
 
     printf(ANSI_LN_CLR  "\n");
+    printf(ANSI_LN_CLR "Event queue: %d pending, p99 latency %.1fus\n", manager->event_queue.size,
+           histogram_percentile(&manager->event_queue.latency, 99.0) / 1000.0);
+    printf(ANSI_LN_CLR  "\n");
 
-    last_display_time = current_time;
+    manager->last_display_time = current_time;
     // Flush the output to ensure it appears immediately
     fflush(stdout);
 }
@@ -0,0 +1,215 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Reference reader for the state that `program --export` publishes to /dev/shm.
+// Only ever maps the region read-only, so any number of monitors can run without affecting the simulation.
+
+#define MONITOR_READ_TRIES 1000     // Attempts at a consistent copy before giving up on a stuck writer
+#define MONITOR_ATTACH_WAIT_MS 5000 // How long to wait for the simulation to create the region
+
+// Helper functions just used by this C file
+static const ExportRegion *monitor_attach(const char *name);
+static int monitor_read(const ExportRegion *region, ExportRegion *copy);
+static void monitor_print(const ExportRegion *state);
+static void monitor_benchmark(const ExportRegion *region, int seconds);
+static long long monitor_now_ns(void);
+static void print_usage(const char *program);
+
+int main(int argc, char *argv[]) {
+    const char *name = EXPORT_DEFAULT_NAME;
+    const ExportRegion *region = NULL;
+    ExportRegion state;
+    int interval_ms = 500, count = 0, bench_seconds = 0, waited_ms = 0, samples = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_seconds = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The monitor may well be started before the simulation
+    while ((region = monitor_attach(name)) == NULL && waited_ms < MONITOR_ATTACH_WAIT_MS) {
+        usleep(100 * 1000);
+        waited_ms += 100;
+    }
+    if (region == NULL) {
+        printf("No simulation state at %s (is `program --export` running?)\n", name);
+        return 1;
+    }
+
+    if (bench_seconds > 0) {
+        monitor_benchmark(region, bench_seconds);
+        munmap((void *)region, sizeof(ExportRegion));
+        return 0;
+    }
+
+    while (count == 0 || samples < count) {
+        if (!monitor_read(region, &state)) {
+            printf("Could not get a consistent copy of the state\n");
+            break;
+        }
+        monitor_print(&state);
+        samples++;
+
+        if (state.updates > 0 && !state.simulation_running) {
+            break;
+        }
+        usleep(interval_ms * 1000);
+    }
+
+    munmap((void *)region, sizeof(ExportRegion));
+    return 0;
+}
+
+/**
+ * Maps an export region read-only.
+ *
+ * @param[in] name  Name of the region, as given to `export_open`.
+ * @return          The mapped region, or NULL if it doesn't exist (yet) or has a different layout.
+ */
+static const ExportRegion *monitor_attach(const char *name) {
+    const ExportRegion *region;
+    struct stat info;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(ExportRegion)) {
+        close(fd);
+        return NULL;
+    }
+
+    region = (const ExportRegion *)mmap(NULL, sizeof(ExportRegion), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != EXPORT_MAGIC ||
+        region->version != EXPORT_VERSION || region->size != sizeof(ExportRegion)) {
+        munmap((void *)region, sizeof(ExportRegion));
+        return NULL;
+    }
+
+    return region;
+}
+
+/**
+ * Takes a consistent copy of an export region.
+ *
+ * The copy is only kept if the seqlock's sequence was even (no update in progress) and unchanged
+ * across the copy; otherwise it is retried, since an update only takes a few microseconds.
+ *
+ * @param[in]  region  Pointer to the mapped `ExportRegion`.
+ * @param[out] copy    Pointer to the `ExportRegion` to copy into.
+ * @return             Non-zero if the copy is consistent; zero if the writer never finished an update.
+ */
+static int monitor_read(const ExportRegion *region, ExportRegion *copy) {
+    unsigned int before, after;
+
+    for (int i = 0; i < MONITOR_READ_TRIES; i++) {
+        before = __atomic_load_n(&region->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+
+        memcpy(copy, region, sizeof(ExportRegion));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&region->sequence, __ATOMIC_RELAXED);
+        if (before == after) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Prints one sample of the simulation state.
+ *
+ * @param[in] state  Pointer to a consistent copy of the `ExportRegion`.
+ */
+static void monitor_print(const ExportRegion *state) {
+    static const char *statuses[] = {"TERMINATE", "DISABLED", "SLOW", "STANDARD", "FAST"};
+    int i;
+
+    printf("t=%lldms update=%lld %s queue=%d (max %d) events=%lld dropped=%lld\n",
+           state->clock_ms, state->updates, state->simulation_running ? "running" : "ended",
+           state->queue_size, state->queue_max_size, state->events, state->dropped);
+
+    for (i = 0; i < state->resource_count; i++) {
+        printf("  %-20s %6d / %-6d\n", state->resources[i].name, state->resources[i].amount, state->resources[i].max_capacity);
+    }
+    for (i = 0; i < state->system_count; i++) {
+        const ExportSystem *system = &state->systems[i];
+        printf("  %-20s %-9s%s converts=%lld stores=%lld stalls=%lld\n", system->name,
+               system->status >= TERMINATE && system->status <= FAST ? statuses[system->status] : "UNKNOWN",
+               system->waiting ? " (waiting)" : "", system->conversions, system->stores, system->stalls);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Reads the region as fast as possible, to show what sampling costs a monitor.
+ *
+ * @param[in] region   Pointer to the mapped `ExportRegion`.
+ * @param[in] seconds  How long to read for.
+ */
+static void monitor_benchmark(const ExportRegion *region, int seconds) {
+    ExportRegion copy;
+    long long start = monitor_now_ns(), end = start + seconds * 1000000000LL;
+    long long reads = 0, failed = 0, first_update = -1, last_update = 0;
+
+    while (monitor_now_ns() < end) {
+        if (monitor_read(region, &copy)) {
+            reads++;
+            if (first_update < 0) {
+                first_update = copy.updates;
+            }
+            last_update = copy.updates;
+        } else {
+            failed++;
+        }
+    }
+
+    printf("%lld consistent reads in %ds (%.0f reads/s, %.2fus each), %lld failed, %lld updates seen\n",
+           reads, seconds, reads / (double)seconds, seconds * 1e6 / (reads > 0 ? reads : 1), failed,
+           first_update < 0 ? 0 : last_update - first_update);
+}
+
+/**
+ * Returns the current monotonic time in nanoseconds.
+ *
+ * @return  Nanoseconds since an arbitrary fixed point.
+ */
+static long long monitor_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Prints the command line options.
+ *
+ * @param[in] program  Name the monitor was run as.
+ */
+static void print_usage(const char *program) {
+    printf("Usage: %s [--name <region>] [--interval <ms>] [--count <samples>] [--bench <seconds>]\n", program);
+}
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE     // For sched_getaffinity and pthread_setaffinity_np
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+// Helper functions just used by this C file
+static int placement_find_cpus(Placement *placement);
+static long long placement_read_id(int cpu, const char *name);
+static int placement_compare(const void *a, const void *b);
+static int placement_find_root(int *parent, int i);
+static int placement_plan(Manager *manager);
+static int placement_pin(const Placement *placement, System *system);
+
+/**
+ * Initializes a `Placement` that pins nothing.
+ *
+ * The CPUs are only looked up once threads are placed, so managers that never pin pay nothing.
+ *
+ * @param[out] placement  Pointer to the `Placement` to initialize.
+ */
+void placement_init(Placement *placement) {
+    placement->enabled = 0;
+    placement->count_transfers = 0;
+    placement->cpu_count = 0;
+    placement->cluster_count = 0;
+}
+
+/**
+ * Splits the systems into clusters and pins every running system thread to its cluster's CPUs.
+ *
+ * Systems that share a resource, directly or through other systems, are one cluster. Each cluster gets
+ * one CPU per PLACEMENT_SYSTEMS_PER_CPU of its systems (capped at every CPU), taken in order from the
+ * topology-sorted CPU list, so a cluster sits on sibling threads of a core, then on cores of a package.
+ * A resource only moves between the caches of its cluster's CPUs; with more clusters than CPUs the
+ * list wraps and clusters share CPUs.
+ *
+ * Called when the threads start and again whenever a system is added while they run, since a new
+ * system can join two clusters together.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` whose systems are placed.
+ * @return                 Non-zero if every threaded system was pinned; zero otherwise.
+ */
+int placement_apply(Manager *manager) {
+    System *system = NULL;
+    int pinned = 1;
+
+    if (!placement_plan(manager)) {
+        return 0;
+    }
+
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        if (system->threaded && !placement_pin(&manager->placement, system)) {
+            pinned = 0;
+        }
+    }
+
+    return pinned;
+}
+
+/**
+ * Prints the clusters and how often each resource's amount moved between CPUs.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] stream   Stream to print to.
+ */
+void placement_print(const Manager *manager, FILE *stream) {
+    const Placement *placement = &manager->placement;
+    const System *system = NULL;
+    const Resource *resource = NULL;
+    long long total = 0;
+    int i, c, k;
+
+    if (placement->enabled && placement->cluster_count > 0) {
+        fprintf(stream, "Placement: %d clusters over %d CPUs\n", placement->cluster_count, placement->cpu_count);
+        for (c = 0; c < placement->cluster_count; c++) {
+            for (i = 0; i < manager->systems.size; i++) {
+                system = manager->systems.items[i];
+                if (system->cluster == c) {
+                    break;
+                }
+            }
+            if (i == manager->systems.size) {
+                continue;
+            }
+
+            fprintf(stream, "  cluster %d on CPU", c);
+            for (k = 0; k < system->cpu_count; k++) {
+                fprintf(stream, "%s%d", k == 0 ? " " : ",", placement->cpus[(system->cpu_first + k) % placement->cpu_count]);
+            }
+            fprintf(stream, ":");
+            for (; i < manager->systems.size; i++) {
+                system = manager->systems.items[i];
+                if (system->cluster == c) {
+                    fprintf(stream, " %s", system->name);
+                }
+            }
+            fprintf(stream, "\n");
+        }
+    }
+
+    for (i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        total += resource->cpu_transfers;
+    }
+    if (!placement->enabled && total == 0) {
+        return;
+    }
+
+    fprintf(stream, "Resource cache line transfers between CPUs: %lld (", total);
+    for (i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        fprintf(stream, "%s%s=%lld", i == 0 ? "" : ", ", resource->name, resource->cpu_transfers);
+    }
+    fprintf(stream, ")\n");
+}
+
+/**
+ * Assigns every system a cluster and a run of CPUs.
+ *
+ * Clusters are the connected components of the graph of systems joined by a shared resource, found
+ * with union-find: every system is joined with the first system seen using each of its resources.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` whose systems are placed.
+ * @return                 Non-zero if the systems were placed; zero if the CPUs couldn't be read or memory ran out.
+ */
+static int placement_plan(Manager *manager) {
+    Placement *placement = &manager->placement;
+    int size = manager->systems.size;
+    int *parent, *label, *cluster_size, *first_user;
+    ResourceIndex *indexes;
+    System *system = NULL;
+    Resource *used[2];
+    int i, j, k, index, root, next_cpu = 0, cpus;
+
+    if (!placement_find_cpus(placement)) {
+        return 0;
+    }
+
+    parent = (int *)malloc((size + 1) * sizeof(int));
+    label = (int *)malloc((size + 1) * sizeof(int));
+    cluster_size = (int *)malloc((size + 1) * sizeof(int));
+    first_user = (int *)malloc((manager->resources.size + 1) * sizeof(int));
+    indexes = resource_index_build(&manager->resources);
+    if (parent == NULL || label == NULL || cluster_size == NULL || first_user == NULL || indexes == NULL) {
+        printf("Failed to allocate memory for placement\n");
+        free(parent);
+        free(label);
+        free(cluster_size);
+        free(first_user);
+        free(indexes);
+        return 0;
+    }
+
+    for (i = 0; i < size; i++) {
+        parent[i] = i;
+        label[i] = -1;
+        cluster_size[i] = 0;
+    }
+    for (j = 0; j < manager->resources.size; j++) {
+        first_user[j] = -1;
+    }
+    for (i = 0; i < size; i++) {
+        system = manager->systems.items[i];
+        used[0] = system->consumed.resource;
+        used[1] = system->produced.resource;
+        for (k = 0; k < 2; k++) {
+            index = resource_index_find(indexes, manager->resources.size, used[k]);
+            if (index < 0) {
+                continue;
+            }
+            if (first_user[index] < 0) {
+                first_user[index] = i;
+            } else {
+                parent[placement_find_root(parent, i)] = placement_find_root(parent, first_user[index]);
+            }
+        }
+    }
+    free(first_user);
+    free(indexes);
+
+    // Clusters are numbered in the order their first system appears
+    placement->cluster_count = 0;
+    for (i = 0; i < size; i++) {
+        root = placement_find_root(parent, i);
+        if (label[root] < 0) {
+            label[root] = placement->cluster_count++;
+        }
+        system = manager->systems.items[i];
+        system->cluster = label[root];
+        cluster_size[system->cluster]++;
+    }
+
+    // Consecutive runs of the sorted CPU list, so each cluster stays on neighbouring CPUs
+    for (j = 0; j < placement->cluster_count; j++) {
+        cpus = (cluster_size[j] + PLACEMENT_SYSTEMS_PER_CPU - 1) / PLACEMENT_SYSTEMS_PER_CPU;
+        if (cpus > placement->cpu_count) {
+            cpus = placement->cpu_count;
+        }
+        label[j] = next_cpu % placement->cpu_count;
+        cluster_size[j] = cpus;
+        next_cpu += cpus;
+    }
+    for (i = 0; i < size; i++) {
+        system = manager->systems.items[i];
+        system->cpu_first = label[system->cluster];
+        system->cpu_count = cluster_size[system->cluster];
+    }
+
+    free(parent);
+    free(label);
+    free(cluster_size);
+    return 1;
+}
+
+/**
+ * Pins a system's thread to the CPUs of its cluster.
+ *
+ * @param[in]     placement  Pointer to the `Placement` holding the CPU list.
+ * @param[in,out] system     Pointer to the threaded `System`, already placed by `placement_plan`.
+ * @return                   Non-zero if the thread was pinned; zero otherwise.
+ */
+static int placement_pin(const Placement *placement, System *system) {
+    cpu_set_t set;
+
+    if (system->cpu_count <= 0 || placement->cpu_count <= 0) {
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    for (int k = 0; k < system->cpu_count; k++) {
+        CPU_SET(placement->cpus[(system->cpu_first + k) % placement->cpu_count], &set);
+    }
+
+    if (pthread_setaffinity_np(system->thread, sizeof(set), &set) != 0) {
+        printf("Could not pin the thread of %s\n", system->name);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Lists the CPUs the process may run on, ordered by package, then core, then CPU number.
+ *
+ * Hyperthreads of one core end up next to each other, then the cores of one package, which is the
+ * order in which they share caches. CPUs whose topology can't be read sort by number alone.
+ *
+ * @param[in,out] placement  Pointer to the `Placement` to fill in `cpus` and `cpu_count`.
+ * @return                   Non-zero if at least one CPU was found; zero otherwise.
+ */
+static int placement_find_cpus(Placement *placement) {
+    long long keys[PLACEMENT_MAX_CPUS];
+    cpu_set_t allowed;
+    int cpu;
+
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        printf("Could not read the CPUs this process may run on\n");
+        return 0;
+    }
+
+    // The CPU number goes in the low bits, under the package and core, so sorting the keys sorts the CPUs
+    placement->cpu_count = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE && placement->cpu_count < PLACEMENT_MAX_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            keys[placement->cpu_count++] = (placement_read_id(cpu, "physical_package_id") << 40) |
+                                           (placement_read_id(cpu, "core_id") << 20) | cpu;
+        }
+    }
+    if (placement->cpu_count == 0) {
+        printf("No CPUs to place threads on\n");
+        return 0;
+    }
+
+    qsort(keys, placement->cpu_count, sizeof(long long), placement_compare);
+    for (cpu = 0; cpu < placement->cpu_count; cpu++) {
+        placement->cpus[cpu] = (int)(keys[cpu] & 0xfffff);
+    }
+
+    return 1;
+}
+
+/**
+ * Reads one of a CPU's topology ids from sysfs.
+ *
+ * @param[in] cpu   CPU number.
+ * @param[in] name  Name of the id under /sys/devices/system/cpu/cpuN/topology.
+ * @return          The id (at most 20 bits are kept), or 0 if it can't be read.
+ */
+static long long placement_read_id(int cpu, const char *name) {
+    char path[128];
+    FILE *file;
+    long long id = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%lld", &id) != 1 || id < 0) {
+        id = 0;
+    }
+    fclose(file);
+
+    return id & 0xfffff;
+}
+
+/**
+ * Compares two CPU sort keys for qsort.
+ *
+ * @param[in] a  Pointer to the first key.
+ * @param[in] b  Pointer to the second key.
+ * @return       Negative, zero or positive as `a` sorts before, with or after `b`.
+ */
+static int placement_compare(const void *a, const void *b) {
+    long long left = *(const long long *)a, right = *(const long long *)b;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Finds the root of a system's set in the union-find forest, halving the path on the way.
+ *
+ * @param[in,out] parent  Parent of every system, a root is its own parent.
+ * @param[in]     i       System to look up.
+ * @return                The root of its set.
+ */
+static int placement_find_root(int *parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+
+    return i;
+}
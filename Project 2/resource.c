@@ -1,7 +1,16 @@
+#define _GNU_SOURCE     // For sched_getcpu
 #include "defs.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
+
+// Helper functions just used by this C file
+static int resource_index_compare(const void *a, const void *b);
+static void resource_wake(Resource *resource);
+static int resource_remove_waiter(Waiter **list, const System *system);
+static int resource_check_watermarks(Resource *resource, int amount);
+static void resource_note_cpu(Resource *resource);
 
 /* Resource functions */
 
@@ -22,8 +31,8 @@ void resource_create(Resource **resource, const char *name, int amount, int max_
         return;
     }
     
-    //Allocate memory for the resource
-    *resource = (Resource *)malloc(sizeof(Resource));
+    //Allocate memory for the resource, on a cache line of its own
+    *resource = (Resource *)aligned_alloc(CACHE_LINE_SIZE, sizeof(Resource));
     if(*resource == NULL){
         printf("Failed to allocate memory for resource \n");
         return;
@@ -41,6 +50,19 @@ void resource_create(Resource **resource, const char *name, int amount, int max_
     //Initialize amount and max capacity
     (*resource)->amount = amount;
     (*resource)->max_capacity = max_capacity;
+    (*resource)->shared = 0;
+    (*resource)->handle.index = 0;
+    (*resource)->handle.generation = 0;
+    (*resource)->users = 0;
+    (*resource)->waiter_count = 0;
+    (*resource)->waiting_available = NULL;
+    (*resource)->waiting_space = NULL;
+    (*resource)->last_cpu = -1;
+    (*resource)->cpu_transfers = 0;
+    (*resource)->count_transfers = 0;
+    (*resource)->control_integral = 0;
+    sem_init(&(*resource)->lock, 0, 1);
+    resource_set_watermarks(*resource, THRESHOLD_RESOURCE_LOW, THRESHOLD_RESOURCE_HIGH, THRESHOLD_HYSTERESIS);
 
 }
 
@@ -53,12 +75,235 @@ void resource_create(Resource **resource, const char *name, int amount, int max_
  */
 void resource_destroy(Resource *resource) {
     if(resource != NULL){
+        sem_destroy(&resource->lock);
         free(resource->name);
         free(resource);
         resource = NULL;
     } 
 }
 
+/**
+ * Consumes an amount of a `Resource` if enough of it is available.
+ *
+ * The check and the update are a single atomic operation, so any number of systems (in any number of
+ * threads or processes sharing the resource) may consume at once. Systems waiting for the space freed
+ * up are woken.
+ *
+ * @param[in,out] resource  Pointer to the `Resource` to consume from.
+ * @param[in]     amount    Amount to consume.
+ * @param[out]    crossing  Set to the watermark the consumption crossed (see `resource_set_watermarks`), or `STATUS_OK`. May be NULL.
+ * @return                  `STATUS_OK` if consumed, otherwise `STATUS_EMPTY` or `STATUS_INSUFFICIENT`.
+ */
+int resource_consume(Resource *resource, int amount, int *crossing) {
+    int current = __atomic_load_n(&resource->amount, __ATOMIC_RELAXED);
+
+    if (crossing != NULL) {
+        *crossing = STATUS_OK;
+    }
+
+    do {
+        if (current < amount) {
+            return (current == 0) ? STATUS_EMPTY : STATUS_INSUFFICIENT;
+        }
+    } while (!__atomic_compare_exchange_n(&resource->amount, &current, current - amount, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    if (resource->count_transfers) {
+        resource_note_cpu(resource);
+    }
+
+    if (amount > 0 && __atomic_load_n(&resource->waiter_count, __ATOMIC_SEQ_CST) > 0) {
+        resource_wake(resource);
+    }
+
+    if (crossing != NULL) {
+        *crossing = resource_check_watermarks(resource, current - amount);
+    }
+
+    return STATUS_OK;
+}
+
+/**
+ * Stores as much of an amount into a `Resource` as its capacity allows.
+ *
+ * Like `resource_consume`, the update is atomic, and systems waiting for the stored amount are woken.
+ *
+ * @param[in,out] resource  Pointer to the `Resource` to store into.
+ * @param[in]     amount    Amount to store.
+ * @param[out]    crossing  Set to the watermark the store crossed (see `resource_set_watermarks`), or `STATUS_OK`. May be NULL.
+ * @return                  The amount actually stored, between 0 and `amount`.
+ */
+int resource_store(Resource *resource, int amount, int *crossing) {
+    int current = __atomic_load_n(&resource->amount, __ATOMIC_RELAXED);
+    int stored;
+
+    if (crossing != NULL) {
+        *crossing = STATUS_OK;
+    }
+
+    do {
+        stored = resource->max_capacity - current;
+        if (stored > amount) {
+            stored = amount;
+        }
+        if (stored <= 0) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&resource->amount, &current, current + stored, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    if (resource->count_transfers) {
+        resource_note_cpu(resource);
+    }
+
+    if (__atomic_load_n(&resource->waiter_count, __ATOMIC_SEQ_CST) > 0) {
+        resource_wake(resource);
+    }
+
+    if (crossing != NULL) {
+        *crossing = resource_check_watermarks(resource, current + stored);
+    }
+
+    return stored;
+}
+
+/**
+ * Sets the low and high watermarks of a `Resource`, as fractions of its capacity.
+ *
+ * `resource_consume` and `resource_store` report a crossing only when the amount reaches a watermark
+ * from the other side: STATUS_LOW at or below the low mark, STATUS_HIGH at or above the high mark, and
+ * STATUS_NORMAL once it has moved `hysteresis` back past the mark it crossed. A resource bouncing around
+ * a watermark therefore reports it once, not on every change. The current level is set silently.
+ *
+ * @param[in,out] resource    Pointer to the `Resource`.
+ * @param[in]     low         Fraction of capacity at or below which the resource is low.
+ * @param[in]     high        Fraction of capacity at or above which the resource is high.
+ * @param[in]     hysteresis  Fraction of capacity to move back past a watermark before leaving it.
+ */
+void resource_set_watermarks(Resource *resource, double low, double high, double hysteresis) {
+    int amount = __atomic_load_n(&resource->amount, __ATOMIC_RELAXED);
+
+    resource->low_mark = (int)(resource->max_capacity * low);
+    resource->high_mark = (int)(resource->max_capacity * high);
+    resource->hysteresis = (int)(resource->max_capacity * hysteresis);
+    if (resource->hysteresis < 1) {
+        resource->hysteresis = 1;
+    }
+
+    if (amount <= resource->low_mark) {
+        resource->level = STATUS_LOW;
+    } else if (amount >= resource->high_mark) {
+        resource->level = STATUS_HIGH;
+    } else {
+        resource->level = STATUS_NORMAL;
+    }
+}
+
+/**
+ * Adds a system to one of the resource's wait lists, unless its condition is already met.
+ *
+ * The waiter count is raised before the condition is checked, and `resource_consume/store` change the
+ * amount before checking the count, so a wakeup can never be missed between the check and the wait.
+ * Once woken the system's `waiting` flag is cleared and, if it is threaded, its `wakeup` is posted.
+ *
+ * @param[in,out] resource   Pointer to the `Resource` to wait on.
+ * @param[in,out] system     Pointer to the `System` that will wait.
+ * @param[in]     kind       WAIT_AVAILABLE or WAIT_SPACE.
+ * @param[in]     threshold  Amount available (or free space) the system needs.
+ * @return                   Non-zero if the system now waits; zero if the condition is already met.
+ */
+int resource_wait(Resource *resource, System *system, int kind, int threshold) {
+    Waiter **list = (kind == WAIT_AVAILABLE) ? &resource->waiting_available : &resource->waiting_space;
+    int amount, satisfied;
+
+    sem_wait(&resource->lock);
+    __atomic_fetch_add(&resource->waiter_count, 1, __ATOMIC_SEQ_CST);
+
+    amount = __atomic_load_n(&resource->amount, __ATOMIC_SEQ_CST);
+    satisfied = (kind == WAIT_AVAILABLE) ? amount >= threshold : resource->max_capacity - amount >= threshold;
+    if (satisfied) {
+        __atomic_fetch_sub(&resource->waiter_count, 1, __ATOMIC_SEQ_CST);
+        sem_post(&resource->lock);
+        return 0;
+    }
+
+    // Keep the list sorted so waking stops at the first system that still can't run
+    system->waiter.system = system;
+    system->waiter.threshold = threshold;
+    while (*list != NULL && (*list)->threshold <= threshold) {
+        list = &(*list)->next;
+    }
+    system->waiter.next = *list;
+    *list = &system->waiter;
+
+    system->waiting_on = resource;
+    __atomic_store_n(&system->waiting, 1, __ATOMIC_SEQ_CST);
+    sem_post(&resource->lock);
+
+    return 1;
+}
+
+/**
+ * Removes a system from the resource's wait lists without waking it.
+ *
+ * @param[in,out] resource  Pointer to the `Resource` the system waits on.
+ * @param[in,out] system    Pointer to the waiting `System`.
+ */
+void resource_cancel_wait(Resource *resource, System *system) {
+    sem_wait(&resource->lock);
+    if (resource_remove_waiter(&resource->waiting_available, system) ||
+        resource_remove_waiter(&resource->waiting_space, system)) {
+        __atomic_fetch_sub(&resource->waiter_count, 1, __ATOMIC_SEQ_CST);
+        system->waiting_on = NULL;
+        __atomic_store_n(&system->waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    sem_post(&resource->lock);
+}
+
+/**
+ * Wakes every waiting system whose condition is now met.
+ *
+ * @param[in,out] resource  Pointer to the `Resource` whose amount changed.
+ */
+static void resource_wake(Resource *resource) {
+    Waiter *waiter;
+    int amount;
+
+    sem_wait(&resource->lock);
+    amount = __atomic_load_n(&resource->amount, __ATOMIC_SEQ_CST);
+
+    while (resource->waiting_available != NULL && resource->waiting_available->threshold <= amount) {
+        waiter = resource->waiting_available;
+        resource->waiting_available = waiter->next;
+        __atomic_fetch_sub(&resource->waiter_count, 1, __ATOMIC_SEQ_CST);
+        system_wake(waiter->system);
+    }
+
+    while (resource->waiting_space != NULL && resource->waiting_space->threshold <= resource->max_capacity - amount) {
+        waiter = resource->waiting_space;
+        resource->waiting_space = waiter->next;
+        __atomic_fetch_sub(&resource->waiter_count, 1, __ATOMIC_SEQ_CST);
+        system_wake(waiter->system);
+    }
+
+    sem_post(&resource->lock);
+}
+
+/**
+ * Unlinks a system from a wait list.
+ *
+ * @param[in,out] list    Pointer to the head of the wait list.
+ * @param[in]     system  Pointer to the `System` to remove.
+ * @return                Non-zero if the system was in the list.
+ */
+static int resource_remove_waiter(Waiter **list, const System *system) {
+    while (*list != NULL) {
+        if ((*list)->system == system) {
+            *list = (*list)->next;
+            return 1;
+        }
+        list = &(*list)->next;
+    }
+
+    return 0;
+}
+
 /* ResourceAmount functions */
 
 /**
@@ -76,72 +321,112 @@ void resource_amount_init(ResourceAmount *resource_amount, Resource *resource, i
 }
 
 /**
- * Initializes the `ResourceArray`.
+ * Builds an index from `Resource` pointers to their position in a manager's resources.
  *
- * Allocates memory for the array of `Resource*` pointers and sets initial values.
+ * The returned array is sorted by address for `resource_index_find` and must be freed by the caller.
  *
- * @param[out] array  Pointer to the `ResourceArray` to initialize.
+ * @param[in] resources  Pointer to the `SlotMap` of resources to index.
+ * @return               The index, or NULL if it could not be allocated.
  */
-void resource_array_init(ResourceArray *array) {
-    //Initialize array capacity and size
-    array->capacity = 1;
-    array->size = 0;
-
-    //Initialize resources array
-    array->resources = (Resource **) malloc(array->capacity * sizeof(Resource *));
-    if(array->resources == NULL){
-        printf("Failed to allocate memory for resources");
-        free(array);
-        return;
+ResourceIndex *resource_index_build(const SlotMap *resources) {
+    ResourceIndex *indexes = (ResourceIndex *)malloc((resources->size + 1) * sizeof(ResourceIndex));
+    if (indexes == NULL) {
+        printf("Failed to allocate memory for resource index\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < resources->size; i++) {
+        indexes[i].resource = resources->items[i];
+        indexes[i].index = i;
     }
+    qsort(indexes, resources->size, sizeof(ResourceIndex), resource_index_compare);
+
+    return indexes;
 }
 
 /**
- * Cleans up the `ResourceArray` by destroying all resources and freeing memory.
+ * Finds the position of a resource using an index from `resource_index_build`.
  *
- * Iterates through the array, calls `resource_destroy` on each `Resource`,
- * and frees the array memory.
+ * @param[in] indexes   Index built by `resource_index_build`.
+ * @param[in] size      Number of resources in the index.
+ * @param[in] resource  Resource to look up, may be NULL.
+ * @return              The resource's position in the array, or -1 if it is NULL or not found.
+ */
+int resource_index_find(const ResourceIndex *indexes, int size, const Resource *resource) {
+    ResourceIndex key, *found;
+
+    if (resource == NULL) {
+        return -1;
+    }
+
+    key.resource = (Resource *)resource;
+    key.index = -1;
+    found = (ResourceIndex *)bsearch(&key, indexes, size, sizeof(ResourceIndex), resource_index_compare);
+
+    return found == NULL ? -1 : found->index;
+}
+
+/**
+ * Orders `ResourceIndex` entries by resource address, for `qsort` and `bsearch`.
+ */
+static int resource_index_compare(const void *a, const void *b) {
+    const Resource *left = ((const ResourceIndex *)a)->resource;
+    const Resource *right = ((const ResourceIndex *)b)->resource;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Moves a resource between its watermark levels after its amount changed.
  *
- * @param[in,out] array  Pointer to the `ResourceArray` to clean.
+ * The level is changed by compare-and-swap, so when several threads change the amount at once exactly
+ * one of them reports each transition.
+ *
+ * @param[in,out] resource  Pointer to the `Resource`.
+ * @param[in]     amount    Amount of the resource after the change.
+ * @return                  The new level if it changed (STATUS_LOW, STATUS_NORMAL or STATUS_HIGH), otherwise `STATUS_OK`.
  */
-void resource_array_clean(ResourceArray *array) {
-    if(array != NULL){
-        for(int i = 0; i < array->size; i++){
-            if(array->resources[i] != NULL){
-                resource_destroy(array->resources[i]);
+static int resource_check_watermarks(Resource *resource, int amount) {
+    int level = __atomic_load_n(&resource->level, __ATOMIC_RELAXED);
+    int next;
+
+    do {
+        next = level;
+        if (level == STATUS_NORMAL) {
+            if (amount <= resource->low_mark) {
+                next = STATUS_LOW;
+            } else if (amount >= resource->high_mark) {
+                next = STATUS_HIGH;
             }
+        } else if (level == STATUS_LOW && amount >= resource->low_mark + resource->hysteresis) {
+            next = amount >= resource->high_mark ? STATUS_HIGH : STATUS_NORMAL;
+        } else if (level == STATUS_HIGH && amount <= resource->high_mark - resource->hysteresis) {
+            next = amount <= resource->low_mark ? STATUS_LOW : STATUS_NORMAL;
         }
-        free(array->resources);
-        array->resources = NULL;
-    }
+
+        if (next == level) {
+            return STATUS_OK;
+        }
+    } while (!__atomic_compare_exchange_n(&resource->level, &level, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return next;
 }
 
 /**
- * Adds a `Resource` to the `ResourceArray`, resizing if necessary (doubling the size).
+ * Counts a change of the resource's amount made on a different CPU than the change before it.
+ *
+ * Each such change had to pull the cache line holding `amount` over from the other CPU, so
+ * `cpu_transfers` counts how often the line moved. Both fields share that line, so keeping count
+ * touches no other memory, and they are only written when the CPU actually changed. Only called for
+ * resources with `count_transfers` set, so other runs don't pay for `sched_getcpu`.
  *
- * Resizes the array when the capacity is reached and adds the new `Resource`.
- * Use of realloc is NOT permitted.
- * 
- * @param[in,out] array     Pointer to the `ResourceArray`.
- * @param[in]     resource  Pointer to the `Resource` to add.
+ * @param[in,out] resource  Pointer to the `Resource` that was just changed.
  */
-void resource_array_add(ResourceArray *array, Resource *resource) {
-    //Resizes array if necessary
-    if(array->size == array->capacity){
-        array->capacity *= 2;
-
-        Resource **temp = (Resource **)malloc(array->capacity * sizeof(Resource *));
-        if(temp == NULL){
-            printf("Failed to resize resource array");
-            return;
-        }
+static void resource_note_cpu(Resource *resource) {
+    int cpu = sched_getcpu();
 
-        memcpy(temp, array->resources, array->size * sizeof(Resource *));
-        free(array->resources);
-        array->resources = temp;
+    if (cpu >= 0 && __atomic_load_n(&resource->last_cpu, __ATOMIC_RELAXED) != cpu) {
+        if (__atomic_exchange_n(&resource->last_cpu, cpu, __ATOMIC_RELAXED) >= 0) {
+            __atomic_fetch_add(&resource->cpu_transfers, 1, __ATOMIC_RELAXED);
+        }
     }
-
-    //Adds the resource into the array
-    array->resources[array->size] = resource;
-    array->size++;
-}
\ No newline at end of file
+}
@@ -0,0 +1,450 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#define SCENARIO_NAME_LENGTH 64
+#define SCENARIO_LINE_LENGTH 256
+#define SCENARIO_MAX_TRIES   64   // Random edge picks before giving up on the fan-in/fan-out limits
+
+// Helper functions just used by this C file
+static unsigned long long scenario_rand(unsigned long long *state);
+static int scenario_rand_range(unsigned long long *state, int min, int max);
+static int scenario_processing_time(unsigned long long *state, const ScenarioConfig *config);
+static int scenario_parse_int(const char *value, int min, int *result);
+static int scenario_parse_range(const char *value, int min, int *low, int *high);
+static int scenario_add_system(Manager *manager, int number, Resource *consumed, int consumed_amount,
+                               Resource *produced, int produced_amount, int processing_time);
+
+/**
+ * Initializes a `ScenarioConfig` with a small default scenario.
+ *
+ * @param[out] config  Pointer to the `ScenarioConfig` to initialize.
+ */
+void scenario_config_init(ScenarioConfig *config) {
+    config->seed = 1;
+    config->resource_count = 8;
+    config->system_count = 16;
+    config->max_fan_in = 0;
+    config->max_fan_out = 0;
+    config->processing_distribution = SCENARIO_DIST_UNIFORM;
+    config->min_processing_time = 1;
+    config->max_processing_time = 20;
+    config->min_capacity = 50;
+    config->max_capacity = 1000;
+    config->capacity_ratio = 0.5;
+    config->max_amount = 10;
+}
+
+/**
+ * Sets one field of a `ScenarioConfig` from a `name=value` option, as given to `--generate`.
+ *
+ *     fan_in=<n>                            max_fan_in (0 for no limit)
+ *     fan_out=<n>                           max_fan_out (0 for no limit)
+ *     dist=<constant|uniform|exponential>   processing_distribution
+ *     time=<min>:<max>                      min_processing_time and max_processing_time (at least 1)
+ *     capacity=<min>:<max>                  min_capacity and max_capacity
+ *     ratio=<fraction>                      capacity_ratio
+ *     amount=<n>                            max_amount
+ *
+ * @param[in,out] config  Pointer to the `ScenarioConfig` to change.
+ * @param[in]     option  The option.
+ * @return                Non-zero if the option was recognised and valid; zero otherwise, leaving `config` unchanged.
+ */
+int scenario_config_set(ScenarioConfig *config, const char *option) {
+    const char *value = strchr(option, '=');
+    size_t length;
+    char *end;
+    double ratio;
+    int number, low, high;
+
+    if (value == NULL) {
+        return 0;
+    }
+    length = value - option;
+    value++;
+
+    if (strncmp(option, "fan_in", length) == 0 && length == 6) {
+        if (!scenario_parse_int(value, 0, &number)) {
+            return 0;
+        }
+        config->max_fan_in = number;
+    } else if (strncmp(option, "fan_out", length) == 0 && length == 7) {
+        if (!scenario_parse_int(value, 0, &number)) {
+            return 0;
+        }
+        config->max_fan_out = number;
+    } else if (strncmp(option, "dist", length) == 0 && length == 4) {
+        if (strcmp(value, "constant") == 0) {
+            config->processing_distribution = SCENARIO_DIST_CONSTANT;
+        } else if (strcmp(value, "uniform") == 0) {
+            config->processing_distribution = SCENARIO_DIST_UNIFORM;
+        } else if (strcmp(value, "exponential") == 0) {
+            config->processing_distribution = SCENARIO_DIST_EXPONENTIAL;
+        } else {
+            return 0;
+        }
+    } else if (strncmp(option, "time", length) == 0 && length == 4) {
+        if (!scenario_parse_range(value, 1, &low, &high)) {
+            return 0;
+        }
+        config->min_processing_time = low;
+        config->max_processing_time = high;
+    } else if (strncmp(option, "capacity", length) == 0 && length == 8) {
+        if (!scenario_parse_range(value, 1, &low, &high)) {
+            return 0;
+        }
+        config->min_capacity = low;
+        config->max_capacity = high;
+    } else if (strncmp(option, "ratio", length) == 0 && length == 5) {
+        ratio = strtod(value, &end);
+        if (end == value || *end != '\0' || !(ratio >= 0 && ratio <= 1)) {
+            return 0;
+        }
+        config->capacity_ratio = ratio;
+    } else if (strncmp(option, "amount", length) == 0 && length == 6) {
+        if (!scenario_parse_int(value, 1, &number)) {
+            return 0;
+        }
+        config->max_amount = number;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Generates a random production graph and adds it to the `Manager`.
+ *
+ * Resources are ordered and every system consumes a resource and produces a later one, so the graph
+ * never has a cycle. The first system consumes nothing and refills the first resource ("Fuel"), and a
+ * spine of systems links every resource to the next so that Fuel can always reach the last resource
+ * ("Distance", which starts empty and ends the simulation once full). The remaining systems are placed
+ * randomly within the fan-in/fan-out limits.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` to populate.
+ * @param[in]     config   Pointer to the `ScenarioConfig` describing the graph.
+ * @return                 Non-zero if the scenario was generated; zero if the configuration is invalid.
+ */
+int scenario_generate(Manager *manager, const ScenarioConfig *config) {
+    unsigned long long state = config->seed;
+    int resource_count = config->resource_count;
+    int *producers, *consumers;
+    int i, tries, consumed, produced, capacity, amount;
+    char name[SCENARIO_NAME_LENGTH];
+    Resource *resource = NULL;
+    Resource **resources = NULL;
+    int base = manager->resources.size;
+    int success = 1;
+
+    if (resource_count < 2 || config->system_count < resource_count || config->max_amount < 1 ||
+        config->min_capacity > config->max_capacity || config->min_processing_time > config->max_processing_time) {
+        printf("Invalid scenario configuration\n");
+        return 0;
+    }
+
+    producers = (int *)calloc(resource_count, sizeof(int));
+    consumers = (int *)calloc(resource_count, sizeof(int));
+    if (producers == NULL || consumers == NULL) {
+        printf("Failed to allocate memory for scenario\n");
+        free(producers);
+        free(consumers);
+        return 0;
+    }
+
+    // Create the resources, the first starts full and the last is the destination
+    for (i = 0; i < resource_count; i++) {
+        capacity = scenario_rand_range(&state, config->min_capacity, config->max_capacity);
+        if (capacity < config->max_amount) {
+            capacity = config->max_amount;
+        }
+
+        if (i == 0) {
+            strcpy(name, "Fuel");
+            amount = capacity;
+        } else if (i == resource_count - 1) {
+            strcpy(name, "Distance");
+            amount = 0;
+        } else {
+            snprintf(name, sizeof(name), "Resource %d", i);
+            amount = (int)(capacity * config->capacity_ratio);
+        }
+
+        resource_create(&resource, name, amount, capacity);
+        manager_add_resource(manager, resource);
+    }
+    resources = (Resource **)manager->resources.items + base;
+
+    // The intake never runs dry, so a generated mission can always progress towards its destination
+    producers[0]++;
+    success = scenario_add_system(manager, 0, NULL, 0, resources[0], scenario_rand_range(&state, 1, config->max_amount),
+                                  scenario_processing_time(&state, config));
+
+    // The spine guarantees that every resource is both produced and consumed (except the ends)
+    for (i = 0; i < resource_count - 1 && success; i++) {
+        producers[i + 1]++;
+        consumers[i]++;
+        success = scenario_add_system(manager, i + 1, resources[i], scenario_rand_range(&state, 1, config->max_amount),
+                                      resources[i + 1], scenario_rand_range(&state, 1, config->max_amount),
+                                      scenario_processing_time(&state, config));
+    }
+
+    // The rest of the systems go anywhere that respects the resource ordering and fan limits
+    for (i = resource_count; i < config->system_count && success; i++) {
+        for (tries = 0; tries < SCENARIO_MAX_TRIES; tries++) {
+            consumed = scenario_rand_range(&state, 0, resource_count - 2);
+            produced = scenario_rand_range(&state, consumed + 1, resource_count - 1);
+
+            if ((config->max_fan_out <= 0 || consumers[consumed] < config->max_fan_out) &&
+                (config->max_fan_in <= 0 || producers[produced] < config->max_fan_in)) {
+                break;
+            }
+        }
+
+        if (tries == SCENARIO_MAX_TRIES) {
+            printf("Could not place system %d within the fan-in/fan-out limits\n", i);
+            success = 0;
+            break;
+        }
+
+        producers[produced]++;
+        consumers[consumed]++;
+        success = scenario_add_system(manager, i, resources[consumed], scenario_rand_range(&state, 1, config->max_amount),
+                                      resources[produced], scenario_rand_range(&state, 1, config->max_amount),
+                                      scenario_processing_time(&state, config));
+    }
+
+    free(producers);
+    free(consumers);
+    return success;
+}
+
+/**
+ * Writes every resource and system of the `Manager` as a scenario file.
+ *
+ * The format is line based, with the name taking the rest of the line so it may contain spaces:
+ *     resource <amount> <max_capacity> <name>
+ *     system <consumed index> <consumed amount> <produced index> <produced amount> <processing time> <name>
+ * A resource index of -1 means the system does not consume (or produce) anything.
+ *
+ * @param[in] manager  Pointer to the `Manager` to write.
+ * @param[in] stream   Stream to write the scenario to.
+ * @return             Non-zero if the scenario was written; zero otherwise.
+ */
+int scenario_write(Manager *manager, FILE *stream) {
+    ResourceIndex *indexes = NULL;
+    Resource *resource = NULL;
+    System *system = NULL;
+    int i;
+
+    // Systems refer to their resources by position in the file
+    indexes = resource_index_build(&manager->resources);
+    if (indexes == NULL) {
+        return 0;
+    }
+
+    fprintf(stream, "# rocket scenario v1\n");
+    for (i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        fprintf(stream, "resource %d %d %s\n", resource->amount, resource->max_capacity, resource->name);
+    }
+
+    for (i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        fprintf(stream, "system %d %d %d %d %d %s\n",
+                resource_index_find(indexes, manager->resources.size, system->consumed.resource),
+                system->consumed.amount,
+                resource_index_find(indexes, manager->resources.size, system->produced.resource),
+                system->produced.amount,
+                system->processing_time,
+                system->name);
+    }
+
+    free(indexes);
+    return 1;
+}
+
+/**
+ * Loads a scenario file written by `scenario_write` into the `Manager`.
+ *
+ * Resource indexes in the file are relative to the first resource in the same file, so a scenario can be
+ * loaded into a manager that already contains other resources. Every capacity, amount used and processing
+ * time must be positive, and a resource can't start above its capacity; a hand edited file breaking that
+ * is rejected with the number of the line.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` to populate.
+ * @param[in]     stream   Stream to read the scenario from.
+ * @return                 Non-zero if the whole scenario was loaded; zero if a line could not be parsed or is invalid.
+ */
+int scenario_load(Manager *manager, FILE *stream) {
+    char line[SCENARIO_LINE_LENGTH];
+    int amount, max_capacity, consumed, consumed_amount, produced, produced_amount, processing_time;
+    int name_start, line_number = 0;
+    int base = manager->resources.size;
+    int resource_count = 0;
+    Resource *resource = NULL;
+    System *system = NULL;
+    ResourceAmount consume, produce;
+
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        if (sscanf(line, "resource %d %d %n", &amount, &max_capacity, &name_start) == 2 && line[name_start] != '\0') {
+            if (max_capacity < 1 || amount < 0 || amount > max_capacity) {
+                printf("Invalid resource on scenario line %d: the capacity must be positive, and the amount from 0 to the capacity\n", line_number);
+                return 0;
+            }
+            resource_create(&resource, line + name_start, amount, max_capacity);
+            manager_add_resource(manager, resource);
+            resource_count++;
+        } else if (sscanf(line, "system %d %d %d %d %d %n", &consumed, &consumed_amount, &produced, &produced_amount,
+                          &processing_time, &name_start) == 5 && line[name_start] != '\0' &&
+                   consumed >= -1 && consumed < resource_count && produced >= -1 && produced < resource_count) {
+            if ((consumed >= 0 && consumed_amount < 1) || (produced >= 0 && produced_amount < 1) || processing_time < 1) {
+                printf("Invalid system on scenario line %d: the amounts used and the processing time must be positive\n", line_number);
+                return 0;
+            }
+            resource_amount_init(&consume, consumed < 0 ? NULL : manager->resources.items[base + consumed], consumed_amount);
+            resource_amount_init(&produce, produced < 0 ? NULL : manager->resources.items[base + produced], produced_amount);
+            system_create(&system, line + name_start, consume, produce, processing_time, &manager->event_queue);
+            manager_add_system(manager, system);
+        } else {
+            printf("Invalid scenario line %d: %s\n", line_number, line);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Parses a whole string as an integer.
+ *
+ * @param[in]  value   String to parse.
+ * @param[in]  min     Smallest value accepted.
+ * @param[out] result  Set to the integer, only if it is valid.
+ * @return             Non-zero if the whole string is an integer of at least `min`; zero otherwise.
+ */
+static int scenario_parse_int(const char *value, int min, int *result) {
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || number < min || number > INT_MAX) {
+        return 0;
+    }
+
+    *result = (int)number;
+    return 1;
+}
+
+/**
+ * Parses a whole string of the form `<low>:<high>`.
+ *
+ * @param[in]  value  String to parse.
+ * @param[in]  min    Smallest `low` accepted.
+ * @param[out] low    Set to the start of the range, only if it is valid.
+ * @param[out] high   Set to the end of the range, only if it is valid.
+ * @return            Non-zero if the range is valid, with `min <= low <= high`; zero otherwise.
+ */
+static int scenario_parse_range(const char *value, int min, int *low, int *high) {
+    int first, last, end = 0;
+
+    if (sscanf(value, "%d:%d%n", &first, &last, &end) != 2 || value[end] != '\0' || first < min || last < first) {
+        return 0;
+    }
+
+    *low = first;
+    *high = last;
+    return 1;
+}
+
+/**
+ * Returns the next number from a splitmix64 generator.
+ *
+ * Used instead of `rand` so that scenarios do not depend on (or disturb) any global random state.
+ *
+ * @param[in,out] state  Pointer to the generator state.
+ * @return               A uniformly distributed 64-bit number.
+ */
+static unsigned long long scenario_rand(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Returns a uniformly distributed integer in an inclusive range.
+ *
+ * @param[in,out] state  Pointer to the generator state.
+ * @param[in]     min    Smallest value returned.
+ * @param[in]     max    Largest value returned.
+ * @return               A value between `min` and `max`.
+ */
+static int scenario_rand_range(unsigned long long *state, int min, int max) {
+    return min + (int)(scenario_rand(state) % (unsigned long long)(max - min + 1));
+}
+
+/**
+ * Picks a processing time from the configured distribution.
+ *
+ * @param[in,out] state   Pointer to the generator state.
+ * @param[in]     config  Pointer to the `ScenarioConfig` describing the distribution.
+ * @return                Processing time in milliseconds.
+ */
+static int scenario_processing_time(unsigned long long *state, const ScenarioConfig *config) {
+    double uniform, value;
+
+    switch (config->processing_distribution) {
+        case SCENARIO_DIST_CONSTANT:
+            return config->min_processing_time;
+        case SCENARIO_DIST_EXPONENTIAL:
+            uniform = (scenario_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+            value = -config->min_processing_time * log(1.0 - uniform);
+            // Every system takes some time, as `scenario_load` rejects anything else
+            if (value < 1) {
+                return 1;
+            }
+            return value > config->max_processing_time ? config->max_processing_time : (int)value;
+        default:
+            return scenario_rand_range(state, config->min_processing_time, config->max_processing_time);
+    }
+}
+
+/**
+ * Creates a generated system and adds it to the `Manager`.
+ *
+ * @param[in,out] manager          Pointer to the `Manager`.
+ * @param[in]     number           Number used to name the system.
+ * @param[in]     consumed         Resource consumed by the system.
+ * @param[in]     consumed_amount  Amount consumed per conversion.
+ * @param[in]     produced         Resource produced by the system.
+ * @param[in]     produced_amount  Amount produced per conversion.
+ * @param[in]     processing_time  Processing time in milliseconds.
+ * @return                         Non-zero if the system was created; zero otherwise.
+ */
+static int scenario_add_system(Manager *manager, int number, Resource *consumed, int consumed_amount,
+                               Resource *produced, int produced_amount, int processing_time) {
+    char name[SCENARIO_NAME_LENGTH];
+    ResourceAmount consume, produce;
+    System *system = NULL;
+
+    snprintf(name, sizeof(name), "System %d", number);
+    resource_amount_init(&consume, consumed, consumed_amount);
+    resource_amount_init(&produce, produced, produced_amount);
+    system_create(&system, name, consume, produce, processing_time, &manager->event_queue);
+    if (system == NULL) {
+        return 0;
+    }
+
+    manager_add_system(manager, system);
+    return 1;
+}
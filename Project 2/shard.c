@@ -0,0 +1,555 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// Amounts that went through a resource during a run, summed over every shard
+typedef struct ShardFlow {
+    long long consumed;
+    long long produced;
+} ShardFlow;
+
+#define SHARD_MAILBOX_SIZE 1024  // Boundary events kept for the other shards before the oldest is overwritten
+#define SHARD_TIME_TOLERANCE   0.25  // Fraction of the single-process end time the sharded run may differ by
+#define SHARD_TIME_SLACK_MS    (2 * SYSTEM_WAIT_TIME)  // Smallest difference allowed, boundary resources are polled
+#define SHARD_AMOUNT_TOLERANCE 0.10  // Fraction of a resource's capacity its final amounts may differ by
+
+// An event about a boundary resource, posted by one shard for all of the others
+typedef struct ShardMessage {
+    long long sequence;     // Mailbox position + 1 once the message is complete, 0 while it is written
+    int shard;              // Shard that posted the message
+    int resource;           // Index of the resource in the shared region
+    int status;
+    int priority;
+    int amount;
+} ShardMessage;
+
+// What a single shard did during a run
+typedef struct ShardReport {
+    int system_count;
+    long long conversions;
+    long long stores;
+    long long events;
+    long long forwarded;    // Events received from other shards
+} ShardReport;
+
+// Everything the coordinator and the shards share; the whole region is one anonymous shared mapping
+// created before forking, so the pointers inside it are valid in every process
+typedef struct ShardRegion {
+    int running;                // Cleared to stop every shard
+    int termination_reason;     // Set once, by the first shard (or the coordinator) to end the run
+    int shard_count;
+    int resource_count;
+    Resource *resources;        // Shared copies of every resource, updated with `resource_consume/store`
+    ShardFlow *flows;
+    ShardReport *reports;
+    ShardMessage *mailbox;      // Ring of boundary events shared by every shard
+    long long mailbox_head;     // Next mailbox position to be claimed by a poster
+    size_t size;
+} ShardRegion;
+
+// A shard's view of the region, used as the observer of its event queue
+typedef struct ShardContext {
+    ShardRegion *region;
+    Manager *manager;           // The shard's local manager, which resolves event handles
+    int shard;
+    long long mailbox_tail;     // Next mailbox position this shard has not read
+} ShardContext;
+
+// Result of one sharded run, kept by the coordinator to compare runs
+typedef struct ShardOutcome {
+    int termination_reason;
+    long long end_time_ms;
+    int boundary_count;
+    int conserved;
+    int *amounts;
+} ShardOutcome;
+
+// Helper functions just used by this C file
+static int shard_execute(Manager *manager, int shard_count, long long time_limit_ms, ShardOutcome *outcome, FILE *stream);
+static ShardRegion *shard_region_create(Manager *manager, int shard_count);
+static void shard_worker(Manager *manager, ShardRegion *region, const ResourceIndex *indexes, int shard);
+static int shard_of_system(int system, int system_count, int shard_count);
+static int shard_within(long long value, long long reference, double tolerance);
+static void shard_stop(ShardRegion *region, int reason);
+static void shard_post(void *context, const Event *event);
+static int shard_receive(ShardContext *context, EventQueue *queue);
+
+/**
+ * Runs the manager's scenario in a single process and split across shards, and compares the two runs.
+ *
+ * Both runs start from the manager's current resource amounts, which are left untouched. Each run is
+ * checked for conservation (every resource ends at its initial amount plus what was produced minus what
+ * was consumed). The sharded run then has to end for the same reason as the single-process run, within
+ * SHARD_TIME_TOLERANCE of its end time (or SHARD_TIME_SLACK_MS, for short runs), with every resource within SHARD_AMOUNT_TOLERANCE of its capacity
+ * of the single-process amount. Both runs are timed on the wall clock and their systems run on threads,
+ * so only the scheduling can tell them apart.
+ *
+ * @param[in] manager        Pointer to the `Manager` holding the scenario.
+ * @param[in] shard_count    Number of worker processes for the sharded run.
+ * @param[in] time_limit_ms  Wall time after which a run is stopped with END_TIMEOUT.
+ * @param[in] stream         Stream to print the comparison to.
+ * @return                   Non-zero if both runs conserved every resource and the sharded run matched.
+ */
+int shard_compare(Manager *manager, int shard_count, long long time_limit_ms, FILE *stream) {
+    ShardOutcome single, sharded;
+    Resource *resource = NULL;
+    double slack;
+    int i, within, matches;
+
+    if (shard_count < 1) {
+        printf("Invalid shard count\n");
+        return 0;
+    }
+
+    single.amounts = (int *)calloc(manager->resources.size + 1, sizeof(int));
+    sharded.amounts = (int *)calloc(manager->resources.size + 1, sizeof(int));
+    if (single.amounts == NULL || sharded.amounts == NULL) {
+        printf("Failed to allocate memory for shard comparison\n");
+        free(single.amounts);
+        free(sharded.amounts);
+        return 0;
+    }
+
+    fprintf(stream, "%-8s %-12s %10s %10s %10s\n", "Shards", "Result", "Time(ms)", "Boundary", "Conserved");
+    if (!shard_execute(manager, 1, time_limit_ms, &single, stream) ||
+        !shard_execute(manager, shard_count, time_limit_ms, &sharded, stream)) {
+        free(single.amounts);
+        free(sharded.amounts);
+        return 0;
+    }
+
+    matches = single.conserved && sharded.conserved && single.termination_reason == sharded.termination_reason;
+    slack = SHARD_TIME_TOLERANCE * single.end_time_ms;
+    if (slack < SHARD_TIME_SLACK_MS) {
+        slack = SHARD_TIME_SLACK_MS;
+    }
+    within = shard_within(sharded.end_time_ms, single.end_time_ms, slack);
+    matches = matches && within;
+    fprintf(stream, "\n%-20s %12lld %12lld %8s (within %.0fms)\n", "End time (ms)", single.end_time_ms, sharded.end_time_ms,
+            within ? "ok" : "DIFFERS", slack);
+
+    fprintf(stream, "\n%-20s %12s %12s\n", "Final amounts", "1 shard", "sharded");
+    for (i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        within = shard_within(sharded.amounts[i], single.amounts[i], SHARD_AMOUNT_TOLERANCE * resource->max_capacity);
+        matches = matches && within;
+        fprintf(stream, "%-20s %12d %12d %8s\n", resource->name, single.amounts[i], sharded.amounts[i], within ? "ok" : "DIFFERS");
+    }
+    fprintf(stream, "(amounts within %.0f%% of capacity)\n", SHARD_AMOUNT_TOLERANCE * 100);
+
+    fprintf(stream, "\nSharded run %s the single-process run\n", matches ? "matches" : "DIFFERS FROM");
+
+    free(single.amounts);
+    free(sharded.amounts);
+    return matches;
+}
+
+/**
+ * Runs the scenario split across worker processes, coordinating until the run ends.
+ *
+ * Systems are split into contiguous blocks, one per shard. Every resource is copied into shared memory;
+ * resources used by more than one shard are the boundary, and flow between shards purely through the
+ * atomic `resource_consume` and `resource_store`. Each shard runs its own `Manager` over its systems, and
+ * events about boundary resources are also posted to a shared mailbox so that every shard's manager can
+ * react to them. The first shard to see a termination condition records it and stops the others. The coordinator (the
+ * calling process) waits for that, or for the time limit, then collects the results.
+ *
+ * @param[in]  manager        Pointer to the `Manager` holding the scenario.
+ * @param[in]  shard_count    Number of worker processes.
+ * @param[in]  time_limit_ms  Wall time after which the run is stopped.
+ * @param[out] outcome        Pointer to the `ShardOutcome` to fill in, with `amounts` already allocated.
+ * @param[in]  stream         Stream to print the run's summary line to.
+ * @return                    Non-zero if the run completed; zero otherwise.
+ */
+static int shard_execute(Manager *manager, int shard_count, long long time_limit_ms, ShardOutcome *outcome, FILE *stream) {
+    ShardRegion *region;
+    ResourceIndex *indexes;
+    pid_t *pids;
+    int i, status, exited = 0, started = 0;
+    long long start_ns = stats_now_ns();
+
+    if (shard_count > manager->systems.size) {
+        shard_count = manager->systems.size > 0 ? manager->systems.size : 1;
+    }
+
+    region = shard_region_create(manager, shard_count);
+    indexes = resource_index_build(&manager->resources);
+    pids = (pid_t *)calloc(shard_count, sizeof(pid_t));
+    if (region == NULL || indexes == NULL || pids == NULL) {
+        printf("Failed to set up shards\n");
+        if (region != NULL) {
+            munmap(region, region->size);
+        }
+        free(indexes);
+        free(pids);
+        return 0;
+    }
+
+    // Anything still buffered would otherwise be printed again by every child
+    fflush(stdout);
+    fflush(stream);
+
+    for (i = 0; i < shard_count; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            shard_worker(manager, region, indexes, i);
+        }
+        if (pids[i] < 0) {
+            printf("Failed to start shard %d\n", i);
+            shard_stop(region, END_TIMEOUT);
+            break;
+        }
+        started++;
+    }
+
+    // Coordinate: end the run on the time limit, or as soon as any shard exits early
+    while (exited < started) {
+        for (i = 0; i < started; i++) {
+            if (pids[i] > 0 && waitpid(pids[i], &status, WNOHANG) == pids[i]) {
+                pids[i] = 0;
+                exited++;
+                shard_stop(region, END_TIMEOUT);
+            }
+        }
+
+        if ((stats_now_ns() - start_ns) / 1000000 >= time_limit_ms) {
+            shard_stop(region, END_TIMEOUT);
+        }
+
+        if (exited < started) {
+            usleep(MANAGER_WAIT_TIME * 1000);
+        }
+    }
+
+    outcome->termination_reason = region->termination_reason;
+    outcome->end_time_ms = (stats_now_ns() - start_ns) / 1000000;
+    outcome->boundary_count = 0;
+    outcome->conserved = 1;
+    for (i = 0; i < region->resource_count; i++) {
+        Resource *initial = manager->resources.items[i];
+        Resource *final = &region->resources[i];
+
+        outcome->amounts[i] = final->amount;
+        outcome->boundary_count += final->shared;
+        if (initial->amount + region->flows[i].produced - region->flows[i].consumed != final->amount) {
+            printf("Resource %s not conserved: %d + %lld - %lld != %d\n", initial->name, initial->amount,
+                   region->flows[i].produced, region->flows[i].consumed, final->amount);
+            outcome->conserved = 0;
+        }
+    }
+
+    fprintf(stream, "%-8d %-12s %10lld %10d %10s\n", shard_count, manager_termination_name(outcome->termination_reason),
+            outcome->end_time_ms, outcome->boundary_count, outcome->conserved ? "yes" : "NO");
+    for (i = 0; i < shard_count; i++) {
+        fprintf(stream, "    shard %-3d systems=%-6d conversions=%-8lld stores=%-8lld events=%-6lld forwarded=%lld\n", i,
+                region->reports[i].system_count, region->reports[i].conversions, region->reports[i].stores,
+                region->reports[i].events, region->reports[i].forwarded);
+    }
+
+    munmap(region, region->size);
+    free(indexes);
+    free(pids);
+    return started == shard_count;
+}
+
+/**
+ * Creates the shared region for a run and copies the manager's resources into it.
+ *
+ * Resources referenced by systems from different shards are marked as `shared`. Everything a manager
+ * sets up when a resource is added (watermarks, handle) is set here, before any shard starts, so the
+ * shards never write these fields while other shards are already changing the amounts next to them.
+ *
+ * @param[in] manager      Pointer to the `Manager` holding the scenario.
+ * @param[in] shard_count  Number of shards.
+ * @return                 The region, or NULL if it could not be mapped.
+ */
+static ShardRegion *shard_region_create(Manager *manager, int shard_count) {
+    int resource_count = manager->resources.size;
+    int system_count = manager->systems.size;
+    // Resources start a cache line (`amount` is CACHE_ALIGNED), and the mapping itself starts a page
+    size_t resources_offset = (sizeof(ShardRegion) + SHARD_MAILBOX_SIZE * sizeof(ShardMessage) + CACHE_LINE_SIZE - 1) /
+                              CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    size_t size = resources_offset + resource_count * (sizeof(Resource) + sizeof(ShardFlow)) +
+                  shard_count * sizeof(ShardReport);
+    ShardRegion *region;
+    ResourceIndex *indexes;
+    SlotMap handles;
+    int *owner;
+    int i, j, index, shard;
+
+    region = (ShardRegion *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+
+    memset(region, 0, size);
+    region->size = size;
+    region->running = 1;
+    region->termination_reason = END_RUNNING;
+    region->shard_count = shard_count;
+    region->resource_count = resource_count;
+    region->mailbox = (ShardMessage *)(region + 1);
+    region->resources = (Resource *)((char *)region + resources_offset);
+    region->flows = (ShardFlow *)(region->resources + resource_count);
+    region->reports = (ShardReport *)(region->flows + resource_count);
+
+    // Every shard inserts the resources into an empty slot map in this order, so gets these handles
+    slot_map_init(&handles);
+    for (i = 0; i < resource_count; i++) {
+        region->resources[i] = *(Resource *)manager->resources.items[i];
+        region->resources[i].shared = 0;
+        region->resources[i].waiter_count = 0;
+        region->resources[i].waiting_available = NULL;
+        region->resources[i].waiting_space = NULL;
+        region->resources[i].count_transfers = 0;
+        region->resources[i].handle = slot_map_insert(&handles, &region->resources[i]);
+        resource_set_watermarks(&region->resources[i], manager->threshold_low, THRESHOLD_RESOURCE_HIGH, THRESHOLD_HYSTERESIS);
+        sem_init(&region->resources[i].lock, 1, 1);
+    }
+    slot_map_clean(&handles);
+
+    // A resource is on the boundary once systems from two different shards use it
+    indexes = resource_index_build(&manager->resources);
+    owner = (int *)malloc((resource_count + 1) * sizeof(int));
+    if (indexes == NULL || owner == NULL) {
+        free(indexes);
+        free(owner);
+        munmap(region, size);
+        return NULL;
+    }
+    for (i = 0; i < resource_count; i++) {
+        owner[i] = -1;
+    }
+
+    for (i = 0; i < system_count; i++) {
+        System *system = manager->systems.items[i];
+        Resource *used[2] = {system->consumed.resource, system->produced.resource};
+        shard = shard_of_system(i, system_count, shard_count);
+
+        for (j = 0; j < 2; j++) {
+            index = resource_index_find(indexes, resource_count, used[j]);
+            if (index < 0) {
+                continue;
+            }
+            if (owner[index] < 0) {
+                owner[index] = shard;
+            } else if (owner[index] != shard) {
+                region->resources[index].shared = 1;
+            }
+        }
+    }
+
+    free(indexes);
+    free(owner);
+    return region;
+}
+
+/**
+ * Runs one shard in a child process. Never returns.
+ *
+ * The child's copies of its systems are pointed at the shared resources and at a local `Manager`, which
+ * runs every system on its own thread until the run ends, as `main` does with `--threads`. The shared
+ * resources were set up by `shard_region_create`, so the shard only inserts them into its slot map, in
+ * the same order, and a resource has the same handle in every shard.
+ *
+ * @param[in]     manager  Pointer to the scenario `Manager` (the child's copy).
+ * @param[in,out] region   Pointer to the shared `ShardRegion`.
+ * @param[in]     indexes  Index of the scenario's resources.
+ * @param[in]     shard    Number of this shard.
+ */
+static void shard_worker(Manager *manager, ShardRegion *region, const ResourceIndex *indexes, int shard) {
+    Manager local;
+    ShardContext context;
+    ShardReport *report = &region->reports[shard];
+    int system_count = manager->systems.size;
+    int i, index;
+
+    manager_init(&local);
+    local.display_enabled = 0;
+    manager_set_stats_timing(&local, manager->stats_timed);
+    // A shard only sees its own systems, so it can't tell a stall from waiting on another shard
+    local.stall.enabled = region->shard_count == 1;
+
+    context.region = region;
+    context.manager = &local;
+    context.shard = shard;
+    context.mailbox_tail = 0;
+    local.event_queue.observer = shard_post;
+    local.event_queue.observer_context = &context;
+
+    for (i = 0; i < region->resource_count; i++) {
+        slot_map_insert(&local.resources, &region->resources[i]);
+    }
+
+    for (i = 0; i < system_count; i++) {
+        System *system = manager->systems.items[i];
+        if (shard_of_system(i, system_count, region->shard_count) != shard) {
+            continue;
+        }
+
+        index = resource_index_find(indexes, region->resource_count, system->consumed.resource);
+        system->consumed.resource = index < 0 ? NULL : &region->resources[index];
+        index = resource_index_find(indexes, region->resource_count, system->produced.resource);
+        system->produced.resource = index < 0 ? NULL : &region->resources[index];
+        system->event_queue = &local.event_queue;
+        system_stats_init(&system->stats, system->status);
+        manager_add_system(&local, system);
+    }
+
+    manager_start_threads(&local);
+    while (local.simulation_running && __atomic_load_n(&region->running, __ATOMIC_ACQUIRE)) {
+        report->forwarded += shard_receive(&context, &local.event_queue);
+        manager_run(&local);
+        usleep(MANAGER_WAIT_TIME * 1000);
+    }
+    manager_stop_threads(&local);
+
+    if (local.termination_reason != END_RUNNING) {
+        shard_stop(region, local.termination_reason);
+    }
+
+    // Report this shard's share of the flows through every resource
+    report->system_count = local.systems.size;
+    report->events = local.event_queue.latency.total;
+    for (i = 0; i < local.systems.size; i++) {
+        System *system = local.systems.items[i];
+
+        report->conversions += system->stats.conversions;
+        report->stores += system->stats.stores;
+        if (system->consumed.resource != NULL) {
+            __atomic_fetch_add(&region->flows[system->consumed.resource - region->resources].consumed,
+                               system->stats.consumed_total, __ATOMIC_RELAXED);
+        }
+        if (system->produced.resource != NULL) {
+            __atomic_fetch_add(&region->flows[system->produced.resource - region->resources].produced,
+                               system->stats.produced_total, __ATOMIC_RELAXED);
+        }
+    }
+
+    // The process image is discarded, so there is nothing to clean up (and the stdio buffers belong to the parent)
+    _exit(0);
+}
+
+/**
+ * Returns the shard a system belongs to, splitting the systems into contiguous blocks.
+ *
+ * @param[in] system        Position of the system in the manager.
+ * @param[in] system_count  Number of systems in the manager.
+ * @param[in] shard_count   Number of shards.
+ * @return                  Shard number, from 0 to `shard_count - 1`.
+ */
+static int shard_of_system(int system, int system_count, int shard_count) {
+    return (int)((long long)system * shard_count / system_count);
+}
+
+/**
+ * Checks whether a value is within a tolerance of a reference value.
+ *
+ * @param[in] value      Value to check.
+ * @param[in] reference  Value it should be close to.
+ * @param[in] tolerance  Largest difference allowed, in the same units.
+ * @return               Non-zero if `value` is within `tolerance` of `reference`.
+ */
+static int shard_within(long long value, long long reference, double tolerance) {
+    long long difference = value > reference ? value - reference : reference - value;
+
+    return difference <= tolerance;
+}
+
+/**
+ * Stops every shard, recording the reason if no shard has recorded one yet.
+ *
+ * @param[in,out] region  Pointer to the shared `ShardRegion`.
+ * @param[in]     reason  END_* code to record.
+ */
+static void shard_stop(ShardRegion *region, int reason) {
+    int expected = END_RUNNING;
+
+    __atomic_compare_exchange_n(&region->termination_reason, &expected, reason, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    __atomic_store_n(&region->running, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Posts an event about a boundary resource to the mailbox, as the observer of a shard's event queue.
+ *
+ * Events about resources only this shard uses, and events forwarded from other shards, are not posted.
+ *
+ * @param[in,out] context  Pointer to the posting shard's `ShardContext`.
+ * @param[in]     event    Pointer to the `Event` that was pushed.
+ */
+static void shard_post(void *context, const Event *event) {
+    ShardContext *shard = (ShardContext *)context;
+    ShardRegion *region = shard->region;
+    ShardMessage *message;
+    Resource *resource = slot_map_get(&shard->manager->resources, event->resource);
+    long long position;
+
+    if (slot_map_get(&shard->manager->systems, event->system) == NULL || resource == NULL || !resource->shared) {
+        return;
+    }
+
+    position = __atomic_fetch_add(&region->mailbox_head, 1, __ATOMIC_ACQ_REL);
+    message = &region->mailbox[position % SHARD_MAILBOX_SIZE];
+
+    __atomic_store_n(&message->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    message->shard = shard->shard;
+    message->resource = (int)(resource - region->resources);
+    message->status = event->status;
+    message->priority = event->priority;
+    message->amount = event->amount;
+    __atomic_store_n(&message->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pushes every event posted by other shards since the last call onto the shard's queue.
+ *
+ * A shard that falls more than a mailbox behind skips the overwritten messages, they are only hints.
+ *
+ * @param[in,out] context  Pointer to the receiving shard's `ShardContext`.
+ * @param[in,out] queue    Pointer to the shard's `EventQueue`.
+ * @return                 Number of events received.
+ */
+static int shard_receive(ShardContext *context, EventQueue *queue) {
+    ShardRegion *region = context->region;
+    long long head = __atomic_load_n(&region->mailbox_head, __ATOMIC_ACQUIRE);
+    long long sequence;
+    ShardMessage *slot, message;
+    Event event;
+    int received = 0;
+
+    if (head - context->mailbox_tail > SHARD_MAILBOX_SIZE) {
+        context->mailbox_tail = head - SHARD_MAILBOX_SIZE;
+    }
+
+    while (context->mailbox_tail < head) {
+        slot = &region->mailbox[context->mailbox_tail % SHARD_MAILBOX_SIZE];
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        // Still being written: pick it up next time
+        if (sequence < context->mailbox_tail + 1) {
+            break;
+        }
+
+        message = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        context->mailbox_tail++;
+
+        // Overwritten by a later message while reading
+        if (sequence != context->mailbox_tail || __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+            continue;
+        }
+
+        if (message.shard != context->shard) {
+            event_init(&event, NULL, &region->resources[message.resource], message.status, message.priority, message.amount);
+            event_queue_push(queue, &event);
+            received++;
+        }
+    }
+
+    return received;
+}
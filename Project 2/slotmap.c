@@ -0,0 +1,204 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Helper functions just used by this C file
+static int slot_map_grow(SlotMap *map);
+
+/**
+ * Initializes an empty `SlotMap`.
+ *
+ * Allocates room for a single entry, growing by doubling as entries are inserted.
+ *
+ * @param[out] map  Pointer to the `SlotMap` to initialize.
+ */
+void slot_map_init(SlotMap *map) {
+    map->size = 0;
+    map->capacity = 1;
+    map->slot_count = 0;
+    map->free_head = -1;
+
+    map->items = (void **)malloc(map->capacity * sizeof(void *));
+    map->owners = (int *)malloc(map->capacity * sizeof(int));
+    map->slots = (Slot *)malloc(map->capacity * sizeof(Slot));
+    if (map->items == NULL || map->owners == NULL || map->slots == NULL) {
+        printf("Failed to allocate memory for slot map\n");
+        map->capacity = 0;
+    }
+}
+
+/**
+ * Frees the memory used by a `SlotMap`.
+ *
+ * The entries themselves belong to the caller and are not freed.
+ *
+ * @param[in,out] map  Pointer to the `SlotMap` to clean.
+ */
+void slot_map_clean(SlotMap *map) {
+    if (map != NULL) {
+        free(map->items);
+        free(map->owners);
+        free(map->slots);
+        map->items = NULL;
+        map->owners = NULL;
+        map->slots = NULL;
+        map->size = 0;
+        map->capacity = 0;
+    }
+}
+
+/**
+ * Inserts an entry into a `SlotMap`.
+ *
+ * The entry is appended to the dense `items` array, and a slot (reusing a free one when possible)
+ * records where it is. The slot's generation is what makes old handles to a reused slot stale.
+ *
+ * @param[in,out] map   Pointer to the `SlotMap`.
+ * @param[in]     item  Entry to insert.
+ * @return              Handle to the entry, or an invalid handle (generation 0) if memory ran out.
+ */
+Handle slot_map_insert(SlotMap *map, void *item) {
+    Handle handle = {0, 0};
+    int slot;
+
+    if (map->size == map->capacity && !slot_map_grow(map)) {
+        return handle;
+    }
+
+    if (map->free_head >= 0) {
+        slot = map->free_head;
+        map->free_head = map->slots[slot].dense;
+    } else {
+        slot = map->slot_count++;
+        map->slots[slot].generation = 0;
+    }
+
+    // Generation 0 is never handed out, so a zeroed handle is always invalid
+    map->slots[slot].generation++;
+    if (map->slots[slot].generation == 0) {
+        map->slots[slot].generation = 1;
+    }
+    map->slots[slot].dense = map->size;
+
+    map->items[map->size] = item;
+    map->owners[map->size] = slot;
+    map->size++;
+
+    handle.index = (unsigned int)slot;
+    handle.generation = map->slots[slot].generation;
+    return handle;
+}
+
+/**
+ * Looks up the entry for a handle.
+ *
+ * @param[in] map     Pointer to the `SlotMap`.
+ * @param[in] handle  Handle returned by `slot_map_insert`.
+ * @return            The entry, or NULL if it has been removed (or the handle is invalid).
+ */
+void *slot_map_get(const SlotMap *map, Handle handle) {
+    const Slot *slot;
+
+    if (handle.generation == 0 || handle.index >= (unsigned int)map->slot_count) {
+        return NULL;
+    }
+
+    slot = &map->slots[handle.index];
+    if (slot->generation != handle.generation) {
+        return NULL;
+    }
+
+    return map->items[slot->dense];
+}
+
+/**
+ * Removes the entry for a handle.
+ *
+ * The last entry is moved into the removed entry's place so `items` stays dense, and the slot's
+ * generation is bumped so every existing handle to it becomes stale.
+ *
+ * @param[in,out] map     Pointer to the `SlotMap`.
+ * @param[in]     handle  Handle of the entry to remove.
+ * @return                The removed entry, or NULL if the handle was already stale.
+ */
+void *slot_map_remove(SlotMap *map, Handle handle) {
+    void *item = slot_map_get(map, handle);
+    Slot *slot;
+    int dense, last;
+
+    if (item == NULL) {
+        return NULL;
+    }
+
+    slot = &map->slots[handle.index];
+    dense = slot->dense;
+    last = map->size - 1;
+
+    map->items[dense] = map->items[last];
+    map->owners[dense] = map->owners[last];
+    map->slots[map->owners[dense]].dense = dense;
+    map->size--;
+
+    slot->generation++;
+    if (slot->generation == 0) {
+        slot->generation = 1;
+    }
+    slot->dense = map->free_head;
+    map->free_head = (int)handle.index;
+
+    return item;
+}
+
+/**
+ * Returns the handle of the entry at a position in `items`.
+ *
+ * @param[in] map    Pointer to the `SlotMap`.
+ * @param[in] dense  Position in `items`, from 0 to `size - 1`.
+ * @return           Handle to the entry.
+ */
+Handle slot_map_handle_at(const SlotMap *map, int dense) {
+    Handle handle;
+
+    handle.index = (unsigned int)map->owners[dense];
+    handle.generation = map->slots[handle.index].generation;
+    return handle;
+}
+
+/**
+ * Doubles the capacity of a `SlotMap`.
+ *
+ * Use of realloc is NOT permitted, so each array is copied into a new allocation.
+ *
+ * @param[in,out] map  Pointer to the `SlotMap` to grow.
+ * @return             Non-zero if the map grew; zero if memory ran out.
+ */
+static int slot_map_grow(SlotMap *map) {
+    int capacity = map->capacity > 0 ? map->capacity * 2 : 1;
+    void **items = (void **)malloc(capacity * sizeof(void *));
+    int *owners = (int *)malloc(capacity * sizeof(int));
+    Slot *slots = (Slot *)malloc(capacity * sizeof(Slot));
+
+    if (items == NULL || owners == NULL || slots == NULL) {
+        printf("Failed to resize slot map\n");
+        free(items);
+        free(owners);
+        free(slots);
+        return 0;
+    }
+
+    if (map->capacity > 0) {
+        memcpy(items, map->items, map->size * sizeof(void *));
+        memcpy(owners, map->owners, map->size * sizeof(int));
+        memcpy(slots, map->slots, map->slot_count * sizeof(Slot));
+    }
+    free(map->items);
+    free(map->owners);
+    free(map->slots);
+
+    map->items = items;
+    map->owners = owners;
+    map->slots = slots;
+    map->capacity = capacity;
+    return 1;
+}
@@ -0,0 +1,315 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// What `stall_analyze` works out, kept together so `stall_print` can explain it
+typedef struct StallAnalysis {
+    ResourceIndex *indexes;
+    int *live;          // Per system (by position in the manager), non-zero if it could still run
+    int *producers;     // Per resource, live systems producing it
+    int *consumers;     // Per resource, live systems consuming it
+    int oxygen;         // Position of the "Oxygen" resource, -1 if there is none
+    int distance;       // Position of the "Distance" resource, -1 if there is none
+    int live_count;
+    int can_end;        // non-zero if a live system uses up Oxygen or adds Distance
+} StallAnalysis;
+
+// Helper functions just used by this C file
+static int stall_analyze(const Manager *manager, StallAnalysis *analysis, int include_terminated);
+static void stall_analysis_clean(StallAnalysis *analysis);
+static int stall_can_run(const Manager *manager, const StallAnalysis *analysis, const System *system);
+static int stall_find_resource(const Manager *manager, const char *name);
+static long long stall_progress(const Manager *manager);
+static long long stall_window(const Manager *manager);
+
+/**
+ * Initializes a `StallDetector`, enabled and with nothing suspected.
+ *
+ * @param[out] stall  Pointer to the `StallDetector` to initialize.
+ */
+void stall_init(StallDetector *stall) {
+    memset(stall, 0, sizeof(StallDetector));
+    stall->enabled = 1;
+}
+
+/**
+ * Ends the simulation if no system can make progress again, or none that could end it.
+ *
+ * The live systems are the least fixed point of: a system is live if it could run given the current
+ * amounts and the other live systems. A system about to convert is live if its input has enough, or a
+ * live system produces the input; one holding output is live if its output has room, or a live system
+ * consumes the output. Starting from nothing, this only ever reaches systems that can run now or are fed
+ * by ones that can, so an exhausted input with no producer, or a cycle with nothing left in it, is never
+ * live. The run is stalled if nothing is live, or if nothing live consumes Oxygen or produces Distance,
+ * since then neither ending can ever happen.
+ *
+ * The analysis only runs after something that can stall a system (a system reporting that it failed to
+ * consume or store, a system added or removed) has set `dirty`, and on every loop while a stall is
+ * suspected. A threaded system in the middle of its processing time looks stopped, so the run is only
+ * ended once the stall has lasted longer than any system's processing time (with no conversion or
+ * store, if nothing was live at all).
+ *
+ * @param[in,out] manager  Pointer to the `Manager` to check.
+ * @return                 Non-zero if the simulation was ended; zero otherwise.
+ */
+int stall_check(Manager *manager) {
+    StallDetector *stall = &manager->stall;
+    StallAnalysis analysis;
+    long long now, progress;
+    int dirty;
+
+    // Manager workers set `dirty` from their own threads
+    dirty = __atomic_exchange_n(&stall->dirty, 0, __ATOMIC_RELAXED);
+    if (!stall->enabled || !manager->simulation_running || (!dirty && !stall->suspect)) {
+        return 0;
+    }
+
+    if (!stall_analyze(manager, &analysis, 0)) {
+        return 0;
+    }
+    stall_analysis_clean(&analysis);
+    stall->checks++;
+    stall->live_count = analysis.live_count;
+    stall->can_end = analysis.can_end;
+
+    if (stall->live_count > 0 && stall->can_end) {
+        stall->suspect = 0;
+        return 0;
+    }
+
+    now = clock_now_ms(&manager->clock);
+    progress = stall_progress(manager);
+
+    // Systems still converting or storing, while nothing is live, are finishing work already started
+    if (!stall->suspect || (stall->live_count == 0 && progress != stall->progress)) {
+        stall->suspect = 1;
+        stall->suspect_ms = now;
+        stall->progress = progress;
+        stall->window_ms = stall_window(manager);
+        return 0;
+    }
+    if (now - stall->suspect_ms < stall->window_ms) {
+        return 0;
+    }
+
+    if (manager->display_enabled) {
+        printf("Simulation stalled. Terminating all systems.\n");
+    }
+    manager_end(manager, END_STALLED);
+    return 1;
+}
+
+/**
+ * Prints why a stalled simulation was ended: every system that could no longer run, and what it was missing.
+ *
+ * Prints nothing unless the simulation ended with END_STALLED.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] stream   Stream to print to.
+ */
+void stall_print(const Manager *manager, FILE *stream) {
+    StallAnalysis analysis;
+    const System *system = NULL;
+    const Resource *resource = NULL;
+
+    if (manager->termination_reason != END_STALLED) {
+        return;
+    }
+
+    fprintf(stream, "Stalled at %lldms after %lld checks: %s\n", manager->end_time_ms, manager->stall.checks,
+            manager->stall.live_count == 0 ? "no system can make progress" : "nothing still running can use up Oxygen or add Distance");
+
+    // Every system was terminated when the run ended, so they are analyzed as they were before that
+    if (!stall_analyze(manager, &analysis, 1)) {
+        return;
+    }
+
+    if (!analysis.can_end && analysis.oxygen >= 0) {
+        resource = manager->resources.items[analysis.oxygen];
+        fprintf(stream, "  %-20s %d/%d, and nothing that could consume it can run\n", resource->name, resource->amount, resource->max_capacity);
+    }
+    if (!analysis.can_end && analysis.distance >= 0) {
+        resource = manager->resources.items[analysis.distance];
+        fprintf(stream, "  %-20s %d/%d, and nothing that could produce it can run\n", resource->name, resource->amount, resource->max_capacity);
+    }
+
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        if (analysis.live[i]) {
+            continue;
+        }
+
+        if (system->amount_stored > 0) {
+            resource = system->produced.resource;
+            fprintf(stream, "  %-20s holds %d %s, which is full (%d/%d) and nothing that could consume it can run\n",
+                    system->name, system->amount_stored, resource->name, resource->amount, resource->max_capacity);
+        } else {
+            resource = system->consumed.resource;
+            fprintf(stream, "  %-20s needs %d %s, has %d, and nothing that could produce it can run\n",
+                    system->name, system->consumed.amount, resource->name, resource->amount);
+        }
+    }
+
+    stall_analysis_clean(&analysis);
+}
+
+/**
+ * Works out which systems are live.
+ *
+ * @param[in]  manager             Pointer to the `Manager`.
+ * @param[out] analysis            Pointer to the `StallAnalysis` to fill in, to be freed with `stall_analysis_clean`.
+ * @param[in]  include_terminated  Non-zero to analyze terminated systems as if they were still running.
+ * @return                         Non-zero if the analysis was done; zero if memory ran out.
+ */
+static int stall_analyze(const Manager *manager, StallAnalysis *analysis, int include_terminated) {
+    int system_count = manager->systems.size, resource_count = manager->resources.size;
+    const System *system = NULL;
+    int i, changed, consumed, produced;
+
+    analysis->indexes = resource_index_build(&manager->resources);
+    analysis->live = (int *)calloc(system_count + 1, sizeof(int));
+    analysis->producers = (int *)calloc(resource_count + 1, sizeof(int));
+    analysis->consumers = (int *)calloc(resource_count + 1, sizeof(int));
+    if (analysis->indexes == NULL || analysis->live == NULL || analysis->producers == NULL || analysis->consumers == NULL) {
+        printf("Failed to allocate memory for stall detection\n");
+        stall_analysis_clean(analysis);
+        return 0;
+    }
+    analysis->oxygen = stall_find_resource(manager, "Oxygen");
+    analysis->distance = stall_find_resource(manager, "Distance");
+
+    // Each pass can only add systems, so this ends after at most one pass per system
+    analysis->live_count = 0;
+    do {
+        changed = 0;
+        for (i = 0; i < system_count; i++) {
+            system = manager->systems.items[i];
+            if (analysis->live[i] || (!include_terminated && (system->status == TERMINATE || system->status == DISABLED))) {
+                continue;
+            }
+            if (!stall_can_run(manager, analysis, system)) {
+                continue;
+            }
+
+            analysis->live[i] = 1;
+            analysis->live_count++;
+            changed = 1;
+            consumed = resource_index_find(analysis->indexes, resource_count, system->consumed.resource);
+            produced = resource_index_find(analysis->indexes, resource_count, system->produced.resource);
+            if (consumed >= 0) {
+                analysis->consumers[consumed]++;
+            }
+            if (produced >= 0) {
+                analysis->producers[produced]++;
+            }
+        }
+    } while (changed);
+
+    // Without either resource the run has no ending to reach, so only running out of live systems counts
+    analysis->can_end = (analysis->oxygen < 0 && analysis->distance < 0) ||
+                        (analysis->oxygen >= 0 && analysis->consumers[analysis->oxygen] > 0) ||
+                        (analysis->distance >= 0 && analysis->producers[analysis->distance] > 0);
+    return 1;
+}
+
+/**
+ * Frees the arrays of a `StallAnalysis`.
+ *
+ * @param[in,out] analysis  Pointer to the `StallAnalysis` to clean.
+ */
+static void stall_analysis_clean(StallAnalysis *analysis) {
+    free(analysis->indexes);
+    free(analysis->live);
+    free(analysis->producers);
+    free(analysis->consumers);
+    analysis->indexes = NULL;
+    analysis->live = NULL;
+    analysis->producers = NULL;
+    analysis->consumers = NULL;
+}
+
+/**
+ * Checks whether a system could run, given the current amounts and the systems found live so far.
+ *
+ * @param[in] manager   Pointer to the `Manager`.
+ * @param[in] analysis  Pointer to the `StallAnalysis` being built.
+ * @param[in] system    Pointer to the `System` to check.
+ * @return              Non-zero if the system could run.
+ */
+static int stall_can_run(const Manager *manager, const StallAnalysis *analysis, const System *system) {
+    const Resource *resource = NULL;
+    int position;
+
+    if (system->amount_stored > 0) {
+        resource = system->produced.resource;
+        position = resource_index_find(analysis->indexes, manager->resources.size, resource);
+        return resource == NULL || __atomic_load_n(&resource->amount, __ATOMIC_RELAXED) < resource->max_capacity ||
+               (position >= 0 && analysis->consumers[position] > 0);
+    }
+
+    resource = system->consumed.resource;
+    position = resource_index_find(analysis->indexes, manager->resources.size, resource);
+    return resource == NULL || __atomic_load_n(&resource->amount, __ATOMIC_RELAXED) >= system->consumed.amount ||
+           (position >= 0 && analysis->producers[position] > 0);
+}
+
+/**
+ * Finds a resource by name.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] name     Name of the resource.
+ * @return             Position of the resource in the manager, or -1 if there is none.
+ */
+static int stall_find_resource(const Manager *manager, const char *name) {
+    for (int i = 0; i < manager->resources.size; i++) {
+        if (strcmp(((Resource *)manager->resources.items[i])->name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Sums the conversions and stores of every system, which only grow while some system makes progress.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @return             The sum.
+ */
+static long long stall_progress(const Manager *manager) {
+    const System *system = NULL;
+    long long progress = 0;
+
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        progress += __atomic_load_n(&system->stats.conversions, __ATOMIC_RELAXED) +
+                    __atomic_load_n(&system->stats.stores, __ATOMIC_RELAXED);
+    }
+
+    return progress;
+}
+
+/**
+ * Works out how long a stall must last before the run is ended.
+ *
+ * A system that has consumed its input only shows what it produced after its processing time, which is
+ * at most twice `processing_time` (running SLOW) times its `time_scale`, so the window is longer than that.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @return             The window in milliseconds.
+ */
+static long long stall_window(const Manager *manager) {
+    long long longest = 0, time;
+    const System *system = NULL;
+
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        time = (long long)(2.0 * system->processing_time * system->time_scale + 0.5);
+        if (time > longest) {
+            longest = time;
+        }
+    }
+
+    return longest + SYSTEM_WAIT_TIME + STALL_CONFIRM_MS;
+}
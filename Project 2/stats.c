@@ -0,0 +1,436 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Helper functions just used by this C file
+static int histogram_index(long long value);
+static long long histogram_bucket_value(int index);
+static void manager_throughput_print(const Manager *manager, FILE *stream);
+static void system_stats_settle(SystemStats *stats);
+
+/**
+ * Returns the current monotonic time in nanoseconds.
+ *
+ * Used for all of the timing statistics, since it never jumps when the wall clock is changed.
+ *
+ * @return  Nanoseconds since an arbitrary fixed point.
+ */
+long long stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Returns the monotonic time in nanoseconds, only as precise as the scheduler tick (a few milliseconds).
+ *
+ * Several times cheaper to read than `stats_now_ns`, so it is what the systems time their statuses and
+ * stalls with on every loop. Consecutive samples charged one after the other add up to the exact total
+ * but for one tick, and a single interval is off by under a tick either way, which is below what the
+ * statistics print.
+ *
+ * @return  Nanoseconds since an arbitrary fixed point, not comparable with `stats_now_ns`.
+ */
+long long stats_coarse_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* SystemStats functions */
+
+/**
+ * Initializes the `SystemStats` of a system.
+ *
+ * @param[out] stats   Pointer to the `SystemStats` to initialize.
+ * @param[in]  status  Current status of the system, used as the first sampled status.
+ */
+void system_stats_init(SystemStats *stats, int status) {
+    memset(stats, 0, sizeof(SystemStats));
+    stats->last_status = status;
+    stats->timed = 1;
+}
+
+/**
+ * Samples the status of a system, charging the time since the status last changed to the previous status.
+ *
+ * Called once per loop of the system, so a status change made by the manager is charged from the
+ * next sample onwards. The clock is only read when the status changed, so a loop in the same status
+ * costs a comparison; the time in the current status is added when the statistics are printed. Does
+ * nothing while the timing statistics are off.
+ *
+ * @param[in,out] stats   Pointer to the `SystemStats` to update.
+ * @param[in]     status  Current status of the system.
+ */
+void system_stats_sample(SystemStats *stats, int status) {
+    if (!stats->timed || (stats->last_sample_ns != 0 && status == stats->last_status)) {
+        return;
+    }
+
+    if (stats->last_sample_ns == 0) {
+        stats->last_sample_ns = stats_coarse_ns();
+    } else {
+        system_stats_settle(stats);
+    }
+    stats->last_status = status;
+}
+
+/**
+ * Charges the time since the status last changed to the current status, bringing `status_ns` up to date.
+ *
+ * @param[in,out] stats  Pointer to the `SystemStats` to update.
+ */
+static void system_stats_settle(SystemStats *stats) {
+    long long now;
+
+    if (!stats->timed || stats->last_sample_ns == 0) {
+        return;
+    }
+
+    now = stats_coarse_ns();
+    if (stats->last_status >= 0 && stats->last_status < SYSTEM_STATUS_COUNT) {
+        stats->status_ns[stats->last_status] += now - stats->last_sample_ns;
+    }
+    stats->last_sample_ns = now;
+}
+
+/**
+ * Adds the counters of one `SystemStats` into a running total.
+ *
+ * @param[in,out] total  Pointer to the `SystemStats` accumulating the totals.
+ * @param[in]     stats  Pointer to the `SystemStats` to add.
+ */
+void system_stats_merge(SystemStats *total, const SystemStats *stats) {
+    int i;
+
+    total->conversions += stats->conversions;
+    total->stores += stats->stores;
+    total->consumed_total += stats->consumed_total;
+    total->produced_total += stats->produced_total;
+    for (i = 0; i < STALL_STATUS_COUNT; i++) {
+        total->stalls[i] += stats->stalls[i];
+        total->stall_ns[i] += stats->stall_ns[i];
+    }
+    for (i = 0; i < SYSTEM_STATUS_COUNT; i++) {
+        total->status_ns[i] += stats->status_ns[i];
+    }
+}
+
+/**
+ * Turns the timing statistics of a simulation on or off.
+ *
+ * The timing statistics are the time each system spends in each status and stalled, and the latency and
+ * block time histograms of the event queues; they cost a clock read per system loop and per event. The
+ * counters (conversions, stores, stalls, events popped) are kept either way, since the shards, the stall
+ * detector and the exported state rely on them, and each is a plain increment by the thread that owns it.
+ * Systems added later, and the queues of manager workers started later, follow the setting.
+ *
+ * Call before the simulation starts, or the times recorded so far are left as they are.
+ *
+ * @param[in,out] manager  Pointer to the `Manager`.
+ * @param[in]     enabled  Non-zero to record the timing statistics (the default), zero to skip them.
+ */
+void manager_set_stats_timing(Manager *manager, int enabled) {
+    manager->stats_timed = enabled != 0;
+    manager->event_queue.histograms = manager->stats_timed;
+    for (int i = 0; i < manager->systems.size; i++) {
+        ((System *)manager->systems.items[i])->stats.timed = manager->stats_timed;
+    }
+}
+
+/* LatencyHistogram functions */
+
+/**
+ * Initializes a `LatencyHistogram` to be empty.
+ *
+ * @param[out] histogram  Pointer to the `LatencyHistogram` to initialize.
+ */
+void histogram_init(LatencyHistogram *histogram) {
+    memset(histogram, 0, sizeof(LatencyHistogram));
+    histogram->min = -1;
+}
+
+/**
+ * Records a single value into the histogram.
+ *
+ * Negative values (e.g. from an event that was never timestamped) are recorded as zero.
+ *
+ * @param[in,out] histogram  Pointer to the `LatencyHistogram`.
+ * @param[in]     value      Value to record, in nanoseconds.
+ */
+void histogram_record(LatencyHistogram *histogram, long long value) {
+    if (value < 0) {
+        value = 0;
+    }
+
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+
+    if (histogram->min < 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/**
+ * Adds every value of one histogram into another.
+ *
+ * @param[in,out] total      Pointer to the `LatencyHistogram` accumulating the values.
+ * @param[in]     histogram  Pointer to the `LatencyHistogram` to add.
+ */
+void histogram_merge(LatencyHistogram *total, const LatencyHistogram *histogram) {
+    if (histogram->total == 0) {
+        return;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total->counts[i] += histogram->counts[i];
+    }
+    total->total += histogram->total;
+    total->sum += histogram->sum;
+
+    if (total->min < 0 || histogram->min < total->min) {
+        total->min = histogram->min;
+    }
+    if (histogram->max > total->max) {
+        total->max = histogram->max;
+    }
+}
+
+/**
+ * Returns the value at the given percentile.
+ *
+ * The result is the lower bound of the bucket holding the percentile, clamped to the recorded min/max.
+ *
+ * @param[in] histogram   Pointer to the `LatencyHistogram`.
+ * @param[in] percentile  Percentile to look up, from 0 to 100.
+ * @return                The value at the percentile, or 0 if the histogram is empty.
+ */
+long long histogram_percentile(const LatencyHistogram *histogram, double percentile) {
+    long long target, seen = 0, value;
+
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    target = (long long)(histogram->total * (percentile / 100.0));
+    if (target < 1) {
+        target = 1;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target) {
+            value = histogram_bucket_value(i);
+            if (value < histogram->min) {
+                value = histogram->min;
+            }
+            return value > histogram->max ? histogram->max : value;
+        }
+    }
+
+    return histogram->max;
+}
+
+/**
+ * Prints a one line summary of a histogram in microseconds.
+ *
+ * @param[in] stream     Stream to print to.
+ * @param[in] label      Label printed in front of the summary.
+ * @param[in] histogram  Pointer to the `LatencyHistogram` to print.
+ */
+void histogram_print(FILE *stream, const char *label, const LatencyHistogram *histogram) {
+    if (histogram->total == 0) {
+        fprintf(stream, "%-20s: no samples\n", label);
+        return;
+    }
+
+    fprintf(stream, "%-20s: n=%lld mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+            label,
+            histogram->total,
+            histogram->sum / (double)histogram->total / 1000.0,
+            histogram_percentile(histogram, 50.0) / 1000.0,
+            histogram_percentile(histogram, 90.0) / 1000.0,
+            histogram_percentile(histogram, 99.0) / 1000.0,
+            histogram_percentile(histogram, 99.9) / 1000.0,
+            histogram->max / 1000.0);
+}
+
+/**
+ * Prints the statistics for every system, their totals, and the event queue latency.
+ *
+ * Safe to call at any point while the simulation runs; the counters are read as they are.
+ *
+ * @param[in] manager  Pointer to the `Manager` containing the simulation state.
+ * @param[in] stream   Stream to print to.
+ */
+void manager_stats_print(Manager *manager, FILE *stream) {
+    SystemStats total, stats;
+    System *system = NULL;
+    int i, j;
+
+    system_stats_init(&total, STANDARD);
+
+    fprintf(stream, "System Statistics:\n");
+    fprintf(stream, "------------------\n");
+    fprintf(stream, "%-20s %10s %10s %8s %8s %8s %10s %10s %10s\n",
+            "System", "Converts", "Stores", "Empty", "Insuff", "Capacity", "Stall(ms)", "Slow(ms)", "Fast(ms)");
+
+    for (i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        // A copy, charged the time in its current status, since the system's own is only charged when the status changes
+        stats = system->stats;
+        system_stats_settle(&stats);
+
+        fprintf(stream, "%-20s %10lld %10lld %8lld %8lld %8lld %10.1f %10.1f %10.1f\n",
+                system->name,
+                stats.conversions,
+                stats.stores,
+                stats.stalls[STATUS_EMPTY],
+                stats.stalls[STATUS_INSUFFICIENT],
+                stats.stalls[STATUS_CAPACITY],
+                (stats.stall_ns[STATUS_EMPTY] + stats.stall_ns[STATUS_INSUFFICIENT] + stats.stall_ns[STATUS_CAPACITY]) / 1e6,
+                stats.status_ns[SLOW] / 1e6,
+                stats.status_ns[FAST] / 1e6);
+
+        system_stats_merge(&total, &stats);
+    }
+
+    fprintf(stream, "%-20s %10lld %10lld %8lld %8lld %8lld\n", "Total",
+            total.conversions, total.stores,
+            total.stalls[STATUS_EMPTY], total.stalls[STATUS_INSUFFICIENT], total.stalls[STATUS_CAPACITY]);
+
+    if (manager->stats_timed) {
+        fprintf(stream, "Time in status:");
+        for (j = 0; j < SYSTEM_STATUS_COUNT; j++) {
+            fprintf(stream, " %s=%.1fms", stats_status_name(j), total.status_ns[j] / 1e6);
+        }
+        fprintf(stream, "\n");
+    } else {
+        fprintf(stream, "Timing statistics off (--no-stats): no stall, status or latency times recorded\n");
+    }
+    manager_throughput_print(manager, stream);
+    fprintf(stream, "\n");
+
+    if (manager->stats_timed) {
+        histogram_print(stream, "Event queue latency", &manager->event_queue.latency);
+        histogram_print(stream, "  HIGH priority", &manager->event_queue.priority_latency[PRIORITY_HIGH]);
+        histogram_print(stream, "  MED priority", &manager->event_queue.priority_latency[PRIORITY_MED]);
+        histogram_print(stream, "  LOW priority", &manager->event_queue.priority_latency[PRIORITY_LOW]);
+    } else {
+        fprintf(stream, "Events popped: %lld\n", manager->event_queue.latency.total);
+    }
+    fprintf(stream, "Events promoted by age or deadline: %lld\n", manager->event_queue.promoted);
+    if (manager->event_queue.capacity == 0) {
+        fprintf(stream, "Event queue depth: max %d (unbounded)\n", manager->event_queue.max_size);
+    } else {
+        fprintf(stream, "Event queue depth: max %d of %d (%s), dropped %lld, merged %lld, overflowed %lld\n",
+                manager->event_queue.max_size, manager->event_queue.capacity,
+                event_queue_policy_name(manager->event_queue.overflow_policy),
+                manager->event_queue.dropped, manager->event_queue.merged, manager->event_queue.overflowed);
+    }
+    if (manager->stats_timed) {
+        histogram_print(stream, "Producer block time", &manager->event_queue.block_time);
+    }
+    lookahead_print(&manager->lookahead, stream);
+    placement_print(manager, stream);
+    control_print(manager, stream);
+    dispatch_print(manager, stream);
+    stall_print(manager, stream);
+    if (manager->stale_events > 0) {
+        fprintf(stream, "Stale events dropped: %lld\n", manager->stale_events);
+    }
+}
+
+/**
+ * Maps a value to its bucket in the histogram.
+ *
+ * @param[in] value  Non-negative value to map.
+ * @return           Index of the bucket holding `value`.
+ */
+static int histogram_index(long long value) {
+    int magnitude, sub;
+
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (int)value;
+    }
+
+    magnitude = 63 - __builtin_clzll((unsigned long long)value);
+    sub = (int)((value >> (magnitude - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+
+    return (magnitude - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+/**
+ * Returns the smallest value that maps to a bucket.
+ *
+ * @param[in] index  Index of the bucket.
+ * @return           Lower bound of the bucket.
+ */
+static long long histogram_bucket_value(int index) {
+    int magnitude, sub;
+
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+
+    magnitude = index / HISTOGRAM_SUB_COUNT - 1 + HISTOGRAM_SUB_BITS;
+    sub = index % HISTOGRAM_SUB_COUNT;
+
+    return (long long)(HISTOGRAM_SUB_COUNT | sub) << (magnitude - HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * Returns a short name for a system status.
+ *
+ * @param[in] status  Status code (TERMINATE..FAST).
+ * @return            Name of the status.
+ */
+const char *stats_status_name(int status) {
+    switch (status) {
+        case TERMINATE:
+            return "TERMINATE";
+        case DISABLED:
+            return "DISABLED";
+        case SLOW:
+            return "SLOW";
+        case STANDARD:
+            return "STANDARD";
+        case FAST:
+            return "FAST";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+/**
+ * Prints how fast the simulation went: Distance covered per wall-clock second, and events the manager
+ * handled per simulated minute.
+ *
+ * The first is what a faster run is after; the second is how much reacting it took to get there.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] stream   Stream to print to.
+ */
+static void manager_throughput_print(const Manager *manager, FILE *stream) {
+    const Resource *resource = NULL;
+    double wall_s = (stats_now_ns() - manager->clock.start_ns) / 1e9;
+    double simulated_min = (manager->end_time_ms > 0 ? manager->end_time_ms : clock_now_ms(&manager->clock)) / 60000.0;
+    int distance = 0;
+
+    for (int i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        if (strcmp(resource->name, "Distance") == 0) {
+            distance = resource->amount;
+        }
+    }
+
+    fprintf(stream, "Throughput: %.1f Distance per wall second, %.1f events per simulated minute\n",
+            wall_s > 0 ? distance / wall_s : 0.0,
+            simulated_min > 0 ? manager->event_queue.latency.total / simulated_min : 0.0);
+}
@@ -0,0 +1,561 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Outcome of a single run of the sweep
+typedef struct SweepResult {
+    double values[SWEEP_MAX_AXES];  // Value of every axis in this run
+    int loaded;                     // non-zero once the scenario was loaded and changed for the run
+    int termination_reason;
+    long long end_time_ms;
+    int min_oxygen;                 // -1 if the scenario has no Oxygen
+    int distance;                   // -1 if the scenario has no Distance
+} SweepResult;
+
+// State shared by the sweep's worker threads
+typedef struct SweepJob {
+    const SweepConfig *config;
+    SweepResult *results;
+    int run_count;
+    int next_run;       // Index of the next run to claim, updated atomically
+} SweepJob;
+
+// Helper functions just used by this C file
+static void *sweep_worker(void *arg);
+static void sweep_simulate(const SweepConfig *config, int run, SweepResult *result);
+static int sweep_load(const SweepConfig *config, Manager *manager);
+static int sweep_apply(Manager *manager, const SweepAxis *axis, double value);
+static void sweep_default_axes(SweepConfig *config, Manager *manager);
+static void sweep_axis_set(SweepAxis *axis, int kind, const char *target, int count, const double *values);
+static int sweep_parse_values(const char *text, SweepAxis *axis);
+static void sweep_print_axis(const SweepAxis *axis, FILE *stream);
+static Resource *sweep_find_resource(Manager *manager, const char *name);
+static System *sweep_find_system(Manager *manager, const char *name);
+
+/**
+ * Initializes a `SweepConfig` with no axes (so the default grid), one thread per core and no scenario.
+ *
+ * @param[out] config  Pointer to the `SweepConfig` to initialize.
+ */
+void sweep_config_init(SweepConfig *config) {
+    config->axis_count = 0;
+    config->thread_count = 0;
+    config->time_limit_ms = 10 * 60 * 1000;
+    config->scenario = NULL;
+    config->scenario_length = 0;
+}
+
+/**
+ * Adds an axis to a `SweepConfig`, or sets its time limit, from a `name=value` option, as given to `--sweep`.
+ *
+ * Values are either a comma separated list (`30,50,70`) or an inclusive range with a step (`30:90:20`).
+ *
+ *     capacity=<resource>:<values>          max_capacity of a resource
+ *     time=<system>:<values>                processing_time of a system, in ms (at least 1)
+ *     scale=<values>                        Multiplier applied to every system's processing time (above 0)
+ *     low=<values>                          Fraction of capacity below which resources are low (0 to 1)
+ *     limit=<seconds>                       Simulated time after which a run is stopped as a timeout
+ *
+ * Resource and system names run up to the first ':', so `capacity=Resource 3:10:50:10` sweeps the
+ * capacity of "Resource 3" from 10 to 50. Whether the names exist is checked by `sweep_run`.
+ *
+ * @param[in,out] config  Pointer to the `SweepConfig` to change.
+ * @param[in]     option  The option.
+ * @return                Non-zero if the option was recognised and valid; zero otherwise, leaving `config` unchanged.
+ */
+int sweep_config_set(SweepConfig *config, const char *option) {
+    const char *value = strchr(option, '=');
+    const char *separator;
+    SweepAxis axis;
+    size_t length;
+    char *end;
+    double seconds, low = 0, high = 0;
+    int i;
+
+    if (value == NULL) {
+        return 0;
+    }
+    length = value - option;
+    value++;
+
+    if (strncmp(option, "limit", length) == 0 && length == 5) {
+        seconds = strtod(value, &end);
+        if (end == value || *end != '\0' || !(seconds >= 0.001 && seconds <= 1e9)) {
+            return 0;
+        }
+        config->time_limit_ms = (long long)(seconds * 1000);
+        return 1;
+    }
+
+    if (config->axis_count >= SWEEP_MAX_AXES) {
+        return 0;
+    }
+    axis.target[0] = '\0';
+
+    if ((strncmp(option, "capacity", length) == 0 && length == 8) || (strncmp(option, "time", length) == 0 && length == 4)) {
+        axis.kind = length == 8 ? SWEEP_AXIS_CAPACITY : SWEEP_AXIS_TIME;
+        separator = strchr(value, ':');
+        if (separator == NULL || separator == value || separator - value >= SWEEP_NAME_LENGTH) {
+            return 0;
+        }
+        memcpy(axis.target, value, separator - value);
+        axis.target[separator - value] = '\0';
+        value = separator + 1;
+        low = 1;
+        high = 1e9;
+    } else if (strncmp(option, "scale", length) == 0 && length == 5) {
+        axis.kind = SWEEP_AXIS_SCALE;
+        low = 1e-6;
+        high = 1e6;
+    } else if (strncmp(option, "low", length) == 0 && length == 3) {
+        axis.kind = SWEEP_AXIS_LOW;
+        low = 0;
+        high = 1;
+    } else {
+        return 0;
+    }
+
+    if (!sweep_parse_values(value, &axis)) {
+        return 0;
+    }
+    for (i = 0; i < axis.count; i++) {
+        if (!(axis.values[i] >= low && axis.values[i] <= high)) {
+            return 0;
+        }
+    }
+
+    config->axes[config->axis_count++] = axis;
+    return 1;
+}
+
+/**
+ * Runs every combination of the sweep's axes and prints a table of the outcomes.
+ *
+ * Each run is an isolated `Manager` loading `config->scenario`, changed by one value of every axis and
+ * simulated in virtual time, so the runs are spread over worker threads with no shared state besides the
+ * results table. With no axes the default grid is run: the capacity of Fuel (500 to 1500), Oxygen (30 to
+ * 90) and Energy (30 to 70) where the scenario has them, every processing time scaled by 0.5, 1 and 2, and
+ * the low threshold from 0.1 to 0.4.
+ *
+ * @param[in] config  Pointer to the `SweepConfig` to run.
+ * @param[in] stream  Stream to print the results table to.
+ * @return            Non-zero if every run completed; zero otherwise.
+ */
+int sweep_run(const SweepConfig *config, FILE *stream) {
+    SweepConfig grid = *config;
+    SweepJob job;
+    Manager base;
+    pthread_t *threads;
+    int thread_count = config->thread_count;
+    int i, j, started = 0, failed = 0;
+    long long run_count = 1, start_ns, elapsed_ns;
+
+    // Every run loads the same scenario, so the axes' names are checked once against it
+    manager_init(&base);
+    base.display_enabled = 0;
+    if (!sweep_load(config, &base)) {
+        manager_clean(&base);
+        return 0;
+    }
+    if (grid.axis_count == 0) {
+        sweep_default_axes(&grid, &base);
+    }
+    for (i = 0; i < grid.axis_count; i++) {
+        if (grid.axes[i].kind == SWEEP_AXIS_CAPACITY && sweep_find_resource(&base, grid.axes[i].target) == NULL) {
+            printf("No resource named %s in the scenario to sweep\n", grid.axes[i].target);
+            failed = 1;
+        } else if (grid.axes[i].kind == SWEEP_AXIS_TIME && sweep_find_system(&base, grid.axes[i].target) == NULL) {
+            printf("No system named %s in the scenario to sweep\n", grid.axes[i].target);
+            failed = 1;
+        }
+        run_count *= grid.axes[i].count;
+        if (run_count > SWEEP_MAX_RUNS) {
+            printf("A sweep can run at most %d combinations\n", SWEEP_MAX_RUNS);
+            failed = 1;
+            break;
+        }
+    }
+    manager_clean(&base);
+    if (failed) {
+        return 0;
+    }
+
+    job.config = &grid;
+    job.next_run = 0;
+    job.run_count = (int)run_count;
+
+    if (thread_count <= 0) {
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_count > job.run_count) {
+        thread_count = job.run_count;
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    job.results = (SweepResult *)calloc(job.run_count + 1, sizeof(SweepResult));
+    threads = (pthread_t *)malloc(thread_count * sizeof(pthread_t));
+    if (job.results == NULL || threads == NULL) {
+        printf("Failed to allocate memory for sweep\n");
+        free(job.results);
+        free(threads);
+        return 0;
+    }
+
+    start_ns = stats_now_ns();
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, sweep_worker, &job) != 0) {
+            printf("Failed to start sweep thread\n");
+            break;
+        }
+        started++;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed_ns = stats_now_ns() - start_ns;
+
+    for (j = 0; j < grid.axis_count; j++) {
+        sweep_print_axis(&grid.axes[j], stream);
+    }
+    fprintf(stream, "result,end_time_ms,min_oxygen,distance\n");
+    for (i = 0; i < job.run_count; i++) {
+        const SweepResult *result = &job.results[i];
+        for (j = 0; j < grid.axis_count; j++) {
+            fprintf(stream, "%g,", result->values[j]);
+        }
+        if (!result->loaded) {
+            fprintf(stream, "failed,,,\n");
+            failed++;
+            continue;
+        }
+        fprintf(stream, "%s,%lld,", manager_termination_name(result->termination_reason), result->end_time_ms);
+        if (result->min_oxygen >= 0) {
+            fprintf(stream, "%d", result->min_oxygen);
+        }
+        fprintf(stream, ",");
+        if (result->distance >= 0) {
+            fprintf(stream, "%d", result->distance);
+        }
+        fprintf(stream, "\n");
+    }
+    fprintf(stream, "# %d runs on %d threads in %.2fs (%.1f runs/s)\n", job.run_count, started,
+            elapsed_ns / 1e9, job.run_count / (elapsed_ns / 1e9));
+
+    free(threads);
+    free(job.results);
+    return started > 0 && failed == 0;
+}
+
+/**
+ * Claims runs from the job until there are none left.
+ *
+ * @param[in,out] arg  Pointer to the shared `SweepJob`.
+ * @return             Always NULL.
+ */
+static void *sweep_worker(void *arg) {
+    SweepJob *job = (SweepJob *)arg;
+    int run;
+
+    while ((run = __atomic_fetch_add(&job->next_run, 1, __ATOMIC_RELAXED)) < job->run_count) {
+        sweep_simulate(job->config, run, &job->results[run]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Simulates one combination of the sweep's axes to completion.
+ *
+ * The run index is read as a mixed-radix number, one digit per axis, the first axis changing fastest.
+ *
+ * @param[in]  config  Pointer to the `SweepConfig`.
+ * @param[in]  run     Index of the combination to simulate.
+ * @param[out] result  Pointer to the `SweepResult` to fill in.
+ */
+static void sweep_simulate(const SweepConfig *config, int run, SweepResult *result) {
+    Manager manager;
+    Resource *oxygen, *distance;
+    int i, remaining = run;
+
+    manager_init(&manager);
+    manager.display_enabled = 0;
+    result->loaded = 0;
+
+    for (i = 0; i < config->axis_count; i++) {
+        result->values[i] = config->axes[i].values[remaining % config->axes[i].count];
+        remaining /= config->axes[i].count;
+        // Taken by every resource as it is added, so it has to be set before loading
+        if (config->axes[i].kind == SWEEP_AXIS_LOW) {
+            manager.threshold_low = result->values[i];
+        }
+    }
+
+    if (!sweep_load(config, &manager)) {
+        manager_clean(&manager);
+        return;
+    }
+    for (i = 0; i < config->axis_count; i++) {
+        if (!sweep_apply(&manager, &config->axes[i], result->values[i])) {
+            manager_clean(&manager);
+            return;
+        }
+    }
+    // The watermarks are fractions of the old capacities until they are set again
+    for (i = 0; i < manager.resources.size; i++) {
+        resource_set_watermarks(manager.resources.items[i], manager.threshold_low, THRESHOLD_RESOURCE_HIGH, THRESHOLD_HYSTERESIS);
+    }
+    result->loaded = 1;
+
+    oxygen = sweep_find_resource(&manager, "Oxygen");
+    distance = sweep_find_resource(&manager, "Distance");
+    manager_set_virtual_time(&manager);
+    result->min_oxygen = oxygen != NULL ? oxygen->amount : -1;
+
+    while (manager.simulation_running) {
+        manager_run(&manager);
+        if (manager_run_systems(&manager) == 0) {
+            clock_sleep_ms(&manager.clock, MANAGER_WAIT_TIME);
+        }
+
+        if (oxygen != NULL && oxygen->amount < result->min_oxygen) {
+            result->min_oxygen = oxygen->amount;
+        }
+
+        if (manager.simulation_running && clock_now_ms(&manager.clock) >= config->time_limit_ms) {
+            manager.simulation_running = 0;
+            manager.termination_reason = END_TIMEOUT;
+            manager.end_time_ms = clock_now_ms(&manager.clock);
+        }
+    }
+
+    result->termination_reason = manager.termination_reason;
+    result->end_time_ms = manager.end_time_ms;
+    result->distance = distance != NULL ? distance->amount : -1;
+
+    manager_clean(&manager);
+}
+
+/**
+ * Loads the sweep's scenario into a `Manager`.
+ *
+ * @param[in]     config   Pointer to the `SweepConfig` holding the scenario.
+ * @param[in,out] manager  Pointer to the `Manager` to load the scenario into.
+ * @return                 Non-zero if the scenario was loaded; zero otherwise.
+ */
+static int sweep_load(const SweepConfig *config, Manager *manager) {
+    FILE *stream;
+    int loaded;
+
+    if (config->scenario == NULL || config->scenario_length == 0) {
+        printf("The sweep has no scenario to run\n");
+        return 0;
+    }
+
+    stream = fmemopen((void *)config->scenario, config->scenario_length, "r");
+    if (stream == NULL) {
+        printf("Failed to read the sweep's scenario\n");
+        return 0;
+    }
+    loaded = scenario_load(manager, stream);
+    fclose(stream);
+    return loaded;
+}
+
+/**
+ * Changes a loaded scenario by the value of one axis.
+ *
+ * A resource that starts full stays full at its new capacity; any other keeps its starting amount if it
+ * still fits. Scaled processing times are kept at 1ms or more.
+ *
+ * @param[in,out] manager  Pointer to the `Manager` holding the loaded scenario.
+ * @param[in]     axis     Pointer to the `SweepAxis`.
+ * @param[in]     value    Value of the axis for this run.
+ * @return                 Non-zero if the change was made; zero if the axis' resource or system is missing.
+ */
+static int sweep_apply(Manager *manager, const SweepAxis *axis, double value) {
+    Resource *resource = NULL;
+    System *system = NULL;
+    int full;
+
+    switch (axis->kind) {
+        case SWEEP_AXIS_CAPACITY:
+            resource = sweep_find_resource(manager, axis->target);
+            if (resource == NULL) {
+                return 0;
+            }
+            full = resource->amount == resource->max_capacity;
+            resource->max_capacity = (int)value;
+            if (full || resource->amount > resource->max_capacity) {
+                resource->amount = resource->max_capacity;
+            }
+            return 1;
+        case SWEEP_AXIS_TIME:
+            system = sweep_find_system(manager, axis->target);
+            if (system == NULL) {
+                return 0;
+            }
+            system->processing_time = (int)value;
+            return 1;
+        case SWEEP_AXIS_SCALE:
+            for (int i = 0; i < manager->systems.size; i++) {
+                system = manager->systems.items[i];
+                system->processing_time = (int)(system->processing_time * value);
+                if (system->processing_time < 1) {
+                    system->processing_time = 1;
+                }
+            }
+            return 1;
+        default:
+            // SWEEP_AXIS_LOW is set on the manager before loading
+            return 1;
+    }
+}
+
+/**
+ * Fills in the default grid: the sample rocket's tanks that the scenario has, speeds and thresholds.
+ *
+ * @param[in,out] config   Pointer to the `SweepConfig` with no axes.
+ * @param[in]     manager  Pointer to a `Manager` holding the loaded scenario.
+ */
+static void sweep_default_axes(SweepConfig *config, Manager *manager) {
+    static const double fuel[] = {500, 750, 1000, 1250, 1500};
+    static const double oxygen[] = {30, 50, 70, 90};
+    static const double energy[] = {30, 50, 70};
+    static const double scale[] = {0.5, 1.0, 2.0};
+    static const double threshold[] = {0.1, 0.2, 0.3, 0.4};
+
+    if (sweep_find_resource(manager, "Fuel") != NULL) {
+        sweep_axis_set(&config->axes[config->axis_count++], SWEEP_AXIS_CAPACITY, "Fuel", 5, fuel);
+    }
+    if (sweep_find_resource(manager, "Oxygen") != NULL) {
+        sweep_axis_set(&config->axes[config->axis_count++], SWEEP_AXIS_CAPACITY, "Oxygen", 4, oxygen);
+    }
+    if (sweep_find_resource(manager, "Energy") != NULL) {
+        sweep_axis_set(&config->axes[config->axis_count++], SWEEP_AXIS_CAPACITY, "Energy", 3, energy);
+    }
+    sweep_axis_set(&config->axes[config->axis_count++], SWEEP_AXIS_SCALE, "", 3, scale);
+    sweep_axis_set(&config->axes[config->axis_count++], SWEEP_AXIS_LOW, "", 4, threshold);
+}
+
+/**
+ * Fills in a `SweepAxis` from an array of values.
+ *
+ * @param[out] axis    Pointer to the `SweepAxis` to fill in.
+ * @param[in]  kind    SWEEP_AXIS_* the axis changes.
+ * @param[in]  target  Resource or system the axis changes, "" for none.
+ * @param[in]  count   Number of values, at most SWEEP_MAX_VALUES.
+ * @param[in]  values  Values to copy.
+ */
+static void sweep_axis_set(SweepAxis *axis, int kind, const char *target, int count, const double *values) {
+    axis->kind = kind;
+    snprintf(axis->target, sizeof(axis->target), "%s", target);
+    axis->count = count < SWEEP_MAX_VALUES ? count : SWEEP_MAX_VALUES;
+    memcpy(axis->values, values, axis->count * sizeof(double));
+}
+
+/**
+ * Parses the values of an axis, a comma separated list or a `<min>:<max>:<step>` range.
+ *
+ * @param[in]  text  Text to parse.
+ * @param[out] axis  Pointer to the `SweepAxis` whose `values` and `count` are set.
+ * @return           Non-zero if `text` held 1 to SWEEP_MAX_VALUES values; zero otherwise.
+ */
+static int sweep_parse_values(const char *text, SweepAxis *axis) {
+    double low, high, step;
+    char *end;
+    int consumed = 0;
+
+    if (strchr(text, ':') != NULL) {
+        if (sscanf(text, "%lf:%lf:%lf%n", &low, &high, &step, &consumed) != 3 || text[consumed] != '\0' ||
+            !(step > 0) || !(high >= low) || (high - low) / step >= SWEEP_MAX_VALUES) {
+            return 0;
+        }
+        // A little slack, so a step that doesn't add up exactly in binary still reaches `high`
+        for (axis->count = 0; axis->count < SWEEP_MAX_VALUES && low + axis->count * step <= high + step * 1e-9; axis->count++) {
+            axis->values[axis->count] = low + axis->count * step;
+        }
+        return 1;
+    }
+
+    axis->count = 0;
+    while (axis->count < SWEEP_MAX_VALUES) {
+        axis->values[axis->count++] = strtod(text, &end);
+        if (end == text || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+        if (*end == '\0') {
+            return 1;
+        }
+        text = end + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the column heading of an axis in the results table.
+ *
+ * @param[in] axis    Pointer to the `SweepAxis`.
+ * @param[in] stream  Stream to print to.
+ */
+static void sweep_print_axis(const SweepAxis *axis, FILE *stream) {
+    switch (axis->kind) {
+        case SWEEP_AXIS_CAPACITY:
+            fprintf(stream, "%s capacity,", axis->target);
+            break;
+        case SWEEP_AXIS_TIME:
+            fprintf(stream, "%s processing_time,", axis->target);
+            break;
+        case SWEEP_AXIS_SCALE:
+            fprintf(stream, "processing_scale,");
+            break;
+        default:
+            fprintf(stream, "threshold_low,");
+            break;
+    }
+}
+
+/**
+ * Finds a resource of the `Manager` by name.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] name     Name of the resource.
+ * @return             The resource, or NULL if there is none with that name.
+ */
+static Resource *sweep_find_resource(Manager *manager, const char *name) {
+    Resource *resource = NULL;
+
+    for (int i = 0; i < manager->resources.size; i++) {
+        resource = manager->resources.items[i];
+        if (strcmp(resource->name, name) == 0) {
+            return resource;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds a system of the `Manager` by name.
+ *
+ * @param[in] manager  Pointer to the `Manager`.
+ * @param[in] name     Name of the system.
+ * @return             The system, or NULL if there is none with that name.
+ */
+static System *sweep_find_system(Manager *manager, const char *name) {
+    System *system = NULL;
+
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        if (strcmp(system->name, name) == 0) {
+            return system;
+        }
+    }
+
+    return NULL;
+}
@@ -10,6 +10,9 @@
 static int system_convert(System *);
 static void system_simulate_process_time(System *);
 static int system_store_resources(System *);
+static void system_stall(System *system, int status, Resource *resource, int kind, int threshold);
+static void system_report_watermark(System *system, Resource *resource, int crossing);
+static void system_push_event(System *system, const Event *event);
 
 /**
  * Creates a new `System` object.
@@ -30,8 +33,8 @@ void system_create(System **system, const char *name, ResourceAmount consumed, R
         return;
     }
     
-    //Allocate memory for the resource
-    *system = (System *)malloc(sizeof(System));
+    //Allocate memory for the system, on a cache line of its own
+    *system = (System *)aligned_alloc(CACHE_LINE_SIZE, sizeof(System));
     if(*system == NULL){
         printf("Failed to allocate memory for system");
         return;
@@ -51,8 +54,24 @@ void system_create(System **system, const char *name, ResourceAmount consumed, R
     (*system)->produced = produced;
     (*system)->processing_time = processing_time;
     (*system)->event_queue = event_queue;
+    (*system)->dispatcher = NULL;
+    (*system)->handle.index = 0;
+    (*system)->handle.generation = 0;
+    (*system)->clock = NULL;
     (*system)->status = STANDARD;
     (*system)->amount_stored = 0;
+    system_stats_init(&(*system)->stats, (*system)->status);
+    (*system)->threaded = 0;
+    (*system)->waiting = 0;
+    (*system)->waiting_on = NULL;
+    (*system)->stall_status = STATUS_OK;
+    (*system)->stall_start_ns = 0;
+    (*system)->cluster = -1;
+    (*system)->cpu_first = 0;
+    (*system)->cpu_count = 0;
+    (*system)->trace = NULL;
+    (*system)->time_scale = 1.0;
+    sem_init(&(*system)->wakeup, 0, 0);
 }
 
 /**
@@ -64,6 +83,7 @@ void system_create(System **system, const char *name, ResourceAmount consumed, R
  */
 void system_destroy(System *system) {
     if(system != NULL){
+        sem_destroy(&system->wakeup);
         free(system->name);
         free(system);
         system = NULL;
@@ -82,7 +102,23 @@ void system_destroy(System *system) {
  */
 void system_run(System *system) {
     Event event;
-    int result_status;
+    Resource *stalled_on = NULL;
+    int result_status, space_needed;
+
+    // Charge the time in the previous status to it, if the manager changed the status since the previous loop
+    system_stats_sample(&system->stats, system->status);
+
+    // A stall is over once the system gets to run again
+    if (system->stall_start_ns != 0) {
+        if (system->trace != NULL) {
+            system->stats.stall_ns[system->stall_status] += stats_now_ns() - system->stall_start_ns;
+            stalled_on = system->stall_status == STATUS_CAPACITY ? system->produced.resource : system->consumed.resource;
+            trace_span(system->trace, TRACE_STALL, system->stall_start_ns, system->stall_status, 0, stalled_on->handle);
+        } else {
+            system->stats.stall_ns[system->stall_status] += stats_coarse_ns() - system->stall_start_ns;
+        }
+        system->stall_start_ns = 0;
+    }
     
     if (system->amount_stored == 0) {
         // Need to convert resources (consume and process)
@@ -91,9 +127,14 @@ void system_run(System *system) {
         if (result_status != STATUS_OK) {
             // Report that resources were out / insufficient
             event_init(&event, system, system->consumed.resource, result_status, PRIORITY_HIGH, system->consumed.resource->amount);
-            event_queue_push(system->event_queue, &event);    
-            // Sleep to prevent looping too frequently and spamming with events
-            usleep(SYSTEM_WAIT_TIME * 1000);          
+            system_push_event(system, &event);
+            if (system->trace != NULL) {
+                trace_instant(system->trace, TRACE_PUSH, result_status, PRIORITY_HIGH, event.resource);
+            }
+            // Wait until enough is available rather than looping and spamming with events
+            system_stall(system, result_status, system->consumed.resource, WAIT_AVAILABLE, system->consumed.amount);
+        } else {
+            system->stats.conversions++;
         }
     }
 
@@ -103,10 +144,97 @@ void system_run(System *system) {
 
         if (result_status != STATUS_OK) {
             event_init(&event, system, system->produced.resource, result_status, PRIORITY_LOW, system->produced.resource->amount);
-            event_queue_push(system->event_queue, &event);
-            // Sleep to prevent looping too frequently and spamming with events
-            usleep(SYSTEM_WAIT_TIME * 1000);
+            system_push_event(system, &event);
+            if (system->trace != NULL) {
+                trace_instant(system->trace, TRACE_PUSH, result_status, PRIORITY_LOW, event.resource);
+            }
+            // Wait until everything left fits (or the resource is empty, if it can never all fit)
+            space_needed = system->amount_stored < system->produced.resource->max_capacity ?
+                           system->amount_stored : system->produced.resource->max_capacity;
+            system_stall(system, result_status, system->produced.resource, WAIT_SPACE, space_needed);
+        } else {
+            system->stats.stores++;
+        }
+    }
+}
+
+/**
+ * Runs a `System` on its own thread until it is terminated.
+ *
+ * Started by `manager_start_threads`.
+ *
+ * @param[in,out] system  Pointer to the `System` to run.
+ * @return                Always NULL.
+ */
+void *system_thread(void *system) {
+    System *self = (System *)system;
+
+    while (__atomic_load_n(&self->status, __ATOMIC_SEQ_CST) != TERMINATE) {
+        system_run(self);
+    }
+    // The time until now was spent in the last status it ran in, not in TERMINATE
+    system_stats_sample(&self->stats, TERMINATE);
+
+    return NULL;
+}
+
+/**
+ * Ends a system's wait on a resource.
+ *
+ * Called by the resource once the system's condition is met (with the resource's lock held), or by the
+ * manager to release a system that is being terminated.
+ *
+ * @param[in,out] system  Pointer to the waiting `System`.
+ */
+void system_wake(System *system) {
+    system->waiting_on = NULL;
+    __atomic_store_n(&system->waiting, 0, __ATOMIC_SEQ_CST);
+
+    if (system->threaded) {
+        sem_post(&system->wakeup);
+    }
+}
+
+/**
+ * Stalls a `System` until a resource can satisfy it.
+ *
+ * The system joins the resource's wait list: a threaded system blocks here until it is woken, and in the
+ * single threaded loop the system is skipped until it is woken. Resources shared with other processes can't
+ * wake anyone, so those fall back to waiting `SYSTEM_WAIT_TIME` before trying again.
+ *
+ * @param[in,out] system     Pointer to the stalled `System`.
+ * @param[in]     status     Status code of the failure (STATUS_EMPTY, STATUS_INSUFFICIENT or STATUS_CAPACITY).
+ * @param[in,out] resource   Pointer to the `Resource` the system is waiting on.
+ * @param[in]     kind       WAIT_AVAILABLE or WAIT_SPACE.
+ * @param[in]     threshold  Amount available (or free space) the system needs.
+ */
+static void system_stall(System *system, int status, Resource *resource, int kind, int threshold) {
+    system->stats.stalls[status]++;
+    system->stall_status = status;
+    // Only timed if someone looks at the time; the stall spans of a trace need the precise clock
+    if (system->trace != NULL) {
+        system->stall_start_ns = stats_now_ns();
+    } else if (system->stats.timed) {
+        system->stall_start_ns = stats_coarse_ns();
+    }
+
+    if (resource->shared) {
+        clock_sleep_ms(system->clock, SYSTEM_WAIT_TIME);
+        return;
+    }
+
+    if (!resource_wait(resource, system, kind, threshold)) {
+        // Became possible while reporting the failure, so try again straight away
+        return;
+    }
+
+    if (system->threaded) {
+        // The manager sets TERMINATE before releasing waiters, so one of the two always sees the other
+        if (__atomic_load_n(&system->status, __ATOMIC_SEQ_CST) == TERMINATE) {
+            resource_cancel_wait(resource, system);
+            return;
         }
+        sem_wait(&system->wakeup);
     }
 }
 
@@ -121,7 +249,9 @@ void system_run(System *system) {
  * @return                         `STATUS_OK` if successful, or an error status code.
  */
 static int system_convert(System *system) {
-    int status;
+    int status, crossing = STATUS_OK;
+    long long start_ns = system->trace != NULL ? stats_now_ns() : 0;
+    Handle none = {0, 0};
     Resource *consumed_resource = system->consumed.resource;
     int amount_consumed = system->consumed.amount;
 
@@ -130,16 +260,25 @@ static int system_convert(System *system) {
         status = STATUS_OK;
     } else {
         // Attempt to consume the required resources
-        if (consumed_resource->amount >= amount_consumed) {
-            consumed_resource->amount -= amount_consumed;
-            status = STATUS_OK;
-        } else {
-            status = (consumed_resource->amount == 0) ? STATUS_EMPTY : STATUS_INSUFFICIENT;
+        status = resource_consume(consumed_resource, amount_consumed, &crossing);
+        if (status == STATUS_OK) {
+            system->stats.consumed_total += amount_consumed;
+        }
+        system_report_watermark(system, consumed_resource, crossing);
+        if (system->trace != NULL) {
+            trace_span(system->trace, TRACE_CONVERT, start_ns, status, amount_consumed, consumed_resource->handle);
         }
     }
 
     if (status == STATUS_OK) {
+        if (system->trace != NULL) {
+            start_ns = stats_now_ns();
+        }
         system_simulate_process_time(system);
+        if (system->trace != NULL) {
+            trace_span(system->trace, TRACE_PROCESS, start_ns, STATUS_OK, system->produced.amount,
+                       system->produced.resource != NULL ? system->produced.resource->handle : none);
+        }
 
         if (system->produced.resource != NULL) {
             system->amount_stored += system->produced.amount;
@@ -162,6 +301,7 @@ static int system_convert(System *system) {
  */
 static void system_simulate_process_time(System *system) {
     int adjusted_processing_time;
+    double time_scale;
 
     // Adjust based on the current system status modifier
     switch (system->status) {
@@ -175,8 +315,14 @@ static void system_simulate_process_time(System *system) {
             adjusted_processing_time = system->processing_time;
     }
 
+    // The rate controller's multiplier applies on top of the status
+    __atomic_load(&system->time_scale, &time_scale, __ATOMIC_RELAXED);
+    if (time_scale != 1.0) {
+        adjusted_processing_time = (int)(adjusted_processing_time * time_scale + 0.5);
+    }
+
     // Sleep for the required time
-    usleep(adjusted_processing_time * 1000);
+    clock_sleep_ms(system->clock, adjusted_processing_time);
 }
 
 /**
@@ -192,7 +338,8 @@ static void system_simulate_process_time(System *system) {
  */
 static int system_store_resources(System *system) {
     Resource *produced_resource = system->produced.resource;
-    int available_space, amount_to_store;
+    int amount_stored, crossing;
+    long long start_ns;
 
     // We can always proceed if there's nothing to store
     if (produced_resource == NULL || system->amount_stored == 0) {
@@ -200,20 +347,16 @@ static int system_store_resources(System *system) {
         return STATUS_OK;
     }
 
-    amount_to_store = system->amount_stored;
-
-    // Calculate available space
-    available_space = produced_resource->max_capacity - produced_resource->amount;
-
-    if (available_space >= amount_to_store) {
-        // Store all produced resources
-        produced_resource->amount += amount_to_store;
-        system->amount_stored = 0;
-    } else if (available_space > 0) {
-        // Store as much as possible
-        produced_resource->amount += available_space;
-        system->amount_stored = amount_to_store - available_space;
+    // Store as much as possible, keeping whatever doesn't fit for the next attempt
+    start_ns = system->trace != NULL ? stats_now_ns() : 0;
+    amount_stored = resource_store(produced_resource, system->amount_stored, &crossing);
+    if (system->trace != NULL) {
+        trace_span(system->trace, TRACE_STORE, start_ns, amount_stored == system->amount_stored ? STATUS_OK : STATUS_CAPACITY,
+                   amount_stored, produced_resource->handle);
     }
+    system->amount_stored -= amount_stored;
+    system->stats.produced_total += amount_stored;
+    system_report_watermark(system, produced_resource, crossing);
 
     if (system->amount_stored != 0) {
         return STATUS_CAPACITY;
@@ -222,72 +365,46 @@ static int system_store_resources(System *system) {
     return STATUS_OK;
 }
 
-
 /**
- * Initializes the `SystemArray`.
+ * Tells the manager that a resource crossed one of its watermarks.
  *
- * Allocates memory for the array of `System*` pointers of capacity 1 and sets up initial values.
+ * Only the system whose change made the crossing reports it, once per crossing, so these events are rare
+ * and go out at PRIORITY_MED: ahead of store failures, behind systems that have already run dry.
  *
- * @param[out] array  Pointer to the `SystemArray` to initialize.
+ * @param[in] system    Pointer to the `System` that changed the resource.
+ * @param[in] resource  Pointer to the `Resource` it changed.
+ * @param[in] crossing  Level reported by `resource_consume` or `resource_store`, or `STATUS_OK` for none.
  */
-void system_array_init(SystemArray *array) {
-    //Initialize array capacity and size
-    array->capacity = 1;
-    array->size = 0;
-
-    //Initialize systems array
-    array->systems = (System **) malloc(array->capacity * sizeof(System *));
-    if(array->systems == NULL){
-        printf("Failed to allocate memory for systems");
+static void system_report_watermark(System *system, Resource *resource, int crossing) {
+    Event event;
+
+    if (crossing == STATUS_OK) {
         return;
     }
-}
 
-/**
- * Cleans up the `SystemArray` by destroying all systems and freeing memory.
- *
- * Iterates through the array, cleaning any memory for each System pointed to by the array.
- *
- * @param[in,out] array  Pointer to the `SystemArray` to clean.
- */
-void system_array_clean(SystemArray *array) {
-    if(array != NULL){
-        for(int i = 0; i < array->size; i++){
-            if(array->systems[i] != NULL){
-                system_destroy(array->systems[i]);
-            }
-        }
-        free(array->systems);
+    event_init(&event, system, resource, crossing, PRIORITY_MED, __atomic_load_n(&resource->amount, __ATOMIC_RELAXED));
+    system_push_event(system, &event);
+    if (system->trace != NULL) {
+        trace_instant(system->trace, TRACE_PUSH, crossing, PRIORITY_MED, event.resource);
     }
 }
 
-
 /**
- * Adds a `System` to the `SystemArray`, resizing if necessary (doubling the size).
+ * Reports an event to the manager.
  *
- * Resizes the array when the capacity is reached and adds the new `System`.
- * Use of realloc is NOT permitted.
+ * While the manager runs workers the event goes to the worker handling its resource, otherwise to the
+ * system's `event_queue`.
  *
- * @param[in,out] array   Pointer to the `SystemArray`.
- * @param[in]     system  Pointer to the `System` to add.
+ * @param[in,out] system  Pointer to the `System` reporting.
+ * @param[in]     event   Pointer to the `Event` to report.
  */
-void system_array_add(SystemArray *array, System *system) {
-    //Resizes array if necessary
-    if(array->size == array->capacity){
-        array->capacity *= 2;
-
-        System **temp = (System **)malloc(array->capacity * sizeof(System *));
-        if(temp == NULL){
-            printf("Failed to resize system array");
-            return;
-        }
+static void system_push_event(System *system, const Event *event) {
+    Dispatcher *dispatcher = __atomic_load_n(&system->dispatcher, __ATOMIC_ACQUIRE);
 
-        memcpy(temp, array->systems, array->size * sizeof(System *));
-        free(array->systems);
-        array->systems = temp;
+    if (dispatcher != NULL) {
+        dispatch_push(dispatcher, event);
+        return;
     }
 
-    //Adds the system into the array
-    array->systems[array->size] = system;
-    array->size++;
-}
\ No newline at end of file
+    event_queue_push(system->event_queue, event);
+}
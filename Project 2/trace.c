@@ -0,0 +1,418 @@
+#include "defs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Helper functions just used by this C file
+static TraceRecord *trace_append(TraceBuffer *buffer);
+static int trace_next_chunk(TraceBuffer *buffer);
+static const char *trace_type_name(int type);
+static const char *trace_status_name(int status);
+static const char *trace_resource_name(const Manager *manager, Handle resource);
+static void trace_write_string(FILE *stream, const char *string);
+static void trace_write_record(const Manager *manager, const TraceBuffer *buffer, const TraceRecord *record, FILE *stream);
+
+/**
+ * Initializes a `Tracer` that records nothing.
+ *
+ * While tracing is off no buffers exist, so every place that records only pays for checking a NULL pointer.
+ *
+ * @param[out] tracer  Pointer to the `Tracer` to initialize.
+ */
+void trace_init(Tracer *tracer) {
+    tracer->enabled = 0;
+    tracer->start_ns = 0;
+    tracer->max_chunks = 0;
+    tracer->chunk_count = 0;
+    tracer->buffers = NULL;
+    tracer->buffer_count = 0;
+    tracer->buffer_capacity = 0;
+}
+
+/**
+ * Frees every buffer of a `Tracer`.
+ *
+ * @param[in,out] tracer  Pointer to the `Tracer` to clean.
+ */
+void trace_clean(Tracer *tracer) {
+    TraceChunk *chunk, *next;
+
+    for (int i = 0; i < tracer->buffer_count; i++) {
+        for (chunk = tracer->buffers[i]->head; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+        free(tracer->buffers[i]);
+    }
+    free(tracer->buffers);
+    trace_init(tracer);
+}
+
+/**
+ * Starts tracing a manager and its systems.
+ *
+ * The manager gets buffer (track) 0 and every system a buffer of its own; systems added later get theirs
+ * from `manager_add_system`. Once the buffers together hold `budget_mb`, each buffer that fills up reuses
+ * its own oldest chunk, so a long run keeps its most recent records. A budget too small to give every
+ * buffer a chunk drops the records of the buffers left without one.
+ *
+ * The cost when recording is an append to a chunk owned by the recording thread, with an allocation (or
+ * reuse) every TRACE_CHUNK_RECORDS records: cheap enough to leave on for minutes of a thousand-system run.
+ *
+ * @param[in,out] manager    Pointer to the `Manager` to trace.
+ * @param[in]     budget_mb  Memory the buffers may use, in megabytes.
+ * @return                   Non-zero if tracing started; zero if memory ran out.
+ */
+int trace_enable(Manager *manager, int budget_mb) {
+    Tracer *tracer = &manager->tracer;
+    System *system = NULL;
+
+    tracer->start_ns = stats_now_ns();
+    tracer->max_chunks = (int)((long long)budget_mb * 1024 * 1024 / sizeof(TraceChunk));
+    if (tracer->max_chunks < 1) {
+        tracer->max_chunks = 1;
+    }
+
+    if (trace_add_buffer(tracer, "Manager") == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < manager->systems.size; i++) {
+        system = manager->systems.items[i];
+        system->trace = trace_add_buffer(tracer, system->name);
+        if (system->trace == NULL) {
+            return 0;
+        }
+    }
+
+    tracer->enabled = 1;
+    return 1;
+}
+
+/**
+ * Adds a buffer for one writer to a `Tracer`.
+ *
+ * Only the manager's thread may add buffers.
+ *
+ * @param[in,out] tracer  Pointer to the `Tracer`.
+ * @param[in]     name    Name of the track in the trace (the string is copied).
+ * @return                The new buffer, or NULL if memory ran out.
+ */
+TraceBuffer *trace_add_buffer(Tracer *tracer, const char *name) {
+    TraceBuffer *buffer;
+    TraceBuffer **buffers;
+    int capacity;
+
+    // Use of realloc is NOT permitted, so the list is copied into a new allocation when it is full
+    if (tracer->buffer_count == tracer->buffer_capacity) {
+        capacity = tracer->buffer_capacity > 0 ? tracer->buffer_capacity * 2 : 8;
+        buffers = (TraceBuffer **)malloc(capacity * sizeof(TraceBuffer *));
+        if (buffers == NULL) {
+            printf("Failed to allocate memory for trace buffers\n");
+            return NULL;
+        }
+        if (tracer->buffer_count > 0) {
+            memcpy(buffers, tracer->buffers, tracer->buffer_count * sizeof(TraceBuffer *));
+        }
+        free(tracer->buffers);
+        tracer->buffers = buffers;
+        tracer->buffer_capacity = capacity;
+    }
+
+    buffer = (TraceBuffer *)malloc(sizeof(TraceBuffer));
+    if (buffer == NULL) {
+        printf("Failed to allocate memory for trace buffer\n");
+        return NULL;
+    }
+
+    buffer->tracer = tracer;
+    strncpy(buffer->name, name, TRACE_NAME_LENGTH - 1);
+    buffer->name[TRACE_NAME_LENGTH - 1] = '\0';
+    buffer->track = tracer->buffer_count;
+    buffer->head = NULL;
+    buffer->tail = NULL;
+    buffer->used = 0;
+    buffer->overwritten = 0;
+    buffer->dropped = 0;
+
+    tracer->buffers[tracer->buffer_count++] = buffer;
+    return buffer;
+}
+
+/**
+ * Records a span that started at `start_ns` and ends now.
+ *
+ * Only the buffer's writer may call this.
+ *
+ * @param[in,out] buffer    Pointer to the writer's `TraceBuffer`.
+ * @param[in]     type      TRACE_CONVERT, TRACE_PROCESS, TRACE_STORE or TRACE_STALL.
+ * @param[in]     start_ns  When the span started, from `stats_now_ns`.
+ * @param[in]     status    STATUS_* outcome of the span.
+ * @param[in]     value     Amount involved.
+ * @param[in]     resource  Resource involved, or an invalid handle.
+ */
+void trace_span(TraceBuffer *buffer, int type, long long start_ns, int status, int value, Handle resource) {
+    TraceRecord *record = trace_append(buffer);
+
+    if (record != NULL) {
+        record->start_ns = start_ns;
+        record->duration_ns = stats_now_ns() - start_ns;
+        record->resource = resource;
+        record->type = type;
+        record->status = status;
+        record->value = value;
+    }
+}
+
+/**
+ * Records something that happened now.
+ *
+ * Only the buffer's writer may call this.
+ *
+ * @param[in,out] buffer    Pointer to the writer's `TraceBuffer`.
+ * @param[in]     type      TRACE_PUSH, TRACE_POP or TRACE_STATUS.
+ * @param[in]     status    STATUS_* code of the event, or the new status for TRACE_STATUS.
+ * @param[in]     value     Priority of the event, or the track of the system for TRACE_STATUS.
+ * @param[in]     resource  Resource involved, or an invalid handle.
+ */
+void trace_instant(TraceBuffer *buffer, int type, int status, int value, Handle resource) {
+    TraceRecord *record = trace_append(buffer);
+
+    if (record != NULL) {
+        record->start_ns = stats_now_ns();
+        record->duration_ns = -1;
+        record->resource = resource;
+        record->type = type;
+        record->status = status;
+        record->value = value;
+    }
+}
+
+/**
+ * Writes every buffer as Chrome Trace Event JSON.
+ *
+ * The file opens in chrome://tracing and in the Perfetto UI. Each system is a thread of its own, with its
+ * phases and stalls as spans and the events it pushed as instants; the manager's thread has the events it
+ * popped. Status changes are instants on the system's thread and also a counter per system, so a run that
+ * keeps switching between SLOW and FAST shows up as a square wave. Call once every writer has stopped.
+ *
+ * @param[in] manager  Pointer to the traced `Manager`, used to name resources.
+ * @param[in] stream   Stream to write to.
+ * @return           Non-zero if tracing was enabled and the trace was written; zero otherwise.
+ */
+int trace_write(const Manager *manager, FILE *stream) {
+    const Tracer *tracer = &manager->tracer;
+    const TraceBuffer *buffer = NULL;
+    const TraceChunk *chunk = NULL;
+    long long records = 0, overwritten = 0, dropped = 0;
+    int i, count;
+
+    if (!tracer->enabled) {
+        return 0;
+    }
+
+    fprintf(stream, "{\"traceEvents\":[\n");
+    for (i = 0; i < tracer->buffer_count; i++) {
+        buffer = tracer->buffers[i];
+        fprintf(stream, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", i == 0 ? "" : ",\n", buffer->track);
+        trace_write_string(stream, buffer->name);
+        fprintf(stream, "}},\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+                buffer->track, buffer->track);
+    }
+
+    for (i = 0; i < tracer->buffer_count; i++) {
+        buffer = tracer->buffers[i];
+        for (chunk = buffer->head; chunk != NULL; chunk = chunk->next) {
+            count = chunk == buffer->tail ? buffer->used : TRACE_CHUNK_RECORDS;
+            for (int j = 0; j < count; j++) {
+                trace_write_record(manager, buffer, &chunk->records[j], stream);
+            }
+            records += count;
+        }
+        overwritten += buffer->overwritten;
+        dropped += buffer->dropped;
+    }
+
+    fprintf(stream, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"records\":%lld,\"overwritten\":%lld,\"dropped\":%lld}}\n",
+            records, overwritten, dropped);
+    return 1;
+}
+
+/**
+ * Writes one record as one or two trace events, each preceded by a separating comma.
+ *
+ * @param[in] manager  Pointer to the traced `Manager`.
+ * @param[in] buffer   Pointer to the `TraceBuffer` holding the record.
+ * @param[in] record   Pointer to the `TraceRecord` to write.
+ * @param[in] stream   Stream to write to.
+ */
+static void trace_write_record(const Manager *manager, const TraceBuffer *buffer, const TraceRecord *record, FILE *stream) {
+    const Tracer *tracer = &manager->tracer;
+    double ts = (record->start_ns - tracer->start_ns) / 1000.0;
+    const TraceBuffer *target = NULL;
+
+    if (record->type == TRACE_STATUS) {
+        if (record->value < 0 || record->value >= tracer->buffer_count) {
+            return;
+        }
+        target = tracer->buffers[record->value];
+        fprintf(stream, ",\n{\"name\":\"%s\",\"cat\":\"status\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                stats_status_name(record->status), target->track, ts);
+        fprintf(stream, ",\n{\"name\":");
+        trace_write_string(stream, target->name);
+        fprintf(stream, ",\"cat\":\"status\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"status\":%d}}", ts, record->status);
+        return;
+    }
+
+    if (record->duration_ns >= 0) {
+        fprintf(stream, ",\n{\"name\":\"%s\",\"cat\":\"system\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"status\":\"%s\",\"amount\":%d,\"resource\":",
+                trace_type_name(record->type), buffer->track, ts, record->duration_ns / 1000.0,
+                trace_status_name(record->status), record->value);
+    } else {
+        fprintf(stream, ",\n{\"name\":\"%s\",\"cat\":\"event\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                "\"args\":{\"status\":\"%s\",\"priority\":%d,\"resource\":",
+                trace_type_name(record->type), buffer->track, ts, trace_status_name(record->status), record->value);
+    }
+    trace_write_string(stream, trace_resource_name(manager, record->resource));
+    fprintf(stream, "}}");
+}
+
+/**
+ * Returns the place for the next record of a buffer.
+ *
+ * @param[in,out] buffer  Pointer to the `TraceBuffer`.
+ * @return                The record to fill in, or NULL if there was no memory for it.
+ */
+static TraceRecord *trace_append(TraceBuffer *buffer) {
+    if ((buffer->tail == NULL || buffer->used == TRACE_CHUNK_RECORDS) && !trace_next_chunk(buffer)) {
+        buffer->dropped++;
+        return NULL;
+    }
+
+    return &buffer->tail->records[buffer->used++];
+}
+
+/**
+ * Gives a buffer an empty chunk to write to.
+ *
+ * A new chunk is allocated while the tracer is within its budget; after that the buffer's oldest chunk
+ * is emptied and reused.
+ *
+ * @param[in,out] buffer  Pointer to the `TraceBuffer` whose last chunk is full.
+ * @return                Non-zero if the buffer has room again; zero if it has no chunk to reuse.
+ */
+static int trace_next_chunk(TraceBuffer *buffer) {
+    Tracer *tracer = buffer->tracer;
+    TraceChunk *chunk = NULL;
+
+    if (__atomic_add_fetch(&tracer->chunk_count, 1, __ATOMIC_RELAXED) <= tracer->max_chunks) {
+        chunk = (TraceChunk *)malloc(sizeof(TraceChunk));
+    }
+    if (chunk == NULL) {
+        __atomic_sub_fetch(&tracer->chunk_count, 1, __ATOMIC_RELAXED);
+
+        if (buffer->head == NULL) {
+            return 0;
+        }
+        chunk = buffer->head;
+        buffer->head = chunk->next;
+        if (buffer->head == NULL) {
+            buffer->tail = NULL;
+        }
+        buffer->overwritten += TRACE_CHUNK_RECORDS;
+    }
+
+    chunk->next = NULL;
+    if (buffer->tail != NULL) {
+        buffer->tail->next = chunk;
+    } else {
+        buffer->head = chunk;
+    }
+    buffer->tail = chunk;
+    buffer->used = 0;
+    return 1;
+}
+
+/**
+ * Returns the name of a record type.
+ *
+ * @param[in] type  TRACE_* code.
+ * @return          Name used for the trace event.
+ */
+static const char *trace_type_name(int type) {
+    switch (type) {
+        case TRACE_CONVERT:
+            return "convert";
+        case TRACE_PROCESS:
+            return "process";
+        case TRACE_STORE:
+            return "store";
+        case TRACE_STALL:
+            return "stall";
+        case TRACE_PUSH:
+            return "push";
+        case TRACE_POP:
+            return "pop";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Returns a short name for a resource status.
+ *
+ * @param[in] status  STATUS_* code.
+ * @return            Name of the status.
+ */
+static const char *trace_status_name(int status) {
+    switch (status) {
+        case STATUS_OK:
+            return "ok";
+        case STATUS_EMPTY:
+            return "empty";
+        case STATUS_LOW:
+            return "low";
+        case STATUS_INSUFFICIENT:
+            return "insufficient";
+        case STATUS_CAPACITY:
+            return "capacity";
+        case STATUS_HIGH:
+            return "high";
+        case STATUS_NORMAL:
+            return "normal";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Returns the name of the resource a record refers to.
+ *
+ * @param[in] manager   Pointer to the traced `Manager`.
+ * @param[in] resource  Handle from the record.
+ * @return              Name of the resource, or "" if there is none or it has since been removed.
+ */
+static const char *trace_resource_name(const Manager *manager, Handle resource) {
+    const Resource *found = slot_map_get(&manager->resources, resource);
+    return found != NULL ? found->name : "";
+}
+
+/**
+ * Writes a string as a JSON string literal.
+ *
+ * @param[in] stream  Stream to write to.
+ * @param[in] string  String to write.
+ */
+static void trace_write_string(FILE *stream, const char *string) {
+    fputc('"', stream);
+    for (; *string != '\0'; string++) {
+        if (*string == '"' || *string == '\\') {
+            fprintf(stream, "\\%c", *string);
+        } else if ((unsigned char)*string < 0x20) {
+            fprintf(stream, "\\u%04x", (unsigned char)*string);
+        } else {
+            fputc(*string, stream);
+        }
+    }
+    fputc('"', stream);
+}